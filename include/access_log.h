@@ -0,0 +1,31 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include "access_log_format.h"
+
+using namespace std;
+
+// Binary access log: fixed-layout records appended through a large
+// in-memory buffer into size-limited segment files.
+
+// AccessMethod code of a request method
+uint8_t method_code(const string &method);
+
+bool init_access_log(const string &directory, size_t segment_size);
+bool access_log_enabled();
+
+void log_access(const string &client_ip, int client_port,
+                const string &method, const string &host, int port,
+                AccessOutcome outcome, int status,
+                size_t bytes, uint32_t duration_ms);
+
+// Writes buffered records if the last flush is older than a second
+void flush_access_log_if_stale();
+
+void flush_access_log();
+
+#endif
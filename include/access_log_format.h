@@ -0,0 +1,94 @@
+#ifndef ACCESS_LOG_FORMAT_H
+#define ACCESS_LOG_FORMAT_H
+
+#include <cstdint>
+
+// On-disk layout of binary access log segments, shared by the proxy and
+// the logquery tool. A segment is a SegmentHeader followed by records.
+// Host names are interned per segment: a HostRecord defines an id before
+// the first AccessRecord that uses it, so every segment can be read on
+// its own. All integers are little-endian (native on supported hosts).
+
+static const char ACCESS_LOG_MAGIC[4] = {'P', 'X', 'A', 'L'};
+static const uint32_t ACCESS_LOG_VERSION = 1;
+
+enum AccessRecordType : uint8_t
+{
+    RECORD_HOST = 1,
+    RECORD_ACCESS = 2
+};
+
+enum AccessOutcome : uint8_t
+{
+    OUTCOME_ALLOWED = 0,
+    OUTCOME_BLOCKED = 1,
+    OUTCOME_RATE_LIMITED = 2,
+    OUTCOME_UNAVAILABLE = 3 // reverse proxy: no pool or no usable backend
+};
+
+enum AccessMethod : uint8_t
+{
+    METHOD_OTHER = 0,
+    METHOD_GET,
+    METHOD_POST,
+    METHOD_PUT,
+    METHOD_DELETE,
+    METHOD_HEAD,
+    METHOD_CONNECT,
+    METHOD_OPTIONS,
+    METHOD_PATCH
+};
+
+#pragma pack(push, 1)
+
+struct SegmentHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t created_unix;
+};
+
+// Followed by name_length bytes of host name
+struct HostRecord
+{
+    uint8_t type; // RECORD_HOST
+    uint8_t name_length;
+    uint32_t host_id;
+};
+
+struct AccessRecord
+{
+    uint8_t type; // RECORD_ACCESS
+    uint8_t outcome;
+    uint8_t method;
+    uint8_t reserved;
+    uint32_t host_id;
+    uint64_t timestamp_us; // wall clock, microseconds since the epoch
+    uint32_t client_ip;    // network byte order
+    uint16_t client_port;
+    uint16_t port;
+    uint16_t status;
+    uint16_t reserved2;
+    uint64_t bytes;
+    uint32_t duration_ms;
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(AccessRecord) == 40, "AccessRecord layout changed");
+
+inline const char *method_name(uint8_t method)
+{
+    static const char *names[] = {"OTHER", "GET", "POST", "PUT", "DELETE",
+                                  "HEAD", "CONNECT", "OPTIONS", "PATCH"};
+    return method <= METHOD_PATCH ? names[method] : "OTHER";
+}
+
+inline const char *outcome_name(uint8_t outcome)
+{
+    static const char *names[] = {"ALLOWED", "BLOCKED", "RATE_LIMITED",
+                                  "UNAVAILABLE"};
+    return outcome <= OUTCOME_UNAVAILABLE ? names[outcome] : "UNKNOWN";
+}
+
+#endif
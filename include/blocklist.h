@@ -2,14 +2,22 @@
 #define BLOCKLIST_H
 
 #include <string>
-#include <set>
 
 using namespace std;
 
-// Load blocked sites from file
+// Blocklist rules, one per line:
+//   example.com            the host and all of its subdomains
+//   *.ads.example.*        host glob (* and ?), matched against the whole host
+//   example.com/private    host (or host glob) plus a path prefix
+//   */tracking/            path prefix on any host
+//   ~banner                substring of the host or the path
+// All rules are compiled into one Aho-Corasick automaton, so a request is
+// checked against the whole set in a single pass over host and path.
+
+// Load (or reload) rules from file; the previous set stays active on error
 bool load_blocklist(const string &filename);
 
-// Check if a host is blocked
-bool is_blocked(const string &host);
+// Check a request; on a match, rule is set to the matching rule's text
+bool is_blocked(const string &host, const string &path, string &rule);
 
 #endif
@@ -0,0 +1,29 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include "access_log_format.h"
+#include "capture_format.h"
+
+using namespace std;
+
+// Traffic capture: per-request shape and timing (no payloads) appended to
+// a file that the replay tool turns back into the same workload.
+
+// Opens (or appends to) the capture file
+bool init_capture(const string &path);
+bool capture_enabled();
+
+// accepted_us is the trace clock when the connection was accepted
+void capture_request(uint64_t accepted_us, const string &method,
+                     const string &host, int port,
+                     AccessOutcome outcome, int status,
+                     size_t header_bytes, size_t request_bytes,
+                     size_t response_bytes, uint64_t first_byte_us);
+
+void flush_capture();
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef CAPTURE_FORMAT_H
+#define CAPTURE_FORMAT_H
+
+#include <cstdint>
+
+// On-disk layout of traffic capture files, shared by the proxy and the
+// replay tool. A file is a CaptureHeader followed by CaptureRecords, each
+// followed by host_length bytes of host name. Records are appended as
+// requests finish, so they are ordered by end time, not start time.
+// Integers are little-endian (native on supported hosts).
+
+static const char CAPTURE_MAGIC[4] = {'P', 'X', 'C', 'P'};
+static const uint32_t CAPTURE_VERSION = 1;
+
+#pragma pack(push, 1)
+
+struct CaptureHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t start_unix_us; // record offsets are relative to this
+};
+
+struct CaptureRecord
+{
+    uint64_t start_us;       // connection accepted, since start_unix_us
+    uint64_t request_bytes;  // body (HTTP) or client -> origin (CONNECT)
+    uint64_t response_bytes; // origin -> client
+    uint32_t header_bytes;   // request line and headers as received
+    uint32_t first_byte_us;  // request sent -> first response byte
+    uint32_t duration_us;    // accepted -> connection closed
+    uint16_t port;
+    uint16_t status;
+    uint8_t method;  // AccessMethod
+    uint8_t outcome; // AccessOutcome
+    uint8_t host_length;
+    uint8_t reserved;
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(CaptureRecord) == 44, "CaptureRecord layout changed");
+
+#endif
@@ -3,6 +3,9 @@
 
 #include "task.h"
 
-void handle_client(const Task &task);
+#include <cstddef>
+
+// Serves one connection; returns the bytes relayed
+size_t handle_client(const Task &task);
 
 #endif
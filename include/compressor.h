@@ -0,0 +1,75 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <zlib.h>
+
+#include "memory_budget.h"
+
+using namespace std;
+
+struct CompressionSettings
+{
+    bool enabled = false;
+    int level = 6;            // zlib level 1-9
+    size_t min_size = 1024;   // skip responses with a smaller Content-Length
+    vector<string> types;     // Content-Type prefixes eligible for compression
+};
+
+void set_compression(const CompressionSettings &settings);
+
+// Streaming gzip/deflate stage for one HTTP response. Origin bytes go in,
+// client bytes come out: headers are buffered until complete, then either
+// rewritten for compression or passed through untouched.
+class ResponseCompressor
+{
+public:
+    // Responses to HEAD carry no body, so they are never compressed
+    ResponseCompressor(const string &method, const string &accept_encoding);
+    ~ResponseCompressor();
+
+    ResponseCompressor(const ResponseCompressor &) = delete;
+    ResponseCompressor &operator=(const ResponseCompressor &) = delete;
+
+    // False if the client accepts no supported encoding or compression is off
+    bool enabled() const { return encoding != NONE; }
+
+    // Replaces out with the bytes to send for this chunk of origin data
+    bool feed(const char *data, size_t len, string &out);
+
+    // Origin finished: replaces out with any remaining bytes
+    bool finish(string &out);
+
+private:
+    enum Encoding
+    {
+        NONE,
+        GZIP,
+        DEFLATE
+    };
+
+    bool start_body(string &out);
+    bool deflate_into(const char *data, size_t len, int flush, string &out);
+
+    Encoding encoding = NONE;
+    int level = 6;
+    size_t min_size = 1024;
+    vector<string> types;
+
+    string headers;
+    bool headers_done = false;
+    bool compressing = false;
+
+    z_stream stream{};
+    bool stream_ready = false;
+    MemoryCharge memory{MEM_COMPRESSION};
+
+    size_t bytes_in = 0;
+    size_t bytes_out = 0;
+    uint64_t cpu_us = 0;
+};
+
+#endif
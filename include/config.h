@@ -10,18 +10,111 @@ struct RuntimeConfig
     int listen_port = 8080;
     int thread_pool_size = 4;
 
-    size_t buffer_size = 4096;
+    bool autoscale = false; // size the pool from observed queue wait
+    int min_threads = 2;
+    int max_threads = 64;
+    int autoscale_target_wait_ms = 20;
+
+    int max_connections_per_client = 0; // 0 = unlimited
+    double fair_quantum_ms = 10;        // fair scheduling credit per round
+
+    // Prefork: a supervisor runs this many worker processes, each with
+    // its own thread pool (0 = single process). With reuseport each
+    // worker binds its own SO_REUSEPORT socket instead of sharing one.
+    int worker_processes = 0;
+    bool reuseport = false;
+
+    std::string worker_cpus;         // e.g. "0-3,8-11"; empty = no pinning
+    bool steer_incoming_cpu = false; // prefer workers on the receiving CPU
+
+    size_t buffer_size = 4096;     // initial relay buffer per connection
+    size_t max_buffer_size = 262144;
+    bool adaptive_buffers = true;
+
+    bool tcp_nodelay = true;
+    int so_sndbuf = 0; // 0 = kernel default
+    int so_rcvbuf = 0;
+    int tcp_notsent_lowat = 0;
+    bool tcp_quickack = false;
+    int tcp_fastopen = 0; // TFO queue length, 0 = disabled
     int default_http_port = 80;
 
+    // Headers added to forwarded HTTP requests
+    bool add_via_header = true;
+    bool add_x_forwarded_for = false;
+
     std::string log_file = "config/logs/proxy.log";
     size_t max_log_size = 5 * 1024 * 1024;
 
+    // Access log format: text, binary or both
+    std::string access_log_format = "text";
+    std::string access_log_dir = "config/logs/access";
+    size_t access_log_segment_size = 64 * 1024 * 1024;
+
+    // Traffic capture for ./replay (empty = off)
+    std::string capture_file;
+
+    // HTTP/2 from clients (prior knowledge or Upgrade: h2c)
+    bool http2 = false;
+    int h2_max_concurrent_streams = 100;
+    int h2_initial_window_size = 65535; // per-stream receive window
+
+    // Reverse-proxy mode: Host selects a backend pool from upstreams_file
+    bool reverse_proxy = false;
+    std::string upstreams_file = "config/upstreams.conf";
+    std::string lb_policy = "least_conn"; // least_conn | p2c_ewma
+    int health_check_interval = 5;        // seconds, 0 = off
+    int health_check_timeout_ms = 1000;
+    std::string health_check_path = "/";  // empty = TCP connect only
+    int outlier_failures = 5;             // consecutive, 0 = never eject
+    int outlier_ejection_sec = 30;
+
     std::string blocklist_file = "config/blocked_sites.txt";
-    int socket_timeout = 5; // seconds
+    int socket_timeout = 5; // seconds, per blocking socket operation
+
+    // Connection deadlines in seconds (0 = disabled)
+    int header_timeout = 10;
+    int idle_timeout = 300;
+    int max_connection_lifetime = 3600;
+
+    // Seconds to let in-flight connections finish on shutdown or upgrade
+    int drain_timeout = 30;
 
     std::string metrics_file = "config/metrics.txt";
+    size_t metrics_max_hosts = 1000; // distinct hosts kept for top_hosts
+
+    // Memory held for connections, queues and counters (0 = unlimited).
+    // Reads pause above memory_pause_percent; new connections get 503
+    // once the budget is reached.
+    size_t memory_budget_mb = 0;
+    int memory_pause_percent = 80;
+
+    // On-the-fly response compression
+    bool compression = false;
+    int compression_level = 6;
+    size_t compression_min_size = 1024;
+    std::string compression_types =
+        "text/,application/json,application/javascript,application/xml,image/svg+xml";
+
+    // Per-client-IP limits (0 = unlimited)
+    double rate_limit_bytes_per_sec = 0;
+    double rate_limit_burst_bytes = 1048576;
+    double rate_limit_requests_per_sec = 0;
+    double rate_limit_burst_requests = 20;
+    int rate_limit_max_wait_ms = 2000;
+    int rate_limit_idle_evict_sec = 60;
+
+    double trace_sample_rate = 0.0; // fraction of requests traced
+    size_t trace_buffer_spans = 4096; // per worker thread
+    std::string trace_file = "config/trace.json";
 };
 
 bool load_config(const std::string &path, RuntimeConfig &cfg);
 
+// Re-reads the file last passed to load_config() into a fresh config
+bool reload_config(RuntimeConfig &cfg);
+
+// Publishes the values read by worker threads on every request
+void publish_runtime_config(const RuntimeConfig &cfg);
+
 #endif
@@ -0,0 +1,29 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <vector>
+#include <cstddef>
+
+using namespace std;
+
+// Worker placement. Workers can be pinned to a list of CPUs (worker i
+// runs on cpus[i % cpus.size()]), and accepted connections can be tagged
+// with the CPU that received them so a worker on that CPU prefers them.
+
+struct AffinitySettings
+{
+    vector<int> cpus;                // empty = workers float
+    bool steer_incoming_cpu = false; // tag connections with SO_INCOMING_CPU
+};
+
+void set_affinity(const AffinitySettings &settings);
+
+// Called by worker `index` before each task; re-pins the calling thread
+// when the settings changed. Returns the CPU it is pinned to, or -1.
+int apply_worker_affinity(size_t index);
+
+// CPU that processed the connection's incoming packets, or -1 when
+// steering is disabled or the kernel does not report it
+int incoming_cpu(int fd);
+
+#endif
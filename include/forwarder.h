@@ -2,9 +2,34 @@
 #define FORWARDER_H
 
 #include "http_parser.h"
+#include <netinet/in.h>
 #include <cstddef>
+#include <cstdint>
 
-size_t forward_tcp(int client_fd, const HttpRequest &req);
-size_t tunnel_tcp(int client_fd, const HttpRequest &req);
+// Fixed origin for a reverse-proxy request; the outcome is filled in
+struct UpstreamTarget
+{
+    sockaddr_in addr{};
+    bool responded = false;     // at least one response byte arrived
+    uint64_t first_byte_us = 0; // request sent -> first response byte
+};
+
+// Bytes relayed in each direction, filled in for logging and capture
+struct RelayStats
+{
+    size_t request_bytes = 0;   // body (HTTP) or client -> origin (CONNECT)
+    size_t response_bytes = 0;  // origin -> client
+    uint64_t first_byte_us = 0; // request sent -> first response byte
+
+    size_t total() const { return request_bytes + response_bytes; }
+};
+
+// Without a target the origin is resolved from req.host
+size_t forward_tcp(int client_fd, const HttpRequest &req,
+                   const string &client_ip,
+                   UpstreamTarget *target = nullptr,
+                   RelayStats *stats = nullptr);
+size_t tunnel_tcp(int client_fd, const HttpRequest &req,
+                  RelayStats *stats = nullptr);
 
 #endif
@@ -0,0 +1,50 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// HPACK header compression for HTTP/2 (RFC 7541)
+
+struct HeaderField
+{
+    string name;
+    string value;
+};
+
+// Per-connection decoding state: the dynamic table the peer's encoder
+// maintains. Header blocks must be decoded in the order they arrive.
+class HpackDecoder
+{
+public:
+    // max_table_size is the SETTINGS_HEADER_TABLE_SIZE we advertised
+    explicit HpackDecoder(size_t max_table_size = 4096);
+
+    // Decodes one complete header block; false on a compression error,
+    // after which the connection cannot continue
+    bool decode(const uint8_t *data, size_t len, vector<HeaderField> &headers);
+
+private:
+    bool lookup(uint64_t index, HeaderField &field) const;
+    void insert(const HeaderField &field);
+    void evict(size_t limit);
+
+    deque<HeaderField> table; // newest first
+    size_t table_size = 0;    // RFC 7541 size: name + value + 32 per entry
+    size_t max_size;
+    size_t settings_limit;
+};
+
+// Encodes without the dynamic table: static table references where
+// possible, otherwise literals that the peer does not index
+void hpack_encode(const vector<HeaderField> &headers, string &out);
+
+// Decodes a Huffman-coded string literal; false if malformed
+bool huffman_decode(const uint8_t *data, size_t len, string &out);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include "http_parser.h"
+#include "task.h"
+
+#include <cstddef>
+
+// HTTP/2 over cleartext TCP (h2c) from clients, by prior knowledge or
+// through "Upgrade: h2c". The connection's worker runs the framing
+// layer; each stream becomes an HTTP/1.1 request handed to
+// handle_client() over a socketpair as a task of the same thread pool,
+// so scheduling, blocklist, rate limits, reverse-proxy pools,
+// compression and logging apply per stream exactly as they do to
+// HTTP/1 clients.
+
+struct Http2Settings
+{
+    bool enabled = false;
+    int max_concurrent_streams = 100;
+    int initial_window_size = 65535; // per-stream receive window
+};
+
+void set_http2_settings(const Http2Settings &settings);
+bool http2_enabled();
+
+// The request line of a prior-knowledge connection preface
+bool is_h2_preface(const HttpRequest &req);
+
+// Serves the connection as HTTP/2 after a preface line or an h2c
+// upgrade request (which becomes stream 1); returns the bytes relayed
+// by all of its streams
+size_t serve_http2(const Task &task, const HttpRequest &req);
+
+#endif
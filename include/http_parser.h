@@ -2,6 +2,7 @@
 #define HTTP_PARSER_H
 
 #include <string>
+#include <cstddef>
 using namespace std;
 
 struct HttpRequest
@@ -10,9 +11,60 @@ struct HttpRequest
     string host;
     string path;
     int port;
-    string raw_request;
+    string raw_request; // as received; rewritten on the way upstream
+
+    // Request body framing; raw_request may already hold the first
+    // body bytes after the header terminator
+    size_t header_length = 0;
+
+    // Spans of raw_request used to rewrite the request line
+    size_t request_line_length = 0; // excluding CRLF
+    size_t path_offset = 0;
+    size_t path_length = 0;  // 0 = absolute URI without a path ("/")
+    string version = "1.0";  // client's HTTP version, e.g. "1.1"
+    long long content_length = -1; // -1 = no Content-Length header
+    bool chunked = false;
+
+    string accept_encoding;
+
+    // HTTP/2: an "Upgrade: h2c" offer and its HTTP2-Settings payload
+    bool h2c_upgrade = false;
+    string http2_settings;
 };
 
 bool parse_http_request(int client_fd, HttpRequest &req);
 
+// Tracks chunked transfer-coding framing so a relay knows where the
+// body ends without buffering it
+class ChunkedDecoder
+{
+public:
+    // Consumes up to len bytes; returns how many belong to the body.
+    // With payload set, chunk data is appended to it without the framing.
+    size_t feed(const char *data, size_t len, string *payload = nullptr);
+
+    bool done() const { return state == DONE; }
+    bool failed() const { return state == FAILED; }
+
+private:
+    enum State
+    {
+        SIZE,
+        SIZE_EXT,
+        SIZE_LF,
+        DATA,
+        DATA_CR,
+        DATA_LF,
+        TRAILER,
+        TRAILER_LF,
+        DONE,
+        FAILED
+    };
+
+    State state = SIZE;
+    size_t remaining = 0;
+    size_t line_length = 0;
+    bool size_digits = false;
+};
+
 #endif
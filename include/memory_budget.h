@@ -0,0 +1,88 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// Accounting for the memory the proxy holds on behalf of connections.
+// Each subsystem charges what it allocates; the total is checked
+// against a global budget. Above pause_percent of the budget relay
+// reads are paused briefly and relay buffers stop growing; at the
+// budget new connections are turned away with 503.
+
+enum MemoryPool
+{
+    MEM_RELAY_BUFFERS,
+    MEM_REQUESTS,    // header read buffers and parsed requests
+    MEM_COMPRESSION, // zlib state and compressed output
+    MEM_QUEUE,       // accepted connections waiting for a worker
+    MEM_METRICS,     // per-host and per-rule counters
+    MEM_POOL_COUNT
+};
+
+const char *memory_pool_name(int pool);
+
+struct MemorySettings
+{
+    size_t budget = 0;      // bytes, 0 = unlimited
+    int pause_percent = 80; // backpressure threshold
+};
+
+void set_memory_settings(const MemorySettings &settings);
+
+void memory_charge(MemoryPool pool, size_t bytes);
+void memory_release(MemoryPool pool, size_t bytes);
+
+// Holds a charge for its lifetime; resize() adjusts it in place
+class MemoryCharge
+{
+public:
+    explicit MemoryCharge(MemoryPool pool, size_t bytes = 0);
+    ~MemoryCharge();
+
+    MemoryCharge(const MemoryCharge &) = delete;
+    MemoryCharge &operator=(const MemoryCharge &) = delete;
+
+    void resize(size_t bytes);
+
+private:
+    MemoryPool pool;
+    size_t bytes;
+};
+
+// Charges made on this thread while a scope is open are attributed to
+// the connection it serves; its peak is recorded when the scope ends
+class ConnectionMemoryScope
+{
+public:
+    ConnectionMemoryScope();
+    ~ConnectionMemoryScope();
+};
+
+// False when the budget is exhausted; counts the rejection
+bool memory_admit_connection();
+
+// True above the backpressure threshold
+bool memory_under_pressure();
+
+// Waits up to max_ms for usage to drop below the threshold before the
+// caller reads more data
+void memory_pause_reads(int max_ms);
+
+struct MemorySnapshot
+{
+    size_t budget;
+    size_t used;
+    size_t peak;
+    size_t pools[MEM_POOL_COUNT];
+    size_t connection_peak_max; // largest single connection
+    size_t connection_peak_avg;
+    uint64_t rejected_connections;
+    uint64_t paused_reads;
+};
+
+MemorySnapshot memory_snapshot();
+
+#endif
@@ -3,11 +3,44 @@
 
 #include <string>
 #include <cstddef>
+#include <cstdint>
 
 void init_metrics(const std::string &metrics_file);
 
+// Bound on distinct hosts kept for top_hosts
+void set_metrics_max_hosts(size_t limit);
+
 void record_allowed(const std::string &host, size_t bytes);
-void record_blocked();
+// rule is the blocklist rule that matched; hits are counted per rule
+void record_blocked(const std::string &rule);
+void record_rate_limited();
+void record_throttled(size_t bytes, size_t delay_ms);
+void record_timeouts(size_t header, size_t idle, size_t lifetime);
+void record_compression(size_t bytes_in, size_t bytes_out, uint64_t cpu_us);
+
+// Reverse proxy: no usable backend, and passive outlier ejections
+void record_upstream_unavailable();
+void record_outlier_ejection();
+
+// HTTP/2: connections, and streams served or refused over the
+// concurrency limit
+void record_http2_connection();
+void record_http2_stream(bool refused);
+
+// Per-worker throughput; local = the connection arrived on the worker's CPU
+void record_worker(size_t worker, int cpu, size_t bytes, uint64_t busy_us,
+                   bool local);
+
+// Prefork mode (see shared_metrics.h). A worker process counts into its
+// slot from then on and leaves metrics_file to the supervisor.
+struct SharedMetricsSlot;
+void metrics_use_shared_slot(SharedMetricsSlot *slot);
+
+// Worker: copy the memory gauges into the slot; no-op otherwise
+void publish_process_metrics();
+
+// Supervisor: sum every slot into metrics_file
+void write_shared_metrics(const SharedMetricsSlot *slots, size_t count);
 
 void stop_metrics();
 
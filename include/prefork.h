@@ -0,0 +1,17 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include "config.h"
+
+// Multi-process mode. The process that read the configuration becomes a
+// supervisor: it forks cfg.worker_processes workers, each of which runs
+// the normal server with its own thread pool, and restarts any worker
+// that exits. Signals are forwarded to the workers; SIGINT/SIGTERM stop
+// them all. Workers count into shared memory (shared_metrics.h) and the
+// supervisor writes the combined metrics file.
+
+// Must be called before any thread is started: only the calling thread
+// survives fork. serve runs in each worker and returns its exit status.
+int run_prefork(const RuntimeConfig &cfg, int (*serve)(const RuntimeConfig &));
+
+#endif
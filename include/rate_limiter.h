@@ -0,0 +1,37 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <string>
+#include <cstddef>
+
+using namespace std;
+
+// Per-client-IP token buckets. A rate of 0 disables that limit.
+struct RateLimitSettings
+{
+    double bytes_per_sec = 0;
+    double burst_bytes = 1024 * 1024;
+    double requests_per_sec = 0;
+    double burst_requests = 20;
+    int max_request_wait_ms = 2000; // longer waits are rejected with 429
+    int idle_evict_sec = 60;
+};
+
+void set_rate_limits(const RateLimitSettings &settings);
+
+// Binds the calling thread to a client and takes one request token,
+// pacing the caller if needed. Returns false if the request must be
+// rejected because the wait would exceed max_request_wait_ms.
+bool rate_limit_admit(const string &client_ip);
+
+// Charges bytes relayed for the bound client and sleeps just long enough
+// to keep it at its configured rate
+void rate_limit_pace(size_t bytes);
+
+// Unbinds the thread and reports throttling totals to metrics
+void rate_limit_release();
+
+// Drops buckets for clients idle longer than idle_evict_sec
+void evict_idle_rate_limits();
+
+#endif
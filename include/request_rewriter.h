@@ -0,0 +1,46 @@
+#ifndef REQUEST_REWRITER_H
+#define REQUEST_REWRITER_H
+
+#include <sys/uio.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "http_parser.h"
+
+using namespace std;
+
+struct RewriteSettings
+{
+    bool add_via = true;
+    bool add_x_forwarded_for = false;
+};
+
+void set_rewrite(const RewriteSettings &settings);
+
+// The upstream request expressed as edits over the received bytes: kept
+// spans point into req.raw_request and only inserted text is new memory.
+// The request line becomes HTTP/1.0 origin-form (HTTP/1.1 with
+// Connection: close for a chunked body, whose framing HTTP/1.0 cannot
+// carry), hop-by-hop headers are dropped, Via and X-Forwarded-For are
+// appended, and any body bytes read with the header follow unchanged.
+class RequestRewrite
+{
+public:
+    RequestRewrite(const HttpRequest &req, const string &client_ip);
+
+    // Writes everything with as few sendmsg() calls as the socket allows
+    bool send_to(int fd);
+
+    size_t size() const { return total; }
+
+private:
+    void keep(const char *data, size_t len);
+    void insert(string text);
+
+    vector<iovec> segments;
+    deque<string> inserted; // stable storage for inserted text
+    size_t total = 0;
+};
+
+#endif
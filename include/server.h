@@ -3,7 +3,24 @@
 
 #include <string>
 
-void start_server(const std::string &address, int port, int thread_pool_size);
+#include "config.h"
+
+void start_server(const RuntimeConfig &cfg);
+
+// Prefork without reuseport: the supervisor opens the listening socket
+// once and every worker accepts from its inherited copy. Returns -1 on
+// failure.
+int open_listen_socket(const RuntimeConfig &cfg);
+
+// The next start_server() accepts on fd instead of opening a listener
+void set_inherited_listener(int fd);
 void request_shutdown();
 
+// Async-signal-safe: re-read proxy.conf on the next accept loop iteration
+void request_reload();
+
+// Async-signal-safe: start a hot upgrade (re-exec and hand off the
+// listening socket) on the next accept loop iteration
+void request_upgrade();
+
 #endif
@@ -0,0 +1,130 @@
+#ifndef SHARED_METRICS_H
+#define SHARED_METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "memory_budget.h"
+
+using namespace std;
+
+// Counters for prefork mode. The supervisor maps one anonymous shared
+// region before forking; each worker process owns a slot and updates it
+// with relaxed atomics only, so no lock is shared between processes and
+// a worker that dies mid-update cannot wedge the others. The supervisor
+// sums the slots into metrics_file. Slots outlive their process, so
+// totals survive a crashed worker being replaced.
+
+enum MetricCounter
+{
+    M_TOTAL_REQUESTS,
+    M_ALLOWED_REQUESTS,
+    M_BLOCKED_REQUESTS,
+    M_BYTES_TRANSFERRED,
+    M_RATE_LIMITED_REQUESTS,
+    M_THROTTLED_BYTES,
+    M_THROTTLE_DELAY_MS,
+    M_HEADER_TIMEOUTS,
+    M_IDLE_TIMEOUTS,
+    M_LIFETIME_TIMEOUTS,
+    M_COMPRESSED_RESPONSES,
+    M_COMPRESSION_BYTES_IN,
+    M_COMPRESSION_BYTES_OUT,
+    M_COMPRESSION_CPU_US,
+    M_UPSTREAM_UNAVAILABLE,
+    M_OUTLIER_EJECTIONS,
+    M_HTTP2_CONNECTIONS,
+    M_HTTP2_STREAMS,
+    M_HTTP2_REFUSED_STREAMS,
+    METRIC_COUNT
+};
+
+// Key as written to metrics_file
+const char *metric_counter_name(int counter);
+
+// Atomics in shared memory must not fall back to a process-local lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "shared metrics need lock-free 32 and 64-bit atomics");
+
+static const size_t SHARED_NAME_LEN = 128;   // longer names are truncated
+static const size_t SHARED_HOST_ENTRIES = 1024;
+static const size_t SHARED_RULE_ENTRIES = 256;
+static const size_t SHARED_WORKER_ENTRIES = 256; // worker_N lines per process
+
+// Open-addressed counter keyed by name. An entry is claimed once with a
+// compare-and-swap and never removed; a full table drops new names.
+struct SharedNameCount
+{
+    atomic<uint32_t> state; // empty, claiming, ready
+    char name[SHARED_NAME_LEN];
+    atomic<uint64_t> count;
+};
+
+// Last memory_snapshot() of the process; rejected and paused counts of
+// earlier processes in the slot are carried over when one exits
+struct SharedMemoryGauges
+{
+    atomic<uint64_t> budget;
+    atomic<uint64_t> used;
+    atomic<uint64_t> peak;
+    atomic<uint64_t> pools[MEM_POOL_COUNT];
+    atomic<uint64_t> connection_peak_max;
+    atomic<uint64_t> connection_peak_avg;
+    atomic<uint64_t> rejected_connections;
+    atomic<uint64_t> paused_reads;
+    atomic<uint64_t> carried_rejected;
+    atomic<uint64_t> carried_paused;
+};
+
+// One pool worker thread of the process (the worker_N lines)
+struct SharedWorkerCounters
+{
+    atomic<int32_t> cpu;
+    atomic<uint64_t> connections;
+    atomic<uint64_t> local_connections;
+    atomic<uint64_t> bytes;
+    atomic<uint64_t> busy_us;
+};
+
+struct SharedMetricsSlot
+{
+    atomic<int32_t> pid; // 0 while no process owns the slot
+    atomic<uint32_t> restarts;
+    atomic<uint64_t> counters[METRIC_COUNT];
+    atomic<uint64_t> dropped_names;
+    SharedMemoryGauges memory;
+    SharedNameCount hosts[SHARED_HOST_ENTRIES];
+    SharedNameCount rules[SHARED_RULE_ENTRIES];
+    SharedWorkerCounters workers[SHARED_WORKER_ENTRIES];
+};
+
+// Maps and zeroes slots for count processes; nullptr on failure.
+// Must be called before fork so every worker sees the same pages.
+SharedMetricsSlot *create_shared_metrics(size_t count);
+void destroy_shared_metrics(SharedMetricsSlot *slots, size_t count);
+
+void shared_count_host(SharedMetricsSlot &slot, const string &host);
+void shared_count_rule(SharedMetricsSlot &slot, const string &rule);
+
+void shared_store_memory(SharedMetricsSlot &slot, const MemorySnapshot &mem);
+
+// Supervisor, after reaping the slot's process
+void shared_retire_process(SharedMetricsSlot &slot);
+
+// Supervisor: sums of every slot
+struct SharedMetricsTotals
+{
+    uint64_t counters[METRIC_COUNT];
+    unordered_map<string, uint64_t> hosts;
+    unordered_map<string, uint64_t> rules;
+    uint64_t dropped_names;
+    MemorySnapshot memory;
+};
+
+void collect_shared_metrics(const SharedMetricsSlot *slots, size_t count,
+                            SharedMetricsTotals &totals);
+
+#endif
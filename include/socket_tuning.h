@@ -0,0 +1,65 @@
+#ifndef SOCKET_TUNING_H
+#define SOCKET_TUNING_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "memory_budget.h"
+
+using namespace std;
+
+// Kernel socket options applied to client and upstream connections.
+// Zero means "leave the kernel default".
+struct SocketTuning
+{
+    bool tcp_nodelay = false;
+    int so_sndbuf = 0;
+    int so_rcvbuf = 0;
+    int tcp_notsent_lowat = 0;
+    bool tcp_quickack = false;
+    int tcp_fastopen = 0; // listen queue length for TFO; enables TFO connect
+};
+
+void set_socket_tuning(const SocketTuning &tuning);
+
+void tune_listen_socket(int fd);
+void tune_client_socket(int fd);
+
+// Must be called before connect() so TCP_FASTOPEN_CONNECT can take effect
+void tune_upstream_socket(int fd);
+
+// TCP_QUICKACK is not sticky; re-arm it after each read
+void rearm_quickack(int fd);
+
+// Relay buffer that grows on sustained full reads and shrinks when
+// reads stay small or the connection goes idle. Growth stops, and the
+// buffer drops back to its minimum, while memory is under pressure.
+class RelayBuffer
+{
+public:
+    RelayBuffer();
+    ~RelayBuffer();
+
+    char *data() { return buffer.data(); }
+    size_t size() const { return buffer.size(); }
+
+    // Report the size of the last recv() once its data has been sent on;
+    // the buffer may be reallocated
+    void record_read(size_t bytes);
+
+private:
+    void resize(size_t new_size);
+
+    vector<char> buffer;
+    size_t min_size;
+    size_t max_size;
+    bool adaptive;
+    MemoryCharge memory;
+
+    int full_reads = 0;
+    int short_reads = 0;
+    uint64_t last_read_ms = 0;
+};
+
+#endif
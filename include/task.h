@@ -2,6 +2,8 @@
 #define TASK_H
 
 #include <string>
+#include <cstdint>
+#include <functional>
 
 using namespace std;
 
@@ -10,6 +12,14 @@ struct Task
     int client_fd;
     string client_ip;
     int client_port;
+
+    uint64_t trace_id = 0;     // 0 = not sampled
+    uint64_t enqueue_us = 0;   // trace clock at enqueue
+    int incoming_cpu = -1;     // CPU that received the connection, if known
+    bool http2_stream = false; // one stream of an HTTP/2 connection
+
+    // Called by the worker with the bytes relayed, after handle_client
+    function<void(size_t)> on_done;
 };
 
 #endif
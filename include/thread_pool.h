@@ -3,14 +3,34 @@
 
 #include <vector>
 #include <queue>
+#include <unordered_map>
+#include <deque>
+#include <string>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 
 #include "task.h"
 
 using namespace std;
 
+struct AutoscaleSettings
+{
+    bool enabled = false;
+    size_t min_size = 1;
+    size_t max_size = 64;
+    int target_wait_ms = 20; // grow when average queue wait exceeds this
+};
+
+struct FairnessSettings
+{
+    size_t max_active_per_client = 0; // 0 = no cap
+    double quantum_ms = 10;           // DRR credit added per round
+};
+
 class ThreadPool
 {
 public:
@@ -19,15 +39,81 @@ public:
 
     void enqueue(Task task);
 
+    // Grow or shrink the pool; busy workers retire after their current task
+    void resize(size_t size);
+    size_t size();
+
+    // Tasks queued or running
+    size_t pending();
+
+    void set_autoscale(const AutoscaleSettings &settings);
+    void set_fairness(const FairnessSettings &settings);
+
+    // The pool whose worker is running the calling thread, or nullptr
+    static ThreadPool *current();
+
+    // Called on a worker whose connection now multiplexes HTTP/2 streams
+    // that are enqueued as tasks of their own. Until the task ends, the
+    // connection does not count against its client's cap or service
+    // cost, and an extra worker stands in for the one it occupies, so
+    // sessions cannot starve their own streams of workers.
+    void begin_multiplexing(const string &client_ip);
+    void end_multiplexing();
+
 private:
-    void worker();
+    // Per-client state for deficit round robin dispatch
+    struct ClientQueue
+    {
+        queue<Task> tasks;
+        size_t active = 0;    // tasks currently on a worker
+        double deficit = 0;   // DRR credit in ms of service time
+        double cost_ms = 1.0; // EWMA service time of this client's tasks
+        bool in_ring = false;
+        chrono::steady_clock::time_point idle_since; // no tasks queued or running
+    };
+
+    void worker(size_t index);
+    void monitor();
+    void spawn_worker_locked();
+    void reap_workers();
+    void autoscale_step();
+    void evict_idle_clients();
+
+    bool dispatchable_locked();
+    bool pick_task_locked(Task &task, int cpu);
+    void take_task_locked(size_t ring_pos, Task &task);
+    void finish_task(const string &client_ip, uint64_t service_us,
+                     bool multiplexed);
+    size_t wanted_workers_locked() const { return target_size + multiplexing; }
+
+    unordered_map<size_t, thread> workers;
+    vector<size_t> exited;
 
-    vector<thread> workers;
-    queue<Task> tasks;
+    // Clients with queued tasks, in round robin order; idle clients are
+    // kept for a while so their cost estimate survives between visits
+    unordered_map<string, ClientQueue> clients;
+    deque<string> ring;
+    size_t queued_tasks = 0;
+
+    size_t live_workers = 0;
+    size_t target_size = 0;
+    size_t busy_workers = 0;
+    size_t multiplexing = 0; // workers held by HTTP/2 sessions
+
+    // Queue wait accumulated since the last autoscale sample
+    uint64_t wait_sum_us = 0;
+    uint64_t wait_count = 0;
+    double utilization = 0.0; // EWMA of busy / live
+
+    AutoscaleSettings autoscale;
+    FairnessSettings fairness;
 
     mutex queue_mutex;
     condition_variable condition;
     bool stop;
+
+    thread monitor_thread;
+    condition_variable monitor_condition;
 };
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef TIMEOUTS_H
+#define TIMEOUTS_H
+
+#include <cstddef>
+
+// Connection deadlines driven by a shared timer wheel.
+// Each worker tracks the connection it is serving; when a deadline
+// passes, the connection's sockets are shut down so any blocking call
+// in the worker returns. Durations are in seconds, 0 disables a timer.
+
+struct TimeoutSettings
+{
+    int header_timeout = 10;   // time to receive the full request header
+    int idle_timeout = 300;    // time without relayed data
+    int max_lifetime = 3600;   // total connection lifetime
+};
+
+void set_timeouts(const TimeoutSettings &settings);
+
+// Starts the timer thread
+void init_timeouts();
+void stop_timeouts();
+
+// Start tracking client_fd for the calling worker (arms header + lifetime)
+void timeouts_begin(int client_fd);
+
+// Header received: cancel the header deadline and arm the idle timer
+void timeouts_header_done();
+
+// Also shut down the upstream socket when a deadline passes
+void timeouts_watch_upstream(int server_fd);
+
+// Record activity; cheap enough to call after every read
+void timeouts_touch();
+
+// Stop tracking; must be called before the sockets are closed
+void timeouts_end();
+
+// Shut down every tracked connection now (end of a shutdown drain).
+// Returns the number of connections affected.
+size_t timeouts_shutdown_all();
+
+#endif
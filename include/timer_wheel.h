@@ -0,0 +1,49 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+// Intrusive timer entry. The owner embeds it and must cancel it before
+// destroying it.
+struct TimerNode
+{
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0; // tick
+    bool linked = false;
+    int kind = 0;          // owner-defined
+    void *owner = nullptr; // owner-defined
+};
+
+// Hierarchical timing wheel: 4 levels of 64 slots. Insert and cancel are
+// O(1); advancing costs O(1) per tick plus an occasional cascade that
+// moves a slot's timers down one level. Not thread-safe.
+class TimerWheel
+{
+public:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    explicit TimerWheel(uint64_t start_tick);
+
+    void insert(TimerNode *node, uint64_t expires);
+    void cancel(TimerNode *node);
+
+    // Moves the wheel forward to `now`, appending expired nodes (unlinked)
+    void advance(uint64_t now, vector<TimerNode *> &expired);
+
+    uint64_t now() const { return current; }
+
+private:
+    void place(TimerNode *node);
+    void cascade(int level);
+
+    TimerNode slots[LEVELS][SLOTS]; // list heads
+    uint64_t current;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// Sampled per-request tracing.
+// Spans are stored in per-thread ring buffers and exported on demand
+// as Chrome trace_event JSON (load the file in chrome://tracing).
+
+void init_tracing(double sample_rate, size_t ring_capacity,
+                  const std::string &output_file);
+
+uint64_t trace_now_us();
+
+// Returns a new trace id if this request is sampled, 0 otherwise
+uint64_t trace_sample();
+
+// Bind the calling thread to a request (0 = not traced)
+void trace_set_current(uint64_t trace_id);
+uint64_t trace_current();
+
+void trace_name_thread(const std::string &name);
+
+void trace_record(uint64_t trace_id, const char *name,
+                  uint64_t start_us, uint64_t end_us);
+
+// Records a span for the current request on scope exit
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name)
+        : name(name),
+          trace_id(trace_current()),
+          start_us(trace_id ? trace_now_us() : 0) {}
+
+    ~TraceSpan()
+    {
+        if (trace_id)
+            trace_record(trace_id, name, start_us, trace_now_us());
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *name;
+    uint64_t trace_id;
+    uint64_t start_us;
+};
+
+// Async-signal-safe: marks a dump as pending
+void request_trace_dump();
+bool trace_dump_pending();
+
+// Writes all buffered spans to the configured trace file
+bool dump_traces();
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+// Hot binary upgrade. The running proxy re-executes its binary and passes
+// the listening socket to the new process over a Unix socket
+// (SCM_RIGHTS). Both processes accept from the same socket until the new
+// one reports ready, so no connection is refused during the switch.
+
+// Remember the executable path and arguments for a later re-exec
+void init_upgrade(int argc, char *argv[]);
+
+// New process: the listening socket handed over by the previous process,
+// or -1 when started normally
+int upgrade_inherited_listener();
+
+// New process: tell the previous process to stop accepting
+void upgrade_notify_ready();
+
+// Old process: start the new binary and hand it listen_fd. Returns a
+// descriptor that becomes readable once the new process is ready or has
+// failed, or -1 if the new process could not be started.
+int upgrade_start(int listen_fd);
+
+// Old process: read the outcome from the descriptor returned by
+// upgrade_start and close it. True when the new process is serving.
+bool upgrade_finish(int channel_fd);
+
+// Old process: shutting down before the new process was ready; stop it
+void upgrade_abort(int channel_fd);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <netinet/in.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+// Reverse-proxy mode: virtual hosts map to pools of backend addresses.
+// Backends are chosen by least connections or by power-of-two-choices
+// over an EWMA of response latency. A health checker probes every
+// backend periodically, and backends that fail repeatedly on live
+// traffic are ejected for a while (passive outlier detection).
+
+enum BalancePolicy
+{
+    BALANCE_LEAST_CONN,
+    BALANCE_P2C_EWMA
+};
+
+struct UpstreamSettings
+{
+    BalancePolicy policy = BALANCE_LEAST_CONN;
+    int health_check_interval = 5;     // seconds, 0 = no active checks
+    int health_check_timeout_ms = 1000;
+    string health_check_path = "/";    // empty = TCP connect only
+    int eject_after_failures = 5;      // consecutive failures, 0 = never
+    int ejection_sec = 30;
+};
+
+struct Backend
+{
+    string name; // host:port as configured
+    string vhost;
+    sockaddr_in addr{};
+
+    atomic<int> active{0};
+    atomic<double> ewma_ms{0};    // first-byte latency, 0 = no sample yet
+    atomic<bool> healthy{true};   // last active health check result
+    atomic<int> failures{0};      // consecutive passive failures
+    atomic<int64_t> ejected_until_ms{0};
+};
+
+void set_upstream_settings(const UpstreamSettings &settings);
+
+// Reads "vhost backend [backend ...]" lines; "*" is the default pool.
+// Replaces the current pools; requests in flight keep their backend.
+bool load_upstreams(const string &filename);
+
+// Starts and stops the health check thread
+void init_upstreams();
+void stop_upstreams();
+
+// Picks a backend for the request's Host and counts it as active;
+// nullptr when the vhost is unknown or has no usable backend
+shared_ptr<Backend> pick_backend(const string &vhost);
+
+// True when a pool exists for the vhost (or a default pool is set)
+bool has_upstream_pool(const string &vhost);
+
+// Ends a request on the backend. success means a response was received;
+// first_byte_us is the latency sample for the EWMA.
+void release_backend(const shared_ptr<Backend> &backend, bool success,
+                     uint64_t first_byte_us);
+
+#endif
@@ -0,0 +1,207 @@
+#include "access_log.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Records are copied into this buffer and written with one write() when
+// it fills, so a request costs a memcpy rather than a syscall
+static const size_t WRITE_BUFFER_SIZE = 1024 * 1024;
+
+static mutex access_mutex;
+static atomic<bool> enabled(false);
+
+static string log_directory;
+static size_t max_segment_size = 64 * 1024 * 1024;
+
+static int segment_fd = -1;
+static size_t segment_bytes = 0;
+static unsigned segment_seq = 0;
+
+static vector<char> write_buffer;
+static unordered_map<string, uint32_t> host_ids; // current segment only
+static chrono::steady_clock::time_point last_flush;
+
+uint8_t method_code(const string &method)
+{
+    static const unordered_map<string, uint8_t> codes = {
+        {"GET", METHOD_GET},
+        {"POST", METHOD_POST},
+        {"PUT", METHOD_PUT},
+        {"DELETE", METHOD_DELETE},
+        {"HEAD", METHOD_HEAD},
+        {"CONNECT", METHOD_CONNECT},
+        {"OPTIONS", METHOD_OPTIONS},
+        {"PATCH", METHOD_PATCH}};
+
+    auto it = codes.find(method);
+    return it == codes.end() ? static_cast<uint8_t>(METHOD_OTHER) : it->second;
+}
+
+static void write_out_locked()
+{
+    size_t done = 0;
+    while (done < write_buffer.size() && segment_fd >= 0)
+    {
+        ssize_t n = write(segment_fd, write_buffer.data() + done,
+                          write_buffer.size() - done);
+        if (n <= 0)
+        {
+            cerr << "[ERROR] Binary access log write failed" << endl;
+            break;
+        }
+        done += n;
+    }
+
+    write_buffer.clear();
+    last_flush = chrono::steady_clock::now();
+}
+
+static void append_locked(const void *data, size_t len)
+{
+    if (write_buffer.size() + len > WRITE_BUFFER_SIZE)
+        write_out_locked();
+
+    const char *bytes = static_cast<const char *>(data);
+    write_buffer.insert(write_buffer.end(), bytes, bytes + len);
+    segment_bytes += len;
+}
+
+static bool open_segment_locked()
+{
+    if (segment_fd >= 0)
+    {
+        write_out_locked();
+        close(segment_fd);
+    }
+
+    uint64_t now = chrono::duration_cast<chrono::seconds>(
+                       chrono::system_clock::now().time_since_epoch())
+                       .count();
+
+    // The pid keeps names unique while an upgraded process overlaps
+    // with the one it replaces
+    string path = log_directory + "/access-" + to_string(now) + "-" +
+                  to_string(getpid()) + "-" +
+                  to_string(segment_seq++) + ".bin";
+
+    segment_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (segment_fd < 0)
+    {
+        cerr << "[ERROR] Cannot open access log segment: " << path << endl;
+        return false;
+    }
+
+    segment_bytes = 0;
+    host_ids.clear();
+
+    SegmentHeader header{};
+    memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic));
+    header.version = ACCESS_LOG_VERSION;
+    header.created_unix = now;
+    append_locked(&header, sizeof(header));
+
+    return true;
+}
+
+bool init_access_log(const string &directory, size_t segment_size)
+{
+    lock_guard<mutex> lock(access_mutex);
+
+    log_directory = directory;
+    max_segment_size = segment_size > 0 ? segment_size : 64 * 1024 * 1024;
+    write_buffer.reserve(WRITE_BUFFER_SIZE);
+
+    mkdir(directory.c_str(), 0755);
+
+    if (!open_segment_locked())
+        return false;
+
+    enabled.store(true);
+    return true;
+}
+
+bool access_log_enabled()
+{
+    return enabled.load();
+}
+
+// Returns the id for host, emitting its definition on first use
+static uint32_t intern_host_locked(const string &host)
+{
+    auto it = host_ids.find(host);
+    if (it != host_ids.end())
+        return it->second;
+
+    uint32_t id = static_cast<uint32_t>(host_ids.size());
+    host_ids.emplace(host, id);
+
+    HostRecord rec{};
+    rec.type = RECORD_HOST;
+    rec.name_length = static_cast<uint8_t>(min<size_t>(host.size(), 255));
+    rec.host_id = id;
+
+    append_locked(&rec, sizeof(rec));
+    append_locked(host.data(), rec.name_length);
+    return id;
+}
+
+void log_access(const string &client_ip, int client_port,
+                const string &method, const string &host, int port,
+                AccessOutcome outcome, int status,
+                size_t bytes, uint32_t duration_ms)
+{
+    if (!enabled.load())
+        return;
+
+    AccessRecord rec{};
+    rec.type = RECORD_ACCESS;
+    rec.outcome = outcome;
+    rec.method = method_code(method);
+    rec.timestamp_us = chrono::duration_cast<chrono::microseconds>(
+                           chrono::system_clock::now().time_since_epoch())
+                           .count();
+    inet_pton(AF_INET, client_ip.c_str(), &rec.client_ip);
+    rec.client_port = client_port;
+    rec.port = port;
+    rec.status = status;
+    rec.bytes = bytes;
+    rec.duration_ms = duration_ms;
+
+    lock_guard<mutex> lock(access_mutex);
+
+    if (segment_bytes >= max_segment_size && !open_segment_locked())
+        return;
+
+    rec.host_id = intern_host_locked(host);
+    append_locked(&rec, sizeof(rec));
+}
+
+void flush_access_log_if_stale()
+{
+    if (!enabled.load())
+        return;
+
+    lock_guard<mutex> lock(access_mutex);
+    if (!write_buffer.empty() &&
+        chrono::steady_clock::now() - last_flush > chrono::seconds(1))
+        write_out_locked();
+}
+
+void flush_access_log()
+{
+    lock_guard<mutex> lock(access_mutex);
+    if (segment_fd >= 0)
+        write_out_locked();
+}
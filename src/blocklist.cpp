@@ -1,11 +1,278 @@
 #include "blocklist.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <queue>
+#include <vector>
 
 using namespace std;
 
-// Internal container
-static set<string> blocked_sites;
+// Markers around the host in the scanned text, so literals can be
+// anchored: "\x01" + host + "\x02" + path
+static const char HOST_START = '\x01';
+static const char HOST_END = '\x02';
+
+struct Rule
+{
+    string text;        // as written in the file
+    uint8_t clauses;    // number of clauses that must all be satisfied
+    string host_glob;   // verified on candidates when the host has wildcards
+};
+
+// A literal whose occurrence satisfies one clause of one rule
+struct Output
+{
+    uint32_t rule;
+    uint8_t clause;
+    int next; // next output for the same automaton state, -1 = end
+};
+
+struct Node
+{
+    uint32_t edge_begin = 0;
+    uint32_t edge_count = 0;
+    int fail = 0;
+    int output = -1;      // first own output
+    int dict = -1;        // nearest state on the fail chain with outputs
+};
+
+struct Blocklist
+{
+    vector<Rule> rules;
+    vector<Node> nodes;
+    vector<pair<uint8_t, int>> edges; // sorted by byte within each node
+    vector<Output> outputs;
+    vector<uint32_t> unanchored; // glob rules without any literal
+};
+
+static shared_ptr<const Blocklist> active = make_shared<const Blocklist>();
+
+// Per-thread clause bitmasks, reset lazily by generation stamp
+static thread_local vector<uint8_t> clause_mask;
+static thread_local vector<uint32_t> mask_stamp;
+static thread_local uint32_t scan_generation = 0;
+
+static string lower(string s)
+{
+    for (char &c : s)
+        c = tolower(static_cast<unsigned char>(c));
+    return s;
+}
+
+static bool has_wildcard(const string &s)
+{
+    return s.find_first_of("*?") != string::npos;
+}
+
+static bool glob_match(const string &pattern, const string &text)
+{
+    size_t p = 0, t = 0;
+    size_t star = string::npos, resume = 0;
+
+    while (t < text.size())
+    {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t]))
+        {
+            ++p;
+            ++t;
+        }
+        else if (p < pattern.size() && pattern[p] == '*')
+        {
+            star = p++;
+            resume = t;
+        }
+        else if (star != string::npos)
+        {
+            p = star + 1;
+            t = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (p < pattern.size() && pattern[p] == '*')
+        ++p;
+    return p == pattern.size();
+}
+
+// Longest literal run of an anchored glob, used as its prefilter
+static string longest_literal(const string &anchored_glob)
+{
+    string best, run;
+    for (char c : anchored_glob)
+    {
+        if (c == '*' || c == '?')
+        {
+            if (run.size() > best.size())
+                best = run;
+            run.clear();
+        }
+        else
+        {
+            run += c;
+        }
+    }
+    return run.size() > best.size() ? run : best;
+}
+
+// Trie under construction; flattened once fail links are known
+struct Builder
+{
+    vector<vector<pair<uint8_t, int>>> children{1};
+    vector<int> first_output{-1};
+    vector<Output> outputs;
+
+    void add(const string &literal, uint32_t rule, uint8_t clause)
+    {
+        int state = 0;
+        for (unsigned char c : literal)
+        {
+            auto &edges = children[state];
+            auto it = find_if(edges.begin(), edges.end(),
+                              [c](const pair<uint8_t, int> &e)
+                              { return e.first == c; });
+            if (it != edges.end())
+            {
+                state = it->second;
+                continue;
+            }
+
+            int child = children.size();
+            edges.push_back({c, child});
+            children.emplace_back();
+            first_output.push_back(-1);
+            state = child;
+        }
+
+        outputs.push_back({rule, clause, first_output[state]});
+        first_output[state] = outputs.size() - 1;
+    }
+};
+
+static int find_edge(const Blocklist &bl, int state, uint8_t c)
+{
+    const Node &node = bl.nodes[state];
+    auto begin = bl.edges.begin() + node.edge_begin;
+    auto end = begin + node.edge_count;
+    auto it = lower_bound(begin, end, make_pair(c, 0),
+                          [](const pair<uint8_t, int> &a,
+                             const pair<uint8_t, int> &b)
+                          { return a.first < b.first; });
+    return it != end && it->first == c ? it->second : -1;
+}
+
+static void compile(Builder &builder, Blocklist &bl)
+{
+    size_t count = builder.children.size();
+    bl.nodes.resize(count);
+    bl.outputs = move(builder.outputs);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        auto &edges = builder.children[i];
+        sort(edges.begin(), edges.end());
+        bl.nodes[i].edge_begin = bl.edges.size();
+        bl.nodes[i].edge_count = edges.size();
+        bl.nodes[i].output = builder.first_output[i];
+        bl.edges.insert(bl.edges.end(), edges.begin(), edges.end());
+    }
+
+    // Breadth-first fail links: the longest proper suffix that is a prefix
+    queue<int> pending;
+    for (const auto &edge : builder.children[0])
+    {
+        bl.nodes[edge.second].fail = 0;
+        pending.push(edge.second);
+    }
+
+    while (!pending.empty())
+    {
+        int state = pending.front();
+        pending.pop();
+
+        for (const auto &edge : builder.children[state])
+        {
+            int child = edge.second;
+            int f = bl.nodes[state].fail;
+            while (f != 0 && find_edge(bl, f, edge.first) < 0)
+                f = bl.nodes[f].fail;
+            int target = find_edge(bl, f, edge.first);
+            bl.nodes[child].fail = target >= 0 ? target : 0;
+
+            int fail = bl.nodes[child].fail;
+            bl.nodes[child].dict = bl.nodes[fail].output >= 0
+                                       ? fail
+                                       : bl.nodes[fail].dict;
+            pending.push(child);
+        }
+    }
+}
+
+// Adds a rule line to the builder; false if it cannot be parsed
+static bool add_rule(const string &line, Builder &builder, Blocklist &bl)
+{
+    uint32_t id = bl.rules.size();
+    Rule rule;
+    rule.text = line;
+    rule.clauses = 0;
+
+    if (line[0] == '~')
+    {
+        string literal = line.substr(1);
+        if (literal.empty())
+            return false;
+        // Hosts are scanned lowercased; the path as sent
+        builder.add(lower(literal), id, rule.clauses);
+        if (lower(literal) != literal)
+            builder.add(literal, id, rule.clauses);
+        rule.clauses = 1;
+        bl.rules.push_back(rule);
+        return true;
+    }
+
+    size_t slash = line.find('/');
+    string host = lower(line.substr(0, slash));
+    string path = slash == string::npos ? "" : line.substr(slash);
+
+    if (host.empty())
+        return false;
+
+    if (host == "*")
+    {
+        // Path-only rule
+    }
+    else if (has_wildcard(host))
+    {
+        string anchored = HOST_START + host + HOST_END;
+        string literal = longest_literal(anchored);
+        rule.host_glob = host;
+        if (literal.size() > 1)
+            builder.add(literal, id, rule.clauses++);
+        else if (path.empty())
+            bl.unanchored.push_back(id);
+    }
+    else
+    {
+        // The host itself or any subdomain
+        builder.add(HOST_START + host + HOST_END, id, rule.clauses);
+        builder.add("." + host + HOST_END, id, rule.clauses);
+        ++rule.clauses;
+    }
+
+    if (!path.empty())
+        builder.add(HOST_END + path, id, rule.clauses++);
+    else if (host == "*")
+        return false;
+
+    bl.rules.push_back(rule);
+    return true;
+}
 
 bool load_blocklist(const string &filename)
 {
@@ -17,37 +284,106 @@ bool load_blocklist(const string &filename)
         return false;
     }
 
+    auto bl = make_shared<Blocklist>();
+    Builder builder;
+
     string line;
     while (getline(file, line))
     {
-        if (!line.empty())
-        {
-            blocked_sites.insert(line);
-        }
+        while (!line.empty() && isspace(static_cast<unsigned char>(line.back())))
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        if (!add_rule(line, builder, *bl))
+            cerr << "[ERROR] Ignoring invalid blocklist rule: " << line << endl;
     }
 
     file.close();
+    compile(builder, *bl);
+    atomic_store(&active, shared_ptr<const Blocklist>(bl));
 
-    cout << "[INFO] Loaded " << blocked_sites.size()
-         << " blocked sites" << endl;
+    cout << "[INFO] Loaded " << bl->rules.size() << " blocklist rules ("
+         << bl->nodes.size() << " automaton states)" << endl;
 
     return true;
 }
 
-bool is_blocked(const string &host)
+// Marks a clause of a rule as satisfied; true when the rule now matches
+static bool satisfy(const Blocklist &bl, uint32_t rule, uint8_t clause,
+                    const string &host)
 {
-    for (const auto &rule : blocked_sites)
+    if (mask_stamp[rule] != scan_generation)
     {
-        if (host == rule)
-            return true;
+        mask_stamp[rule] = scan_generation;
+        clause_mask[rule] = 0;
     }
-    for (const auto &rule : blocked_sites)
+
+    clause_mask[rule] |= 1 << clause;
+
+    const Rule &r = bl.rules[rule];
+    if (clause_mask[rule] != (1 << r.clauses) - 1)
+        return false;
+    return r.host_glob.empty() || glob_match(r.host_glob, host);
+}
+
+bool is_blocked(const string &host, const string &path, string &rule)
+{
+    shared_ptr<const Blocklist> bl = atomic_load(&active);
+    if (bl->rules.empty())
+        return false;
+
+    string lower_host = lower(host);
+
+    for (uint32_t id : bl->unanchored)
     {
-        string suffix = "." + rule;
-        if (host.size() > suffix.size() && host.compare(host.size() - suffix.size(), suffix.size(), suffix) == 0)
+        if (glob_match(bl->rules[id].host_glob, lower_host))
         {
+            rule = bl->rules[id].text;
             return true;
         }
     }
+
+    if (mask_stamp.size() < bl->rules.size())
+    {
+        mask_stamp.assign(bl->rules.size(), 0);
+        clause_mask.assign(bl->rules.size(), 0);
+    }
+    if (++scan_generation == 0)
+    {
+        fill(mask_stamp.begin(), mask_stamp.end(), 0);
+        scan_generation = 1;
+    }
+
+    string text;
+    text.reserve(host.size() + path.size() + 2);
+    text += HOST_START;
+    text += lower_host;
+    text += HOST_END;
+    text += path;
+
+    int state = 0;
+    for (unsigned char c : text)
+    {
+        int next;
+        while ((next = find_edge(*bl, state, c)) < 0 && state != 0)
+            state = bl->nodes[state].fail;
+        state = next < 0 ? 0 : next;
+
+        for (int s = bl->nodes[state].output >= 0 ? state : bl->nodes[state].dict;
+             s > 0; s = bl->nodes[s].dict)
+        {
+            for (int o = bl->nodes[s].output; o >= 0; o = bl->outputs[o].next)
+            {
+                const Output &out = bl->outputs[o];
+                if (satisfy(*bl, out.rule, out.clause, lower_host))
+                {
+                    rule = bl->rules[out.rule].text;
+                    return true;
+                }
+            }
+        }
+    }
+
     return false;
 }
@@ -0,0 +1,155 @@
+#include "capture.h"
+#include "access_log.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+static const size_t WRITE_BUFFER_SIZE = 256 * 1024;
+
+static mutex capture_mutex;
+static atomic<bool> enabled(false);
+
+static int capture_fd = -1;
+static uint64_t start_unix_us = 0;
+static vector<char> write_buffer;
+static chrono::steady_clock::time_point last_flush;
+
+static uint64_t unix_now_us()
+{
+    return chrono::duration_cast<chrono::microseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+static void write_out_locked()
+{
+    size_t done = 0;
+    while (done < write_buffer.size() && capture_fd >= 0)
+    {
+        ssize_t n = write(capture_fd, write_buffer.data() + done,
+                          write_buffer.size() - done);
+        if (n <= 0)
+        {
+            cerr << "[ERROR] Capture write failed" << endl;
+            break;
+        }
+        done += n;
+    }
+
+    write_buffer.clear();
+    last_flush = chrono::steady_clock::now();
+}
+
+// An existing capture is extended (for example by the process that
+// takes over after a hot upgrade), keeping its time base
+bool init_capture(const string &path)
+{
+    lock_guard<mutex> lock(capture_mutex);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        cerr << "[ERROR] Could not open capture file: " << path << endl;
+        return false;
+    }
+
+    CaptureHeader header{};
+    struct stat st{};
+    fstat(fd, &st);
+
+    if (st.st_size == 0)
+    {
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.version = CAPTURE_VERSION;
+        header.start_unix_us = unix_now_us();
+        if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+        {
+            close(fd);
+            cerr << "[ERROR] Could not write capture file: " << path << endl;
+            return false;
+        }
+    }
+    else if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+             memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+             header.version != CAPTURE_VERSION)
+    {
+        close(fd);
+        cerr << "[ERROR] Not a capture file: " << path << endl;
+        return false;
+    }
+
+    capture_fd = fd;
+    start_unix_us = header.start_unix_us;
+    write_buffer.reserve(WRITE_BUFFER_SIZE);
+    last_flush = chrono::steady_clock::now();
+    enabled.store(true);
+
+    cout << "[INFO] Capturing traffic to " << path << endl;
+    return true;
+}
+
+bool capture_enabled()
+{
+    return enabled.load(memory_order_relaxed);
+}
+
+void capture_request(uint64_t accepted_us, const string &method,
+                     const string &host, int port,
+                     AccessOutcome outcome, int status,
+                     size_t header_bytes, size_t request_bytes,
+                     size_t response_bytes, uint64_t first_byte_us)
+{
+    if (!capture_enabled())
+        return;
+
+    // The trace clock is per process; the file needs wall time
+    uint64_t now_trace = trace_now_us();
+    uint64_t duration_us = now_trace > accepted_us ? now_trace - accepted_us : 0;
+    uint64_t accepted_unix = unix_now_us() - duration_us;
+
+    CaptureRecord rec{};
+    rec.start_us = accepted_unix > start_unix_us ? accepted_unix - start_unix_us : 0;
+    rec.request_bytes = request_bytes;
+    rec.response_bytes = response_bytes;
+    rec.header_bytes = min<size_t>(header_bytes, UINT32_MAX);
+    rec.first_byte_us = min<uint64_t>(first_byte_us, UINT32_MAX);
+    rec.duration_us = min<uint64_t>(duration_us, UINT32_MAX);
+    rec.port = port;
+    rec.status = status;
+    rec.method = method_code(method);
+    rec.outcome = outcome;
+    rec.host_length = min<size_t>(host.size(), 255);
+
+    lock_guard<mutex> lock(capture_mutex);
+
+    size_t len = sizeof(rec) + rec.host_length;
+    if (write_buffer.size() + len > WRITE_BUFFER_SIZE ||
+        chrono::steady_clock::now() - last_flush > chrono::seconds(1))
+        write_out_locked();
+
+    const char *bytes = reinterpret_cast<const char *>(&rec);
+    write_buffer.insert(write_buffer.end(), bytes, bytes + sizeof(rec));
+    write_buffer.insert(write_buffer.end(), host.data(),
+                        host.data() + rec.host_length);
+}
+
+void flush_capture()
+{
+    lock_guard<mutex> lock(capture_mutex);
+    if (capture_fd < 0)
+        return;
+
+    write_out_locked();
+}
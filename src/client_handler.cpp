@@ -5,19 +5,121 @@
 #include "logger.h"
 #include "metrics.h"
 #include "task.h"
+#include "trace.h"
+#include "socket_tuning.h"
+#include "rate_limiter.h"
+#include "timeouts.h"
+#include "access_log.h"
+#include "upstream_pool.h"
+#include "memory_budget.h"
+#include "capture.h"
+#include "http2.h"
 
 #include <sys/time.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 
-extern int g_socket_timeout;
+extern atomic<int> g_socket_timeout;
+extern atomic<bool> g_text_access_log;
+extern atomic<bool> g_reverse_proxy;
 
 using namespace std;
-void handle_client(const Task &task)
+
+// One access entry per request, in the text log, the binary log or both,
+// plus a capture record when traffic capture is on
+static void log_request(const Task &task, const HttpRequest &req,
+                        AccessOutcome outcome, int status,
+                        const RelayStats &relay,
+                        chrono::steady_clock::time_point start)
+{
+    size_t bytes = relay.total();
+
+    if (capture_enabled())
+        capture_request(task.enqueue_us, req.method, req.host, req.port,
+                        outcome, status, req.header_length,
+                        relay.request_bytes, relay.response_bytes,
+                        relay.first_byte_us);
+
+    if (access_log_enabled())
+    {
+        uint32_t duration_ms = chrono::duration_cast<chrono::milliseconds>(
+                                   chrono::steady_clock::now() - start)
+                                   .count();
+        log_access(task.client_ip, task.client_port,
+                   req.method, req.host, req.port,
+                   outcome, status, bytes, duration_ms);
+    }
+
+    if (!g_text_access_log.load())
+        return;
+
+    log_event(
+        task.client_ip + ":" + to_string(task.client_port) +
+        " | \"" + req.method + " " + req.path + " HTTP/1.0\"" +
+        " | " + req.host + ":" + to_string(req.port) +
+        " | " + outcome_name(outcome) + " | " + to_string(status) +
+        " | bytes=" + to_string(bytes));
+}
+
+static void reply_and_close(int client_fd, const char *resp)
+{
+    send(client_fd, resp, strlen(resp), MSG_NOSIGNAL);
+    timeouts_end();
+    close(client_fd);
+}
+
+// Reverse proxy: relay to a backend from the vhost's pool
+static size_t forward_to_backend(const Task &task, const HttpRequest &req,
+                                 chrono::steady_clock::time_point start)
+{
+    shared_ptr<Backend> backend;
+    if (req.method != "CONNECT")
+        backend = pick_backend(req.host);
+
+    if (!backend)
+    {
+        rate_limit_release();
+        record_upstream_unavailable();
+
+        bool known = req.method != "CONNECT" && has_upstream_pool(req.host);
+        log_request(task, req, OUTCOME_UNAVAILABLE, known ? 503 : 404,
+                    RelayStats(), start);
+        reply_and_close(task.client_fd,
+                        known ? "HTTP/1.0 503 Service Unavailable\r\n"
+                                "Content-Length: 0\r\n\r\n"
+                              : "HTTP/1.0 404 Not Found\r\n"
+                                "Content-Length: 0\r\n\r\n");
+        return 0;
+    }
+
+    UpstreamTarget target;
+    target.addr = backend->addr;
+
+    RelayStats relay;
+    size_t bytes = forward_tcp(task.client_fd, req, task.client_ip, &target,
+                               &relay);
+    release_backend(backend, target.responded, target.first_byte_us);
+
+    rate_limit_release();
+    record_allowed(req.host, bytes);
+    log_request(task, req, OUTCOME_ALLOWED, target.responded ? 200 : 502,
+                relay, start);
+    return bytes;
+}
+
+size_t handle_client(const Task &task)
 {
+    ConnectionMemoryScope connection_memory;
     HttpRequest req;
+    RelayStats relay;
     size_t bytes = 0;
+    auto start = chrono::steady_clock::now();
+
+    trace_set_current(task.trace_id);
+    TraceSpan request_span("request");
 
     timeval tv{};
     tv.tv_sec = g_socket_timeout;
@@ -25,61 +127,90 @@ void handle_client(const Task &task)
 
     setsockopt(task.client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     setsockopt(task.client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    tune_client_socket(task.client_fd);
+    timeouts_begin(task.client_fd);
+
+    bool parsed;
+    {
+        TraceSpan span("parse");
+        parsed = parse_http_request(task.client_fd, req);
+    }
 
-    if (!parse_http_request(task.client_fd, req))
+    if (!parsed)
     {
+        timeouts_end();
         close(task.client_fd);
-        return;
+        return 0;
     }
 
-    string request_line =
-        req.method + " " + req.path + " HTTP/1.0";
+    timeouts_header_done();
 
-    string host_port =
-        req.host + ":" + to_string(req.port);
+    // HTTP/2 by prior knowledge, or an h2c upgrade of a request without
+    // a body; streams come back here as HTTP/1.1 requests
+    if (!task.http2_stream && http2_enabled() &&
+        (is_h2_preface(req) ||
+         (req.h2c_upgrade && req.content_length <= 0 && !req.chunked)))
+        return serve_http2(task, req);
 
-    // BLOCKED
-    if (is_blocked(req.host))
+    if (is_h2_preface(req))
     {
-        record_blocked();
-        log_event(
-            task.client_ip + ":" + to_string(task.client_port) +
-            " | \"" + request_line + "\"" +
-            " | " + host_port +
-            " | BLOCKED | 403 | bytes=0");
-
-        const char *resp =
-            "HTTP/1.0 403 Forbidden\r\n"
-            "Content-Length: 0\r\n\r\n";
-
-        send(task.client_fd, resp, strlen(resp), MSG_NOSIGNAL);
+        timeouts_end();
         close(task.client_fd);
-        return;
+        return 0;
+    }
+
+    MemoryCharge request_memory(MEM_REQUESTS,
+                                sizeof(req) + req.raw_request.capacity());
+
+    bool blocked;
+    string block_rule;
+    {
+        TraceSpan span("blocklist");
+        blocked = is_blocked(req.host, req.path, block_rule);
+    }
+
+    // BLOCKED
+    if (blocked)
+    {
+        record_blocked(block_rule);
+        log_request(task, req, OUTCOME_BLOCKED, 403, RelayStats(), start);
+
+        reply_and_close(task.client_fd,
+                        "HTTP/1.0 403 Forbidden\r\n"
+                        "Content-Length: 0\r\n\r\n");
+        return 0;
+    }
+
+    // RATE LIMITED
+    if (!rate_limit_admit(task.client_ip))
+    {
+        rate_limit_release();
+        record_rate_limited();
+        log_request(task, req, OUTCOME_RATE_LIMITED, 429, RelayStats(), start);
+
+        reply_and_close(task.client_fd,
+                        "HTTP/1.0 429 Too Many Requests\r\n"
+                        "Content-Length: 0\r\n\r\n");
+        return 0;
     }
 
+    if (g_reverse_proxy.load())
+        return forward_to_backend(task, req, start);
+
     // CONNECT
     if (req.method == "CONNECT")
     {
-        bytes = tunnel_tcp(task.client_fd, req);
+        bytes = tunnel_tcp(task.client_fd, req, &relay);
+        rate_limit_release();
         record_allowed(req.host, bytes);
-
-        log_event(
-            task.client_ip + ":" + to_string(task.client_port) +
-            " | \"" + request_line + "\"" +
-            " | " + host_port +
-            " | ALLOWED | 200 | bytes=" +
-            to_string(bytes));
-        return;
+        log_request(task, req, OUTCOME_ALLOWED, 200, relay, start);
+        return bytes;
     }
 
     // HTTP
-    bytes = forward_tcp(task.client_fd, req);
+    bytes = forward_tcp(task.client_fd, req, task.client_ip, nullptr, &relay);
+    rate_limit_release();
     record_allowed(req.host, bytes);
-
-    log_event(
-        task.client_ip + ":" + to_string(task.client_port) +
-        " | \"" + request_line + "\"" +
-        " | " + host_port +
-        " | ALLOWED | 200 | bytes=" +
-        to_string(bytes));
+    log_request(task, req, OUTCOME_ALLOWED, 200, relay, start);
+    return bytes;
 }
@@ -0,0 +1,330 @@
+#include "compressor.h"
+#include "metrics.h"
+
+#include <memory>
+#include <ctime>
+#include <cstdlib>
+#include <strings.h>
+#include <cstring>
+
+using namespace std;
+
+// Replaced wholesale on reload; readers take a snapshot per response
+static shared_ptr<const CompressionSettings> current_settings =
+    make_shared<const CompressionSettings>();
+
+// Larger headers are passed through rather than buffered further
+static const size_t MAX_HEADER_SIZE = 64 * 1024;
+
+// zlib's deflate state for windowBits 15 and memLevel 8:
+// (1 << (windowBits + 2)) + (1 << (memLevel + 9)) plus a few KB
+static const size_t DEFLATE_MEMORY = (1 << 17) + (1 << 17) + 6 * 1024;
+
+void set_compression(const CompressionSettings &settings)
+{
+    atomic_store(&current_settings,
+                 shared_ptr<const CompressionSettings>(
+                     make_shared<CompressionSettings>(settings)));
+}
+
+static uint64_t thread_cpu_us()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static string lower(string s)
+{
+    for (char &c : s)
+        c = tolower(static_cast<unsigned char>(c));
+    return s;
+}
+
+// True if the coding is listed in Accept-Encoding without q=0
+static bool accepts(const string &accept_encoding, const string &coding)
+{
+    string value = lower(accept_encoding);
+    size_t pos = 0;
+
+    while (pos < value.size())
+    {
+        size_t comma = value.find(',', pos);
+        string item = value.substr(pos, comma == string::npos
+                                            ? string::npos
+                                            : comma - pos);
+        pos = comma == string::npos ? value.size() : comma + 1;
+
+        size_t b = item.find_first_not_of(" \t");
+        if (b == string::npos)
+            continue;
+        item = item.substr(b);
+
+        size_t semi = item.find(';');
+        string name = item.substr(0, semi);
+        name = name.substr(0, name.find_last_not_of(" \t") + 1);
+        if (name != coding)
+            continue;
+
+        if (semi != string::npos)
+        {
+            size_t q = item.find("q=", semi);
+            if (q != string::npos && strtod(item.c_str() + q + 2, nullptr) <= 0.0)
+                return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Header value from a response header block, "" if absent
+static string header_value(const string &headers, const char *name)
+{
+    size_t name_len = strlen(name);
+    size_t pos = headers.find("\r\n");
+
+    while (pos != string::npos)
+    {
+        size_t start = pos + 2;
+        size_t end = headers.find("\r\n", start);
+        if (end == string::npos || end == start)
+            break;
+
+        if (end - start > name_len && headers[start + name_len] == ':' &&
+            strncasecmp(headers.c_str() + start, name, name_len) == 0)
+        {
+            size_t v = headers.find_first_not_of(" \t", start + name_len + 1);
+            return (v == string::npos || v >= end) ? "" : headers.substr(v, end - v);
+        }
+        pos = end;
+    }
+    return "";
+}
+
+ResponseCompressor::ResponseCompressor(const string &method,
+                                       const string &accept_encoding)
+{
+    shared_ptr<const CompressionSettings> settings =
+        atomic_load(&current_settings);
+
+    if (!settings->enabled || accept_encoding.empty() || method == "HEAD")
+        return;
+
+    if (accepts(accept_encoding, "gzip"))
+        encoding = GZIP;
+    else if (accepts(accept_encoding, "deflate"))
+        encoding = DEFLATE;
+
+    level = settings->level;
+    min_size = settings->min_size;
+    types = settings->types;
+}
+
+ResponseCompressor::~ResponseCompressor()
+{
+    if (stream_ready)
+        deflateEnd(&stream);
+
+    if (compressing)
+        record_compression(bytes_in, bytes_out, cpu_us);
+}
+
+// True if a comma-separated header value lists token (case-insensitive)
+static bool lists_token(const string &value, const string &token)
+{
+    size_t pos = 0;
+    while (pos <= value.size())
+    {
+        size_t comma = value.find(',', pos);
+        if (comma == string::npos)
+            comma = value.size();
+
+        size_t b = value.find_first_not_of(" \t", pos);
+        size_t e = value.find_last_not_of(" \t", comma - 1);
+        if (b < comma && e != string::npos && e >= b &&
+            lower(value.substr(b, e - b + 1)) == token)
+            return true;
+        pos = comma + 1;
+    }
+    return false;
+}
+
+// Decides from the complete response header whether to compress, and
+// emits either the rewritten or the original header
+bool ResponseCompressor::start_body(string &out)
+{
+    size_t header_end = headers.find("\r\n\r\n") + 4;
+    string head = headers.substr(0, header_end);
+    string body = headers.substr(header_end);
+
+    string status_line = head.substr(0, head.find("\r\n"));
+    size_t sp = status_line.find(' ');
+    int status = sp == string::npos ? 0 : atoi(status_line.c_str() + sp + 1);
+
+    string type = lower(header_value(head, "Content-Type"));
+    string length = header_value(head, "Content-Length");
+
+    // Only 200 has a body worth compressing; 204 and 304 have none
+    bool eligible = status == 200 &&
+                    header_value(head, "Content-Encoding").empty() &&
+                    header_value(head, "Transfer-Encoding").empty() &&
+                    lower(header_value(head, "Cache-Control")).find("no-transform") == string::npos &&
+                    (length.empty() || strtoull(length.c_str(), nullptr, 10) >= min_size);
+
+    bool type_ok = false;
+    for (const string &prefix : types)
+    {
+        if (type.compare(0, prefix.size(), prefix) == 0)
+        {
+            type_ok = true;
+            break;
+        }
+    }
+
+    if (!eligible || !type_ok)
+    {
+        out.append(headers);
+        headers.clear();
+        return true;
+    }
+
+    // Window bits 15 + 16 selects the gzip wrapper
+    int window_bits = encoding == GZIP ? 15 + 16 : 15;
+    if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        out.append(headers);
+        headers.clear();
+        return true;
+    }
+    stream_ready = true;
+    compressing = true;
+    memory.resize(DEFLATE_MEMORY);
+
+    // Drop Content-Length (the body size changes) and add Accept-Encoding
+    // to the origin's Vary, keeping what it already varies on (Cookie,
+    // Origin, ...) so shared caches still key on it. The encoded body is
+    // no longer byte-identical to the origin's, so a strong ETag becomes
+    // weak.
+    string rewritten = status_line + "\r\n";
+    bool vary_seen = false;
+    bool vary_done = false; // Accept-Encoding or * listed in some Vary
+    for (size_t pos = head.find("\r\n") + 2; pos < head.size() - 2;)
+    {
+        size_t end = head.find("\r\n", pos);
+        size_t colon = head.find(':', pos);
+        if (colon < end && colon - pos == 4 &&
+            strncasecmp(head.c_str() + pos, "vary", 4) == 0)
+        {
+            string value = head.substr(colon + 1, end - colon - 1);
+            vary_seen = true;
+            vary_done = vary_done || lists_token(value, "accept-encoding") ||
+                        lists_token(value, "*");
+        }
+        pos = end + 2;
+    }
+
+    size_t pos = head.find("\r\n") + 2;
+    while (pos < head.size() - 2)
+    {
+        size_t end = head.find("\r\n", pos);
+        string line = head.substr(pos, end - pos);
+        size_t colon = line.find(':');
+        string name = lower(line.substr(0, colon));
+        if (name == "etag" && colon != string::npos)
+        {
+            size_t v = line.find_first_not_of(" \t", colon + 1);
+            if (v != string::npos && line[v] == '"')
+                line.insert(v, "W/");
+        }
+        if (name == "vary" && !vary_done)
+        {
+            bool empty = line.find_first_not_of(" \t", colon + 1) == string::npos;
+            line += empty ? " Accept-Encoding" : ", Accept-Encoding";
+            vary_done = true;
+        }
+        if (name != "content-length")
+            rewritten += line + "\r\n";
+        pos = end + 2;
+    }
+    rewritten += encoding == GZIP ? "Content-Encoding: gzip\r\n"
+                                  : "Content-Encoding: deflate\r\n";
+    if (!vary_seen)
+        rewritten += "Vary: Accept-Encoding\r\n";
+    rewritten += "\r\n";
+
+    out.append(rewritten);
+    headers.clear();
+
+    return deflate_into(body.data(), body.size(), Z_NO_FLUSH, out);
+}
+
+bool ResponseCompressor::deflate_into(const char *data, size_t len,
+                                      int flush, string &out)
+{
+    uint64_t cpu_start = thread_cpu_us();
+    size_t out_start = out.size();
+
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    stream.avail_in = len;
+
+    char chunk[16 * 1024];
+    int rc;
+    do
+    {
+        stream.next_out = reinterpret_cast<Bytef *>(chunk);
+        stream.avail_out = sizeof(chunk);
+
+        rc = deflate(&stream, flush);
+        if (rc == Z_STREAM_ERROR)
+            return false;
+
+        out.append(chunk, sizeof(chunk) - stream.avail_out);
+    } while (stream.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+
+    bytes_in += len;
+    bytes_out += out.size() - out_start;
+    cpu_us += thread_cpu_us() - cpu_start;
+    return true;
+}
+
+bool ResponseCompressor::feed(const char *data, size_t len, string &out)
+{
+    out.clear();
+
+    if (compressing)
+        return deflate_into(data, len, Z_NO_FLUSH, out);
+
+    if (headers_done)
+    {
+        out.assign(data, len);
+        return true;
+    }
+
+    headers.append(data, len);
+
+    if (headers.find("\r\n\r\n") != string::npos)
+    {
+        headers_done = true;
+        return start_body(out);
+    }
+
+    if (headers.size() > MAX_HEADER_SIZE)
+    {
+        headers_done = true;
+        out.swap(headers);
+    }
+    return true;
+}
+
+bool ResponseCompressor::finish(string &out)
+{
+    out.clear();
+
+    if (compressing)
+        return deflate_into(nullptr, 0, Z_FINISH, out);
+
+    // Origin closed before completing its header: pass along what came
+    out.swap(headers);
+    return true;
+}
@@ -1,15 +1,35 @@
 #include "config.h"
+#include "socket_tuning.h"
+#include "rate_limiter.h"
+#include "timeouts.h"
+#include "compressor.h"
+#include "cpu_affinity.h"
+#include "request_rewriter.h"
+#include "http2.h"
+#include "upstream_pool.h"
+#include "memory_budget.h"
+#include "metrics.h"
 
 #include <fstream>
 #include <iostream>
 #include <cstdlib>
-
-size_t g_buffer_size = 4096;
-int g_default_http_port = 80;
-int g_socket_timeout = 5;
+#include <atomic>
+#include <mutex>
 
 using namespace std;
 
+// Read concurrently by workers; replaced on SIGHUP reload
+atomic<size_t> g_buffer_size(4096);
+atomic<size_t> g_max_buffer_size(262144);
+atomic<bool> g_adaptive_buffers(true);
+atomic<int> g_default_http_port(80);
+atomic<int> g_socket_timeout(5);
+atomic<bool> g_text_access_log(true);
+atomic<bool> g_reverse_proxy(false);
+
+static string config_path;
+static mutex config_mutex;
+
 static string trim(const string &s)
 {
     size_t b = s.find_first_not_of(" \t");
@@ -19,6 +39,11 @@ static string trim(const string &s)
     return s.substr(b, e - b + 1);
 }
 
+static bool parse_bool(const string &val)
+{
+    return val == "on" || val == "true" || val == "yes" || val == "1";
+}
+
 bool load_config(const string &path, RuntimeConfig &cfg)
 {
     ifstream file(path);
@@ -28,6 +53,11 @@ bool load_config(const string &path, RuntimeConfig &cfg)
         return false;
     }
 
+    {
+        lock_guard<mutex> lock(config_mutex);
+        config_path = path;
+    }
+
     string line;
     while (getline(file, line))
     {
@@ -48,21 +78,275 @@ bool load_config(const string &path, RuntimeConfig &cfg)
             cfg.listen_port = stoi(val);
         else if (key == "thread_pool_size")
             cfg.thread_pool_size = stoi(val);
+        else if (key == "autoscale")
+            cfg.autoscale = parse_bool(val);
+        else if (key == "min_threads")
+            cfg.min_threads = stoi(val);
+        else if (key == "max_threads")
+            cfg.max_threads = stoi(val);
+        else if (key == "autoscale_target_wait_ms")
+            cfg.autoscale_target_wait_ms = stoi(val);
+        else if (key == "max_connections_per_client")
+            cfg.max_connections_per_client = stoi(val);
+        else if (key == "fair_quantum_ms")
+            cfg.fair_quantum_ms = stod(val);
+        else if (key == "worker_processes")
+            cfg.worker_processes = stoi(val);
+        else if (key == "reuseport")
+            cfg.reuseport = parse_bool(val);
+        else if (key == "worker_cpus")
+            cfg.worker_cpus = val;
+        else if (key == "steer_incoming_cpu")
+            cfg.steer_incoming_cpu = parse_bool(val);
         else if (key == "buffer_size")
             cfg.buffer_size = stoul(val);
+        else if (key == "max_buffer_size")
+            cfg.max_buffer_size = stoul(val);
+        else if (key == "adaptive_buffers")
+            cfg.adaptive_buffers = parse_bool(val);
+        else if (key == "tcp_nodelay")
+            cfg.tcp_nodelay = parse_bool(val);
+        else if (key == "so_sndbuf")
+            cfg.so_sndbuf = stoi(val);
+        else if (key == "so_rcvbuf")
+            cfg.so_rcvbuf = stoi(val);
+        else if (key == "tcp_notsent_lowat")
+            cfg.tcp_notsent_lowat = stoi(val);
+        else if (key == "tcp_quickack")
+            cfg.tcp_quickack = parse_bool(val);
+        else if (key == "tcp_fastopen")
+            cfg.tcp_fastopen = stoi(val);
         else if (key == "default_http_port")
             cfg.default_http_port = stoi(val);
+        else if (key == "add_via_header")
+            cfg.add_via_header = parse_bool(val);
+        else if (key == "add_x_forwarded_for")
+            cfg.add_x_forwarded_for = parse_bool(val);
         else if (key == "log_file")
             cfg.log_file = val;
         else if (key == "max_log_size")
             cfg.max_log_size = stoul(val);
+        else if (key == "access_log_format")
+            cfg.access_log_format = val;
+        else if (key == "access_log_dir")
+            cfg.access_log_dir = val;
+        else if (key == "access_log_segment_size")
+            cfg.access_log_segment_size = stoul(val);
+        else if (key == "http2")
+            cfg.http2 = parse_bool(val);
+        else if (key == "h2_max_concurrent_streams")
+            cfg.h2_max_concurrent_streams = stoi(val);
+        else if (key == "h2_initial_window_size")
+            cfg.h2_initial_window_size = stoi(val);
+        else if (key == "reverse_proxy")
+            cfg.reverse_proxy = parse_bool(val);
+        else if (key == "upstreams_file")
+            cfg.upstreams_file = val;
+        else if (key == "lb_policy")
+            cfg.lb_policy = val;
+        else if (key == "health_check_interval")
+            cfg.health_check_interval = stoi(val);
+        else if (key == "health_check_timeout_ms")
+            cfg.health_check_timeout_ms = stoi(val);
+        else if (key == "health_check_path")
+            cfg.health_check_path = val;
+        else if (key == "outlier_failures")
+            cfg.outlier_failures = stoi(val);
+        else if (key == "outlier_ejection_sec")
+            cfg.outlier_ejection_sec = stoi(val);
         else if (key == "blocklist_file")
             cfg.blocklist_file = val;
         else if (key == "socket_timeout")
             cfg.socket_timeout = stoi(val);
+        else if (key == "header_timeout")
+            cfg.header_timeout = stoi(val);
+        else if (key == "idle_timeout")
+            cfg.idle_timeout = stoi(val);
+        else if (key == "max_connection_lifetime")
+            cfg.max_connection_lifetime = stoi(val);
+        else if (key == "drain_timeout")
+            cfg.drain_timeout = stoi(val);
+        else if (key == "capture_file")
+            cfg.capture_file = val;
         else if (key == "metrics_file")
             cfg.metrics_file = val;
+        else if (key == "metrics_max_hosts")
+            cfg.metrics_max_hosts = stoul(val);
+        else if (key == "memory_budget_mb")
+            cfg.memory_budget_mb = stoul(val);
+        else if (key == "memory_pause_percent")
+            cfg.memory_pause_percent = stoi(val);
+        else if (key == "compression")
+            cfg.compression = parse_bool(val);
+        else if (key == "compression_level")
+            cfg.compression_level = stoi(val);
+        else if (key == "compression_min_size")
+            cfg.compression_min_size = stoul(val);
+        else if (key == "compression_types")
+            cfg.compression_types = val;
+        else if (key == "rate_limit_bytes_per_sec")
+            cfg.rate_limit_bytes_per_sec = stod(val);
+        else if (key == "rate_limit_burst_bytes")
+            cfg.rate_limit_burst_bytes = stod(val);
+        else if (key == "rate_limit_requests_per_sec")
+            cfg.rate_limit_requests_per_sec = stod(val);
+        else if (key == "rate_limit_burst_requests")
+            cfg.rate_limit_burst_requests = stod(val);
+        else if (key == "rate_limit_max_wait_ms")
+            cfg.rate_limit_max_wait_ms = stoi(val);
+        else if (key == "rate_limit_idle_evict_sec")
+            cfg.rate_limit_idle_evict_sec = stoi(val);
+        else if (key == "trace_sample_rate")
+            cfg.trace_sample_rate = stod(val);
+        else if (key == "trace_buffer_spans")
+            cfg.trace_buffer_spans = stoul(val);
+        else if (key == "trace_file")
+            cfg.trace_file = val;
     }
 
     return true;
 }
+
+bool reload_config(RuntimeConfig &cfg)
+{
+    string path;
+    {
+        lock_guard<mutex> lock(config_mutex);
+        path = config_path;
+    }
+
+    if (path.empty())
+        return false;
+
+    // A bad value must not take down a running server
+    try
+    {
+        return load_config(path, cfg);
+    }
+    catch (const exception &e)
+    {
+        cerr << "[ERROR] Invalid value in config file: "
+             << path << " (" << e.what() << ")" << endl;
+        return false;
+    }
+}
+
+// "0-3,8,10-11" -> 0 1 2 3 8 10 11
+static bool parse_cpu_list(const string &list, vector<int> &cpus)
+{
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        size_t comma = list.find(',', pos);
+        if (comma == string::npos)
+            comma = list.size();
+        string item = trim(list.substr(pos, comma - pos));
+        pos = comma + 1;
+
+        if (item.empty())
+            continue;
+
+        char *end = nullptr;
+        long first = strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+
+        if (*end != '\0' || first < 0 || last < first)
+        {
+            cpus.clear();
+            return false;
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(static_cast<int>(cpu));
+    }
+    return true;
+}
+
+void publish_runtime_config(const RuntimeConfig &cfg)
+{
+    g_buffer_size.store(cfg.buffer_size > 0 ? cfg.buffer_size : 4096);
+    g_max_buffer_size.store(cfg.max_buffer_size);
+    g_adaptive_buffers.store(cfg.adaptive_buffers);
+    g_default_http_port.store(cfg.default_http_port);
+    g_socket_timeout.store(cfg.socket_timeout);
+    g_text_access_log.store(cfg.access_log_format != "binary");
+    g_reverse_proxy.store(cfg.reverse_proxy);
+
+    SocketTuning tuning;
+    tuning.tcp_nodelay = cfg.tcp_nodelay;
+    tuning.so_sndbuf = cfg.so_sndbuf;
+    tuning.so_rcvbuf = cfg.so_rcvbuf;
+    tuning.tcp_notsent_lowat = cfg.tcp_notsent_lowat;
+    tuning.tcp_quickack = cfg.tcp_quickack;
+    tuning.tcp_fastopen = cfg.tcp_fastopen;
+    set_socket_tuning(tuning);
+
+    RateLimitSettings limits;
+    limits.bytes_per_sec = cfg.rate_limit_bytes_per_sec;
+    limits.burst_bytes = cfg.rate_limit_burst_bytes;
+    limits.requests_per_sec = cfg.rate_limit_requests_per_sec;
+    limits.burst_requests = cfg.rate_limit_burst_requests;
+    limits.max_request_wait_ms = cfg.rate_limit_max_wait_ms;
+    limits.idle_evict_sec = cfg.rate_limit_idle_evict_sec;
+    set_rate_limits(limits);
+
+    TimeoutSettings timeouts;
+    timeouts.header_timeout = cfg.header_timeout;
+    timeouts.idle_timeout = cfg.idle_timeout;
+    timeouts.max_lifetime = cfg.max_connection_lifetime;
+    set_timeouts(timeouts);
+
+    CompressionSettings compression;
+    compression.enabled = cfg.compression;
+    compression.level = cfg.compression_level;
+    compression.min_size = cfg.compression_min_size;
+    size_t pos = 0;
+    while (pos <= cfg.compression_types.size())
+    {
+        size_t comma = cfg.compression_types.find(',', pos);
+        if (comma == string::npos)
+            comma = cfg.compression_types.size();
+        string type = trim(cfg.compression_types.substr(pos, comma - pos));
+        if (!type.empty())
+            compression.types.push_back(type);
+        pos = comma + 1;
+    }
+    set_compression(compression);
+
+    RewriteSettings rewrite;
+    rewrite.add_via = cfg.add_via_header;
+    rewrite.add_x_forwarded_for = cfg.add_x_forwarded_for;
+    set_rewrite(rewrite);
+
+    Http2Settings http2;
+    http2.enabled = cfg.http2;
+    http2.max_concurrent_streams = cfg.h2_max_concurrent_streams;
+    http2.initial_window_size = cfg.h2_initial_window_size;
+    set_http2_settings(http2);
+
+    UpstreamSettings upstream;
+    upstream.policy = cfg.lb_policy == "p2c_ewma" ? BALANCE_P2C_EWMA
+                                                  : BALANCE_LEAST_CONN;
+    upstream.health_check_interval = cfg.health_check_interval;
+    upstream.health_check_timeout_ms = cfg.health_check_timeout_ms;
+    upstream.health_check_path = cfg.health_check_path;
+    upstream.eject_after_failures = cfg.outlier_failures;
+    upstream.ejection_sec = cfg.outlier_ejection_sec;
+    set_upstream_settings(upstream);
+
+    AffinitySettings affinity;
+    affinity.steer_incoming_cpu = cfg.steer_incoming_cpu;
+    if (!parse_cpu_list(cfg.worker_cpus, affinity.cpus))
+        cerr << "[ERROR] Invalid worker_cpus, workers are not pinned" << endl;
+    set_affinity(affinity);
+
+    MemorySettings memory;
+    // The budget covers the whole proxy: prefork workers get equal shares
+    memory.budget = cfg.memory_budget_mb * 1024 * 1024 /
+                    max(1, cfg.worker_processes);
+    memory.pause_percent = cfg.memory_pause_percent;
+    set_memory_settings(memory);
+    set_metrics_max_hosts(cfg.metrics_max_hosts);
+}
@@ -0,0 +1,98 @@
+#include "cpu_affinity.h"
+#include "logger.h"
+
+#include <sys/socket.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+static shared_ptr<const AffinitySettings> current =
+    make_shared<AffinitySettings>();
+static atomic<unsigned> generation(1);
+
+// Per worker: settings generation last applied and the resulting CPU
+static thread_local unsigned applied_generation = 0;
+static thread_local int pinned_cpu = -1;
+
+void set_affinity(const AffinitySettings &settings)
+{
+    atomic_store(&current,
+                 shared_ptr<const AffinitySettings>(
+                     make_shared<AffinitySettings>(settings)));
+    generation.fetch_add(1);
+}
+
+// NUMA node of a CPU from sysfs, or -1 on single-node or unknown layouts
+static int cpu_node(int cpu)
+{
+    for (int node = 0; node < 64; ++node)
+    {
+        string path = "/sys/devices/system/cpu/cpu" + to_string(cpu) +
+                      "/node" + to_string(node);
+        if (access(path.c_str(), F_OK) == 0)
+            return node;
+    }
+    return -1;
+}
+
+int apply_worker_affinity(size_t index)
+{
+    unsigned gen = generation.load(memory_order_relaxed);
+    if (gen == applied_generation)
+        return pinned_cpu;
+    applied_generation = gen;
+
+    shared_ptr<const AffinitySettings> settings = atomic_load(&current);
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if (settings->cpus.empty())
+    {
+        if (pinned_cpu < 0)
+            return -1;
+
+        // Pinning was turned off: float across all CPUs again
+        long count = sysconf(_SC_NPROCESSORS_CONF);
+        for (long cpu = 0; cpu < count && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        pinned_cpu = -1;
+        return -1;
+    }
+
+    int cpu = settings->cpus[index % settings->cpus.size()];
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return pinned_cpu;
+    CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    {
+        log_event("WORKER PIN FAILED | worker=" + to_string(index) +
+                  " | cpu=" + to_string(cpu));
+        return pinned_cpu;
+    }
+
+    pinned_cpu = cpu;
+    log_event("WORKER PIN | worker=" + to_string(index) +
+              " | cpu=" + to_string(cpu) +
+              " | node=" + to_string(cpu_node(cpu)));
+    return cpu;
+}
+
+int incoming_cpu(int fd)
+{
+    if (!atomic_load(&current)->steer_incoming_cpu)
+        return -1;
+
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+        return -1;
+    return cpu;
+}
@@ -3,16 +3,33 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <cerrno>
+#include <algorithm>
 #include <vector>
+#include <atomic>
 #include <cstring>
 
 #include "forwarder.h"
+#include "trace.h"
+#include "socket_tuning.h"
+#include "rate_limiter.h"
+#include "timeouts.h"
+#include "compressor.h"
+#include "request_rewriter.h"
+#include "memory_budget.h"
 #include <sys/time.h>
 
 using namespace std;
 
-extern size_t g_buffer_size;
-extern int g_socket_timeout;
+extern atomic<int> g_socket_timeout;
+
+static const char BAD_GATEWAY[] =
+    "HTTP/1.0 502 Bad Gateway\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+// Longest a relay waits for memory to free up before reading anyway
+static const int MEMORY_PAUSE_MS = 100;
 
 static void set_socket_timeout(int fd)
 {
@@ -24,6 +41,21 @@ static void set_socket_timeout(int fd)
     setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 }
 
+// Deadlines must stop tracking the sockets before their fds are reused
+static void close_pair(int server_fd, int client_fd)
+{
+    TraceSpan span("close");
+    timeouts_end();
+    close(server_fd);
+    close(client_fd);
+}
+
+static void close_client(int client_fd)
+{
+    timeouts_end();
+    close(client_fd);
+}
+
 static bool send_all(int fd, const char *buf, size_t len)
 {
     size_t total_sent = 0;
@@ -42,106 +74,331 @@ static bool send_all(int fd, const char *buf, size_t len)
     return true;
 }
 
-size_t forward_tcp(int client_fd, const HttpRequest &req)
+// Resolves and connects to the request's origin, or to target when
+// given; -1 on failure
+static int connect_upstream(int client_fd, const HttpRequest &req,
+                            const UpstreamTarget *target)
 {
-    vector<char> buffer(g_buffer_size);
-    size_t total_bytes = 0;
-
-    hostent *host = gethostbyname(req.host.c_str());
-    if (!host)
+    sockaddr_in addr{};
+    if (target)
     {
-        close(client_fd);
-        return 0;
+        addr = target->addr;
+    }
+    else
+    {
+        hostent *host;
+        {
+            TraceSpan span("dns");
+            host = gethostbyname(req.host.c_str());
+        }
+        if (!host)
+            return -1;
+
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(req.port);
+        memcpy(&addr.sin_addr, host->h_addr, host->h_length);
     }
 
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0)
-    {
-        close(client_fd);
-        return 0;
-    }
+        return -1;
 
     set_socket_timeout(server_fd);
     set_socket_timeout(client_fd);
+    tune_upstream_socket(server_fd);
+    timeouts_watch_upstream(server_fd);
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(req.port);
-    memcpy(&addr.sin_addr, host->h_addr, host->h_length);
-
-    if (connect(server_fd,
-                (sockaddr *)&addr,
-                sizeof(addr)) < 0)
+    int rc;
     {
-        close(server_fd);
-        close(client_fd);
-        return 0;
+        TraceSpan span("connect");
+        rc = connect(server_fd, (sockaddr *)&addr, sizeof(addr));
     }
-
-    if (!send_all(server_fd,
-                  req.raw_request.c_str(),
-                  req.raw_request.size()))
+    if (rc < 0)
     {
+        timeouts_watch_upstream(-1);
         close(server_fd);
-        close(client_fd);
-        return 0;
+        return -1;
     }
 
-    while (true)
+    return server_fd;
+}
+
+// One relay direction. At most one buffer of data is held at a time:
+// the source is only read once everything read before has been written,
+// so a slow reader on one side throttles the writer on the other.
+struct RelayPipe
+{
+    RelayPipe(int from, int to) : from(from), to(to) {}
+
+    int from;
+    int to;
+    RelayBuffer buffer;
+    const char *data = nullptr; // pending bytes: buffer or transformed output
+    size_t offset = 0;
+    size_t pending = 0;
+    bool open = true;
+};
+
+// Reads one buffer from the pipe's source. For the request direction,
+// limit caps how much of the read belongs to the body.
+static ssize_t fill_pipe(RelayPipe &pipe, size_t limit)
+{
+    size_t want = min(pipe.buffer.size(), limit);
+    ssize_t n = recv(pipe.from, pipe.buffer.data(), want, MSG_DONTWAIT);
+    if (n > 0)
     {
-        ssize_t bytes = recv(server_fd,
-                             buffer.data(),
-                             buffer.size(),
-                             0);
-        if (bytes <= 0)
-            break;
+        pipe.data = pipe.buffer.data();
+        pipe.offset = 0;
+        pipe.pending = n;
+    }
+    return n;
+}
 
-        if (!send_all(client_fd,
-                      buffer.data(),
-                      bytes))
-            break;
+// Writes as much pending data as the destination accepts without
+// blocking. Returns false on error.
+static bool drain_pipe(RelayPipe &pipe)
+{
+    while (pipe.pending > 0)
+    {
+        ssize_t n = send(pipe.to,
+                         pipe.data + pipe.offset,
+                         pipe.pending,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (n <= 0)
+            return false;
 
-        total_bytes += bytes;
+        pipe.offset += n;
+        pipe.pending -= n;
     }
-
-    close(server_fd);
-    close(client_fd);
-    return total_bytes;
+    return true;
 }
 
-size_t tunnel_tcp(int client_fd, const HttpRequest &req)
+size_t forward_tcp(int client_fd, const HttpRequest &req,
+                   const string &client_ip, UpstreamTarget *target,
+                   RelayStats *stats)
 {
-    vector<char> buffer(g_buffer_size);
-    size_t total_bytes = 0;
+    RelayStats relay;
 
-    hostent *host = gethostbyname(req.host.c_str());
-    if (!host)
+    int server_fd = connect_upstream(client_fd, req, target);
+    if (server_fd < 0)
     {
-        close(client_fd);
+        if (target)
+            send(client_fd, BAD_GATEWAY, sizeof(BAD_GATEWAY) - 1, MSG_NOSIGNAL);
+        close_client(client_fd);
         return 0;
     }
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0)
+    RequestRewrite request(req, client_ip);
+    if (!request.send_to(server_fd))
     {
-        close(client_fd);
+        close_pair(server_fd, client_fd);
         return 0;
     }
 
-    set_socket_timeout(server_fd);
-    set_socket_timeout(client_fd);
+    // Work out how much request body is still to come from the client
+    size_t body_seen = req.raw_request.size() - req.header_length;
+    long long body_left = 0;
+    ChunkedDecoder chunks;
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(req.port);
-    memcpy(&addr.sin_addr, host->h_addr, host->h_length);
+    if (req.chunked)
+    {
+        chunks.feed(req.raw_request.data() + req.header_length, body_seen);
+        body_left = chunks.done() || chunks.failed() ? 0 : -1; // until decoder is done
+    }
+    else if (req.content_length > 0)
+    {
+        body_left = max(0LL, req.content_length - (long long)body_seen);
+    }
+
+    RelayPipe up(client_fd, server_fd);
+    RelayPipe down(server_fd, client_fd);
+    up.open = body_left != 0;
+
+    ResponseCompressor compressor(req.method, req.accept_encoding);
+    string transformed;
+    MemoryCharge transformed_memory(MEM_COMPRESSION);
 
-    if (connect(server_fd,
-                (sockaddr *)&addr,
-                sizeof(addr)) < 0)
+    uint64_t wait_start = trace_now_us();
+    bool first_byte = true;
+
+    // Full duplex: the request body streams up while the response
+    // streams down, each direction paced by its destination.
+    while (down.open || down.pending > 0)
     {
-        close(server_fd);
-        close(client_fd);
+        // Nothing buffered: under memory pressure, hold off reading more
+        if (up.pending == 0 && down.pending == 0)
+            memory_pause_reads(MEMORY_PAUSE_MS);
+
+        pollfd fds[2];
+        nfds_t count = 0;
+
+        int up_index = -1;
+        int down_index = -1;
+
+        if (up.open || up.pending > 0)
+        {
+            up_index = count;
+            fds[count].fd = up.pending > 0 ? server_fd : client_fd;
+            fds[count].events = up.pending > 0 ? POLLOUT : POLLIN;
+            fds[count].revents = 0;
+            ++count;
+        }
+
+        down_index = count;
+        fds[count].fd = down.pending > 0 ? client_fd : server_fd;
+        fds[count].events = down.pending > 0 ? POLLOUT : POLLIN;
+        fds[count].revents = 0;
+        ++count;
+
+        int ready = poll(fds, count, g_socket_timeout * 1000);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            break; // error or socket timeout
+
+        bool failed = false;
+
+        if (up_index >= 0 && fds[up_index].revents)
+        {
+            if (up.pending > 0)
+            {
+                failed = !drain_pipe(up);
+                if (up.pending == 0)
+                    up.buffer.record_read(up.offset);
+            }
+            else
+            {
+                size_t limit = body_left > 0 ? (size_t)body_left
+                                             : up.buffer.size();
+                ssize_t n = fill_pipe(up, limit);
+
+                if (n <= 0 && !(n < 0 && errno == EAGAIN))
+                {
+                    failed = true; // client went away mid-body
+                }
+                else if (n > 0)
+                {
+                    if (body_left > 0)
+                    {
+                        body_left -= n;
+                    }
+                    else
+                    {
+                        up.pending = chunks.feed(up.buffer.data(), n);
+                        if (chunks.failed())
+                            failed = true;
+                    }
+
+                    if (body_left == 0 || chunks.done())
+                        up.open = false;
+
+                    relay.request_bytes += up.pending;
+                    rate_limit_pace(up.pending);
+                    timeouts_touch();
+                    failed = failed || !drain_pipe(up);
+                    if (up.pending == 0)
+                        up.buffer.record_read(n);
+                }
+            }
+        }
+
+        if (fds[down_index].revents && !failed)
+        {
+            if (down.pending > 0)
+            {
+                failed = !drain_pipe(down);
+                if (down.pending == 0)
+                    down.buffer.record_read(down.offset);
+            }
+            else
+            {
+                ssize_t n = fill_pipe(down, down.buffer.size());
+
+                if (n < 0 && errno != EAGAIN)
+                {
+                    // Origin failed mid-response: no gzip trailer, so the
+                    // client can tell the body is incomplete
+                    failed = true;
+                }
+                else if (n == 0)
+                {
+                    down.open = false; // origin finished the response
+
+                    if (compressor.enabled())
+                    {
+                        failed = !compressor.finish(transformed);
+                        down.data = transformed.data();
+                        down.offset = 0;
+                        down.pending = transformed.size();
+                        relay.response_bytes += down.pending;
+                        failed = failed || !drain_pipe(down);
+                    }
+                }
+                else if (n > 0)
+                {
+                    if (first_byte)
+                    {
+                        uint64_t now = trace_now_us();
+                        trace_record(trace_current(), "first_byte",
+                                     wait_start, now);
+                        first_byte = false;
+                        relay.first_byte_us = now - wait_start;
+
+                        if (target)
+                        {
+                            target->responded = true;
+                            target->first_byte_us = now - wait_start;
+                        }
+                    }
+
+                    if (compressor.enabled())
+                    {
+                        failed = !compressor.feed(down.buffer.data(), n,
+                                                  transformed);
+                        transformed_memory.resize(transformed.capacity());
+                        down.data = transformed.data();
+                        down.pending = transformed.size();
+                    }
+
+                    relay.response_bytes += down.pending;
+                    rate_limit_pace(down.pending);
+                    timeouts_touch();
+                    rearm_quickack(server_fd);
+
+                    failed = failed || !drain_pipe(down);
+                    if (down.pending == 0)
+                        down.buffer.record_read(n);
+                }
+            }
+        }
+
+        if (failed)
+            break;
+    }
+
+    // A backend that failed before answering gets a 502, not a reset
+    if (target && !target->responded)
+        send(client_fd, BAD_GATEWAY, sizeof(BAD_GATEWAY) - 1, MSG_NOSIGNAL);
+
+    close_pair(server_fd, client_fd);
+    if (stats)
+        *stats = relay;
+    return relay.total();
+}
+
+size_t tunnel_tcp(int client_fd, const HttpRequest &req, RelayStats *stats)
+{
+    // One buffer per direction so each adapts to its own traffic
+    RelayBuffer upstream_buffer;
+    RelayBuffer downstream_buffer;
+    RelayStats relay;
+
+    int server_fd = connect_upstream(client_fd, req, nullptr);
+    if (server_fd < 0)
+    {
+        close_client(client_fd);
         return 0;
     }
 
@@ -150,15 +407,18 @@ size_t tunnel_tcp(int client_fd, const HttpRequest &req)
 
     if (!send_all(client_fd, resp, strlen(resp)))
     {
-        close(server_fd);
-        close(client_fd);
+        close_pair(server_fd, client_fd);
         return 0;
     }
 
     fd_set fds;
+    uint64_t wait_start = trace_now_us();
+    bool first_byte = true;
 
     while (true)
     {
+        memory_pause_reads(MEMORY_PAUSE_MS);
+
         FD_ZERO(&fds);
         FD_SET(client_fd, &fds);
         FD_SET(server_fd, &fds);
@@ -171,39 +431,58 @@ size_t tunnel_tcp(int client_fd, const HttpRequest &req)
         if (FD_ISSET(client_fd, &fds))
         {
             ssize_t n = recv(client_fd,
-                             buffer.data(),
-                             buffer.size(),
+                             upstream_buffer.data(),
+                             upstream_buffer.size(),
                              0);
             if (n <= 0)
                 break;
 
+            rate_limit_pace(n);
+
             if (!send_all(server_fd,
-                          buffer.data(),
+                          upstream_buffer.data(),
                           n))
                 break;
 
-            total_bytes += n;
+            relay.request_bytes += n;
+            upstream_buffer.record_read(n);
+            timeouts_touch();
+            rearm_quickack(client_fd);
         }
 
         if (FD_ISSET(server_fd, &fds))
         {
             ssize_t n = recv(server_fd,
-                             buffer.data(),
-                             buffer.size(),
+                             downstream_buffer.data(),
+                             downstream_buffer.size(),
                              0);
             if (n <= 0)
                 break;
 
+            if (first_byte)
+            {
+                uint64_t now = trace_now_us();
+                trace_record(trace_current(), "first_byte", wait_start, now);
+                relay.first_byte_us = now - wait_start;
+                first_byte = false;
+            }
+
+            rate_limit_pace(n);
+
             if (!send_all(client_fd,
-                          buffer.data(),
+                          downstream_buffer.data(),
                           n))
                 break;
 
-            total_bytes += n;
+            relay.response_bytes += n;
+            downstream_buffer.record_read(n);
+            timeouts_touch();
+            rearm_quickack(server_fd);
         }
     }
 
-    close(server_fd);
-    close(client_fd);
-    return total_bytes;
+    close_pair(server_fd, client_fd);
+    if (stats)
+        *stats = relay;
+    return relay.total();
 }
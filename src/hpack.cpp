@@ -0,0 +1,425 @@
+#include "hpack.h"
+
+#include <utility>
+
+using namespace std;
+
+// RFC 7541 Appendix A; index 1 is the first entry
+static const pair<const char *, const char *> STATIC_TABLE[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const size_t STATIC_COUNT = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+// Per-entry overhead counted against the dynamic table size
+static const size_t ENTRY_OVERHEAD = 32;
+
+// RFC 7541 Appendix B: {code, length in bits} per symbol, then EOS
+static const pair<uint32_t, uint8_t> HUFFMAN_CODES[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+static const int EOS = 256;
+
+// Binary decoding tree over the code table. A child is another node
+// (> 0), a symbol (-(symbol + 1)) or missing (0).
+struct HuffmanNode
+{
+    int16_t next[2] = {0, 0};
+};
+
+static vector<HuffmanNode> build_huffman_tree()
+{
+    vector<HuffmanNode> tree(1);
+
+    for (int symbol = 0; symbol <= EOS; ++symbol)
+    {
+        uint32_t code = HUFFMAN_CODES[symbol].first;
+        int bits = HUFFMAN_CODES[symbol].second;
+        int node = 0;
+
+        for (int i = bits - 1; i > 0; --i)
+        {
+            int bit = (code >> i) & 1;
+            if (tree[node].next[bit] == 0)
+            {
+                tree[node].next[bit] = tree.size();
+                tree.emplace_back();
+            }
+            node = tree[node].next[bit];
+        }
+        tree[node].next[code & 1] = -(symbol + 1);
+    }
+    return tree;
+}
+
+bool huffman_decode(const uint8_t *data, size_t len, string &out)
+{
+    static const vector<HuffmanNode> tree = build_huffman_tree();
+
+    int node = 0;
+    int depth = 0;      // bits read since the last complete symbol
+    bool ones = true;   // and whether they were all 1s
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        for (int b = 7; b >= 0; --b)
+        {
+            int bit = (data[i] >> b) & 1;
+            int next = tree[node].next[bit];
+
+            if (next < 0)
+            {
+                int symbol = -next - 1;
+                if (symbol == EOS)
+                    return false;
+                out += static_cast<char>(symbol);
+                node = 0;
+                depth = 0;
+                ones = true;
+            }
+            else
+            {
+                node = next;
+                ++depth;
+                ones = ones && bit;
+            }
+        }
+    }
+
+    // The final byte is padded with the high bits of EOS: at most 7 ones
+    return depth < 8 && ones;
+}
+
+static bool decode_integer(const uint8_t *&p, const uint8_t *end,
+                           int prefix_bits, uint64_t &value)
+{
+    if (p >= end)
+        return false;
+
+    uint64_t prefix_max = (1u << prefix_bits) - 1;
+    value = *p++ & prefix_max;
+    if (value < prefix_max)
+        return true;
+
+    for (int shift = 0; p < end; shift += 7)
+    {
+        if (shift > 56)
+            return false;
+        uint8_t b = *p++;
+        value += static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool decode_string(const uint8_t *&p, const uint8_t *end, string &out)
+{
+    if (p >= end)
+        return false;
+
+    bool huffman = *p & 0x80;
+    uint64_t length;
+    if (!decode_integer(p, end, 7, length) ||
+        length > static_cast<uint64_t>(end - p))
+        return false;
+
+    out.clear();
+    if (huffman)
+    {
+        if (!huffman_decode(p, length, out))
+            return false;
+    }
+    else
+    {
+        out.assign(reinterpret_cast<const char *>(p), length);
+    }
+    p += length;
+    return true;
+}
+
+HpackDecoder::HpackDecoder(size_t max_table_size)
+    : max_size(max_table_size), settings_limit(max_table_size)
+{
+}
+
+bool HpackDecoder::lookup(uint64_t index, HeaderField &field) const
+{
+    if (index == 0)
+        return false;
+
+    if (index <= STATIC_COUNT)
+    {
+        field.name = STATIC_TABLE[index - 1].first;
+        field.value = STATIC_TABLE[index - 1].second;
+        return true;
+    }
+
+    index -= STATIC_COUNT + 1;
+    if (index >= table.size())
+        return false;
+    field = table[index];
+    return true;
+}
+
+void HpackDecoder::evict(size_t limit)
+{
+    while (table_size > limit && !table.empty())
+    {
+        const HeaderField &oldest = table.back();
+        table_size -= oldest.name.size() + oldest.value.size() + ENTRY_OVERHEAD;
+        table.pop_back();
+    }
+}
+
+void HpackDecoder::insert(const HeaderField &field)
+{
+    size_t size = field.name.size() + field.value.size() + ENTRY_OVERHEAD;
+
+    // An entry larger than the table empties it and is not added
+    evict(size > max_size ? 0 : max_size - size);
+    if (size > max_size)
+        return;
+
+    table.push_front(field);
+    table_size += size;
+}
+
+bool HpackDecoder::decode(const uint8_t *data, size_t len,
+                          vector<HeaderField> &headers)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    bool fields_seen = false;
+
+    while (p < end)
+    {
+        uint8_t b = *p;
+        HeaderField field;
+        uint64_t index;
+
+        if (b & 0x80)
+        {
+            // Indexed field
+            if (!decode_integer(p, end, 7, index) || !lookup(index, field))
+                return false;
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            // Table size update, only allowed before the first field
+            if (fields_seen || !decode_integer(p, end, 5, index) ||
+                index > settings_limit)
+                return false;
+            max_size = index;
+            evict(max_size);
+            continue;
+        }
+        else
+        {
+            // Literal: with incremental indexing (01), without (0000)
+            // or never indexed (0001)
+            bool indexing = (b & 0xc0) == 0x40;
+            if (!decode_integer(p, end, indexing ? 6 : 4, index))
+                return false;
+
+            if (index > 0)
+            {
+                if (!lookup(index, field))
+                    return false;
+            }
+            else if (!decode_string(p, end, field.name))
+            {
+                return false;
+            }
+
+            if (!decode_string(p, end, field.value))
+                return false;
+            if (indexing)
+                insert(field);
+        }
+
+        fields_seen = true;
+        headers.push_back(move(field));
+    }
+    return true;
+}
+
+static void encode_integer(string &out, uint8_t flags, int prefix_bits,
+                           uint64_t value)
+{
+    uint64_t prefix_max = (1u << prefix_bits) - 1;
+    if (value < prefix_max)
+    {
+        out += static_cast<char>(flags | value);
+        return;
+    }
+
+    out += static_cast<char>(flags | prefix_max);
+    value -= prefix_max;
+    while (value >= 0x80)
+    {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+static void encode_string(string &out, const string &s)
+{
+    encode_integer(out, 0x00, 7, s.size());
+    out += s;
+}
+
+void hpack_encode(const vector<HeaderField> &headers, string &out)
+{
+    for (const HeaderField &field : headers)
+    {
+        size_t full = 0;
+        size_t name_only = 0;
+        for (size_t i = 0; i < STATIC_COUNT && full == 0; ++i)
+        {
+            if (field.name != STATIC_TABLE[i].first)
+                continue;
+            if (field.value == STATIC_TABLE[i].second)
+                full = i + 1;
+            else if (name_only == 0)
+                name_only = i + 1;
+        }
+
+        if (full)
+        {
+            encode_integer(out, 0x80, 7, full);
+            continue;
+        }
+
+        encode_integer(out, 0x00, 4, name_only);
+        if (name_only == 0)
+            encode_string(out, field.name);
+        encode_string(out, field.value);
+    }
+}
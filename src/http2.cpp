@@ -0,0 +1,1493 @@
+#include "http2.h"
+#include "hpack.h"
+#include "client_handler.h"
+#include "metrics.h"
+#include "timeouts.h"
+#include "trace.h"
+#include "memory_budget.h"
+#include "thread_pool.h"
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+extern atomic<int> g_socket_timeout;
+
+static atomic<bool> enabled(false);
+static atomic<int> max_streams(100);
+static atomic<int> initial_window(65535);
+
+static const char CLIENT_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t CLIENT_PREFACE_LENGTH = sizeof(CLIENT_PREFACE) - 1;
+
+static const char SWITCHING_PROTOCOLS[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\n"
+    "Upgrade: h2c\r\n\r\n";
+
+static const char BAD_REQUEST[] =
+    "HTTP/1.0 400 Bad Request\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+enum FrameType
+{
+    FRAME_DATA = 0,
+    FRAME_HEADERS = 1,
+    FRAME_PRIORITY = 2,
+    FRAME_RST_STREAM = 3,
+    FRAME_SETTINGS = 4,
+    FRAME_PUSH_PROMISE = 5,
+    FRAME_PING = 6,
+    FRAME_GOAWAY = 7,
+    FRAME_WINDOW_UPDATE = 8,
+    FRAME_CONTINUATION = 9
+};
+
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+enum ErrorCode
+{
+    NO_ERROR = 0x0,
+    PROTOCOL_ERROR = 0x1,
+    INTERNAL_ERROR = 0x2,
+    FLOW_CONTROL_ERROR = 0x3,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    COMPRESSION_ERROR = 0x9,
+    ENHANCE_YOUR_CALM = 0xb
+};
+
+enum SettingId
+{
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+static const size_t FRAME_HEADER_LENGTH = 9;
+static const uint32_t DEFAULT_WINDOW = 65535;
+static const int64_t MAX_WINDOW = 0x7fffffff;
+static const uint32_t DEFAULT_MAX_FRAME = 16384; // also the most we accept
+
+// Connection-level receive window; each stream is still bounded by its own
+static const int64_t CONNECTION_WINDOW = 1 << 20;
+
+// The HTTP/1 parser rejects request headers above this size
+static const size_t MAX_REQUEST_HEADER = 8192;
+static const size_t MAX_HEADER_BLOCK = 65536;
+static const size_t MAX_RESPONSE_HEADER = 65536;
+
+// Frames queued for the client beyond this stop streams from reading
+// more of their responses
+static const size_t OUTPUT_LIMIT = 256 * 1024;
+
+void set_http2_settings(const Http2Settings &settings)
+{
+    enabled.store(settings.enabled);
+    max_streams.store(max(1, settings.max_concurrent_streams));
+
+    // Never below the protocol default, so data the client sends before
+    // it has seen our SETTINGS always fits
+    initial_window.store(static_cast<int>(
+        min<int64_t>(MAX_WINDOW, max<int64_t>(DEFAULT_WINDOW,
+                                              settings.initial_window_size))));
+}
+
+bool http2_enabled()
+{
+    return enabled.load();
+}
+
+bool is_h2_preface(const HttpRequest &req)
+{
+    return req.method == "PRI" && req.version == "2.0";
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+           (uint32_t(p[2]) << 8) | p[3];
+}
+
+static void put32(char *p, uint32_t v)
+{
+    p[0] = static_cast<char>(v >> 24);
+    p[1] = static_cast<char>(v >> 16);
+    p[2] = static_cast<char>(v >> 8);
+    p[3] = static_cast<char>(v);
+}
+
+// HTTP2-Settings carries a SETTINGS payload in base64url
+static bool base64url_decode(const string &in, string &out)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+
+    for (char c : in)
+    {
+        int v;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-' || c == '+')
+            v = 62;
+        else if (c == '_' || c == '/')
+            v = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out += static_cast<char>((acc >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+static bool is_token_char(char c)
+{
+    return isalnum(static_cast<unsigned char>(c)) ||
+           strchr("!#$%&'*+-.^_`|~", c) != nullptr;
+}
+
+// Field names must be lowercase tokens and values free of line breaks,
+// or a stream could smuggle extra headers into its HTTP/1.1 request
+static bool valid_field(const HeaderField &field)
+{
+    if (field.name.empty())
+        return false;
+    for (char c : field.name)
+    {
+        if (!is_token_char(c) || (c >= 'A' && c <= 'Z'))
+            return false;
+    }
+    return field.value.find_first_of(string("\r\n\0", 3)) == string::npos;
+}
+
+// Connection-specific headers have no meaning in HTTP/2 (RFC 7540 8.1.2.2)
+static bool connection_specific(const string &name)
+{
+    return name == "connection" || name == "keep-alive" ||
+           name == "proxy-connection" || name == "transfer-encoding" ||
+           name == "upgrade" || name == "te";
+}
+
+// Handlers running a connection's streams; the session waits for all
+// of them before it returns
+struct StreamWorkers
+{
+    mutex lock;
+    condition_variable idle;
+    int active = 0;
+    size_t bytes = 0;
+};
+
+struct Stream
+{
+    uint32_t id = 0;
+    int fd = -1; // session end of the socketpair to the stream's handler
+
+    // Request direction: bytes for the handler, and window credit to
+    // return to the client once they have been written
+    string upload;
+    bool chunked_upload = false;
+    bool head_request = false;
+    bool request_done = false; // END_STREAM received
+    bool tunnel = false;       // CONNECT: END_STREAM half-closes the tunnel
+    string held;               // tunnel data sent before it was established
+    bool upload_failed = false;
+    int64_t recv_window = 0;
+    uint32_t credit = 0;
+
+    // Response direction: the HTTP/1 header until it is complete, then
+    // body bytes not yet framed
+    string response;
+    bool headers_sent = false;
+    bool read_closed = false;
+    bool chunked_response = false; // framing is removed before DATA frames
+    ChunkedDecoder response_chunks;
+    int64_t send_window = 0;
+
+    bool done = false;
+};
+
+class Http2Session
+{
+public:
+    explicit Http2Session(const Task &task)
+        : task(task), workers(make_shared<StreamWorkers>()) {}
+
+    size_t run(const HttpRequest &req);
+
+private:
+    bool start_upgraded(const HttpRequest &req);
+    void process_input();
+    void handle_frame(uint8_t type, uint8_t flags, uint32_t id,
+                      const uint8_t *payload, size_t len);
+    void on_data(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+    void on_headers(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+    void on_header_block();
+    void on_settings(uint8_t flags, uint32_t id, const uint8_t *p, size_t len);
+    void on_window_update(uint32_t id, const uint8_t *p, size_t len);
+    bool apply_settings(const uint8_t *p, size_t len);
+
+    void open_stream(uint32_t id, const vector<HeaderField> &headers,
+                     bool end_stream);
+    Stream *add_stream(uint32_t id, const string &request, bool end_stream);
+    bool start_worker(Stream &s);
+    Stream *find_stream(uint32_t id);
+
+    void write_upload(Stream &s);
+    void read_response(Stream &s);
+    bool append_response(Stream &s, const char *data, size_t len);
+    bool parse_response_head(Stream &s);
+    void flush_stream(Stream &s);
+    void flush_streams();
+    void end_response(Stream &s);
+    void reset_stream(Stream &s, uint32_t code);
+    void reap();
+
+    void write_frame(uint8_t type, uint8_t flags, uint32_t id,
+                     const char *payload, size_t len);
+    void write_headers(uint32_t id, const vector<HeaderField> &fields,
+                       bool end_stream);
+    void write_rst(uint32_t id, uint32_t code);
+    void write_window_update(uint32_t id, uint32_t increment);
+    void connection_error(uint32_t code);
+    void send_output();
+    size_t pending_output() const { return out.size() - out_offset; }
+    void account_memory();
+
+    Task task;
+    shared_ptr<StreamWorkers> workers;
+    HpackDecoder decoder;
+
+    map<uint32_t, unique_ptr<Stream>> streams;
+    uint32_t last_stream_id = 0;
+    uint32_t flush_from = 0; // round-robin start for framing responses
+
+    string in;  // client bytes not yet parsed into frames
+    string out; // frames not yet written to the client
+    size_t out_offset = 0;
+    bool preface_seen = false;
+
+    // Header block split over CONTINUATION frames
+    uint32_t header_stream = 0;
+    bool header_end_stream = false;
+    bool in_header_block = false;
+    string header_block;
+
+    int64_t conn_send_window = DEFAULT_WINDOW;
+    int64_t conn_recv_window = DEFAULT_WINDOW;
+    uint32_t conn_credit = 0;
+    int64_t peer_initial_window = DEFAULT_WINDOW;
+    uint32_t peer_max_frame = DEFAULT_MAX_FRAME;
+    int64_t local_window = DEFAULT_WINDOW;
+    int stream_limit = 100;
+
+    bool goaway_received = false;
+    bool closing = false;     // GOAWAY sent after a connection error
+    bool client_gone = false;
+
+    MemoryCharge memory{MEM_RELAY_BUFFERS};
+};
+
+void Http2Session::write_frame(uint8_t type, uint8_t flags, uint32_t id,
+                               const char *payload, size_t len)
+{
+    char header[FRAME_HEADER_LENGTH];
+    header[0] = static_cast<char>(len >> 16);
+    header[1] = static_cast<char>(len >> 8);
+    header[2] = static_cast<char>(len);
+    header[3] = static_cast<char>(type);
+    header[4] = static_cast<char>(flags);
+    put32(header + 5, id & 0x7fffffff);
+
+    out.append(header, sizeof(header));
+    if (len > 0)
+        out.append(payload, len);
+}
+
+void Http2Session::write_headers(uint32_t id, const vector<HeaderField> &fields,
+                                 bool end_stream)
+{
+    string block;
+    hpack_encode(fields, block);
+
+    // Blocks larger than a frame continue in CONTINUATION frames
+    size_t offset = 0;
+    bool first = true;
+    do
+    {
+        size_t len = min<size_t>(block.size() - offset, peer_max_frame);
+        bool last = offset + len == block.size();
+        uint8_t flags = last ? FLAG_END_HEADERS : 0;
+        if (first && end_stream)
+            flags |= FLAG_END_STREAM;
+
+        write_frame(first ? FRAME_HEADERS : FRAME_CONTINUATION, flags, id,
+                    block.data() + offset, len);
+        offset += len;
+        first = false;
+    } while (offset < block.size());
+}
+
+void Http2Session::write_rst(uint32_t id, uint32_t code)
+{
+    char payload[4];
+    put32(payload, code);
+    write_frame(FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+void Http2Session::write_window_update(uint32_t id, uint32_t increment)
+{
+    char payload[4];
+    put32(payload, increment);
+    write_frame(FRAME_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+void Http2Session::connection_error(uint32_t code)
+{
+    if (closing)
+        return;
+
+    char payload[8];
+    put32(payload, last_stream_id);
+    put32(payload + 4, code);
+    write_frame(FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    closing = true;
+}
+
+void Http2Session::send_output()
+{
+    while (out_offset < out.size())
+    {
+        ssize_t n = send(task.client_fd, out.data() + out_offset,
+                         out.size() - out_offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+        if (n <= 0)
+        {
+            client_gone = true;
+            out.clear();
+            out_offset = 0;
+            return;
+        }
+        out_offset += n;
+        timeouts_touch();
+    }
+
+    if (out_offset == out.size())
+    {
+        out.clear();
+        out_offset = 0;
+    }
+    else if (out_offset > OUTPUT_LIMIT)
+    {
+        out.erase(0, out_offset);
+        out_offset = 0;
+    }
+}
+
+void Http2Session::account_memory()
+{
+    size_t bytes = in.capacity() + out.capacity() + header_block.capacity();
+    for (const auto &entry : streams)
+        bytes += sizeof(Stream) + entry.second->upload.capacity() +
+                 entry.second->held.capacity() +
+                 entry.second->response.capacity();
+    memory.resize(bytes);
+}
+
+Stream *Http2Session::find_stream(uint32_t id)
+{
+    auto it = streams.find(id);
+    return it == streams.end() || it->second->done ? nullptr
+                                                   : it->second.get();
+}
+
+bool Http2Session::apply_settings(const uint8_t *p, size_t len)
+{
+    for (size_t i = 0; i + 6 <= len; i += 6)
+    {
+        uint16_t id = (p[i] << 8) | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+
+        switch (id)
+        {
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+            {
+                connection_error(PROTOCOL_ERROR);
+                return false;
+            }
+            break;
+
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+        {
+            if (value > MAX_WINDOW)
+            {
+                connection_error(FLOW_CONTROL_ERROR);
+                return false;
+            }
+            // Applies retroactively to every open stream's send window
+            int64_t delta = static_cast<int64_t>(value) - peer_initial_window;
+            for (auto &entry : streams)
+            {
+                entry.second->send_window += delta;
+                if (entry.second->send_window > MAX_WINDOW)
+                {
+                    connection_error(FLOW_CONTROL_ERROR);
+                    return false;
+                }
+            }
+            peer_initial_window = value;
+            break;
+        }
+
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < DEFAULT_MAX_FRAME || value > 0xffffff)
+            {
+                connection_error(PROTOCOL_ERROR);
+                return false;
+            }
+            peer_max_frame = value;
+            break;
+
+        default:
+            // The encoder never uses the dynamic table and the server
+            // never pushes, so the remaining settings do not matter
+            break;
+        }
+    }
+    return true;
+}
+
+void Http2Session::on_settings(uint8_t flags, uint32_t id, const uint8_t *p,
+                               size_t len)
+{
+    if (id != 0)
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+
+    if (flags & FLAG_ACK)
+    {
+        if (len != 0)
+            connection_error(FRAME_SIZE_ERROR);
+        return;
+    }
+
+    if (len % 6 != 0)
+    {
+        connection_error(FRAME_SIZE_ERROR);
+        return;
+    }
+
+    if (apply_settings(p, len))
+    {
+        write_frame(FRAME_SETTINGS, FLAG_ACK, 0, nullptr, 0);
+        flush_streams();
+    }
+}
+
+void Http2Session::on_window_update(uint32_t id, const uint8_t *p, size_t len)
+{
+    if (len != 4)
+    {
+        connection_error(FRAME_SIZE_ERROR);
+        return;
+    }
+
+    uint32_t increment = get32(p) & 0x7fffffff;
+
+    if (id == 0)
+    {
+        if (increment == 0 || conn_send_window + increment > MAX_WINDOW)
+        {
+            connection_error(increment == 0 ? PROTOCOL_ERROR
+                                            : FLOW_CONTROL_ERROR);
+            return;
+        }
+        conn_send_window += increment;
+        flush_streams();
+        return;
+    }
+
+    Stream *s = find_stream(id);
+    if (!s)
+        return; // may race with the stream closing
+
+    if (increment == 0 || s->send_window + increment > MAX_WINDOW)
+    {
+        reset_stream(*s, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        return;
+    }
+    s->send_window += increment;
+    flush_stream(*s);
+}
+
+void Http2Session::on_data(uint8_t flags, uint32_t id, const uint8_t *p,
+                           size_t len)
+{
+    if (id == 0 || id > last_stream_id)
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+
+    // The whole frame, padding included, counts against both windows
+    conn_recv_window -= len;
+    if (conn_recv_window < 0)
+    {
+        connection_error(FLOW_CONTROL_ERROR);
+        return;
+    }
+
+    // Connection credit is returned at once: what can be buffered is
+    // already bounded by the stream windows
+    conn_credit += len;
+    if (conn_credit >= CONNECTION_WINDOW / 2)
+    {
+        write_window_update(0, conn_credit);
+        conn_recv_window += conn_credit;
+        conn_credit = 0;
+    }
+
+    size_t frame_len = len;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1 || p[0] >= len)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        len -= 1 + p[0];
+        ++p;
+    }
+
+    Stream *s = find_stream(id);
+    if (!s)
+        return; // closed or reset; the data is dropped
+
+    if (s->request_done)
+    {
+        reset_stream(*s, STREAM_CLOSED);
+        return;
+    }
+
+    s->recv_window -= frame_len;
+    if (s->recv_window < 0)
+    {
+        reset_stream(*s, FLOW_CONTROL_ERROR);
+        return;
+    }
+    s->credit += frame_len;
+
+    if (!s->upload_failed)
+    {
+        if (s->chunked_upload && len > 0)
+        {
+            char size[20];
+            snprintf(size, sizeof(size), "%zx\r\n", len);
+            s->upload += size;
+            s->upload.append(reinterpret_cast<const char *>(p), len);
+            s->upload += "\r\n";
+        }
+        else
+        {
+            // Like an HTTP/1 client, a tunnel waits for "200 Connection
+            // Established" before its data is relayed
+            string &target = s->tunnel && !s->headers_sent ? s->held
+                                                           : s->upload;
+            target.append(reinterpret_cast<const char *>(p), len);
+        }
+    }
+
+    if (flags & FLAG_END_STREAM)
+    {
+        s->request_done = true;
+        if (s->chunked_upload && !s->upload_failed)
+            s->upload += "0\r\n\r\n";
+    }
+
+    write_upload(*s);
+}
+
+void Http2Session::on_headers(uint8_t flags, uint32_t id, const uint8_t *p,
+                              size_t len)
+{
+    if (id == 0)
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1 || p[0] >= len)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        len -= 1 + p[0];
+        ++p;
+    }
+
+    // Priority information is accepted and ignored
+    if (flags & FLAG_PRIORITY)
+    {
+        if (len < 5)
+        {
+            connection_error(FRAME_SIZE_ERROR);
+            return;
+        }
+        p += 5;
+        len -= 5;
+    }
+
+    header_stream = id;
+    header_end_stream = flags & FLAG_END_STREAM;
+    header_block.assign(reinterpret_cast<const char *>(p), len);
+
+    if (flags & FLAG_END_HEADERS)
+        on_header_block();
+    else
+        in_header_block = true;
+}
+
+void Http2Session::on_header_block()
+{
+    in_header_block = false;
+
+    // Decoded even for streams that are refused, to keep the HPACK
+    // dynamic table in step with the client's encoder
+    vector<HeaderField> headers;
+    bool decoded = decoder.decode(
+        reinterpret_cast<const uint8_t *>(header_block.data()),
+        header_block.size(), headers);
+    header_block.clear();
+    header_block.shrink_to_fit();
+
+    if (!decoded)
+    {
+        connection_error(COMPRESSION_ERROR);
+        return;
+    }
+
+    uint32_t id = header_stream;
+
+    // Trailers end the request body; their fields are not forwarded
+    Stream *s = find_stream(id);
+    if (s)
+    {
+        if (!header_end_stream || s->request_done)
+        {
+            reset_stream(*s, PROTOCOL_ERROR);
+            return;
+        }
+        s->request_done = true;
+        if (s->chunked_upload && !s->upload_failed)
+            s->upload += "0\r\n\r\n";
+        write_upload(*s);
+        return;
+    }
+
+    if (id % 2 == 0 || id <= last_stream_id)
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    last_stream_id = id;
+
+    if (goaway_received)
+    {
+        write_rst(id, REFUSED_STREAM);
+        return;
+    }
+
+    if (static_cast<int>(streams.size()) >= stream_limit)
+    {
+        record_http2_stream(true);
+        write_rst(id, REFUSED_STREAM);
+        return;
+    }
+
+    open_stream(id, headers, header_end_stream);
+}
+
+// Builds the stream's HTTP/1.1 request from its pseudo-headers and fields
+void Http2Session::open_stream(uint32_t id, const vector<HeaderField> &headers,
+                               bool end_stream)
+{
+    string method, authority, path, host, cookies, fields;
+    bool regular_seen = false;
+    bool has_length = false;
+    bool malformed = false;
+
+    for (const HeaderField &field : headers)
+    {
+        if (!field.name.empty() && field.name[0] == ':')
+        {
+            string value = field.value;
+            if (regular_seen ||
+                value.find_first_of(string(" \r\n\0", 4)) != string::npos)
+                malformed = true;
+            else if (field.name == ":method")
+                method = value;
+            else if (field.name == ":authority")
+                authority = value;
+            else if (field.name == ":path")
+                path = value;
+            else if (field.name != ":scheme")
+                malformed = true;
+            continue;
+        }
+
+        regular_seen = true;
+        if (!valid_field(field))
+        {
+            malformed = true;
+            continue;
+        }
+
+        if (connection_specific(field.name))
+            continue;
+
+        if (field.name == "host")
+            host = field.value;
+        else if (field.name == "cookie")
+            cookies += (cookies.empty() ? "" : "; ") + field.value;
+        else
+        {
+            if (field.name == "content-length")
+                has_length = true;
+            fields += field.name + ": " + field.value + "\r\n";
+        }
+    }
+
+    bool connect = method == "CONNECT";
+    if (!authority.empty())
+        host = authority;
+
+    if (malformed || method.empty() || host.empty() ||
+        (!connect && path.empty()))
+    {
+        write_rst(id, PROTOCOL_ERROR);
+        return;
+    }
+
+    string request = method + " " + (connect ? host : path) +
+                     " HTTP/1.1\r\nHost: " + host + "\r\n" + fields;
+    if (!cookies.empty())
+        request += "cookie: " + cookies + "\r\n";
+
+    // Without a length the body is framed with chunked coding
+    bool chunked = !end_stream && !connect && !has_length;
+    if (chunked)
+        request += "transfer-encoding: chunked\r\n";
+    request += "\r\n";
+
+    if (request.size() > MAX_REQUEST_HEADER)
+    {
+        write_headers(id, {{":status", "431"}}, true);
+        if (!end_stream)
+            write_rst(id, NO_ERROR);
+        return;
+    }
+
+    Stream *s = add_stream(id, request, end_stream);
+    if (s)
+    {
+        s->chunked_upload = chunked;
+        s->head_request = method == "HEAD";
+        s->tunnel = connect;
+        write_upload(*s);
+    }
+}
+
+Stream *Http2Session::add_stream(uint32_t id, const string &request,
+                                 bool end_stream)
+{
+    // Over the memory budget: the client may retry the stream later
+    if (!memory_admit_connection())
+    {
+        record_http2_stream(true);
+        write_rst(id, REFUSED_STREAM);
+        return nullptr;
+    }
+
+    unique_ptr<Stream> s(new Stream);
+    s->id = id;
+    s->upload = request;
+    s->request_done = end_stream;
+    s->recv_window = local_window;
+    s->send_window = peer_initial_window;
+
+    if (!start_worker(*s))
+    {
+        write_rst(id, INTERNAL_ERROR);
+        return nullptr;
+    }
+
+    record_http2_stream(false);
+    Stream *stream = s.get();
+    streams[id] = move(s);
+    return stream;
+}
+
+// Streams run as ordinary tasks of the pool serving this connection,
+// so pool size, fair scheduling, per-client caps and autoscaling apply
+// to them as to HTTP/1 connections
+bool Http2Session::start_worker(Stream &s)
+{
+    ThreadPool *pool = ThreadPool::current();
+    if (!pool)
+        return false;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        return false;
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+    shared_ptr<StreamWorkers> w = workers;
+    {
+        lock_guard<mutex> lock(w->lock);
+        ++w->active;
+    }
+
+    Task stream_task;
+    stream_task.client_fd = fds[0];
+    stream_task.client_ip = task.client_ip;
+    stream_task.client_port = task.client_port;
+    stream_task.trace_id = trace_sample();
+    stream_task.http2_stream = true;
+    stream_task.on_done = [w](size_t bytes)
+    {
+        lock_guard<mutex> lock(w->lock);
+        w->bytes += bytes;
+        if (--w->active == 0)
+            w->idle.notify_all();
+    };
+    pool->enqueue(stream_task);
+
+    s.fd = fds[1];
+    return true;
+}
+
+void Http2Session::write_upload(Stream &s)
+{
+    while (!s.upload.empty() && !s.upload_failed)
+    {
+        ssize_t n = send(s.fd, s.upload.data(), s.upload.size(),
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (n <= 0)
+        {
+            // The handler stopped reading; its response says why
+            s.upload_failed = true;
+            break;
+        }
+        s.upload.erase(0, n);
+    }
+    s.upload.clear();
+
+    // Window credit goes back once the data has been handed on, so a
+    // handler that stops reading throttles the client
+    if (!s.request_done && s.credit >= local_window / 2)
+    {
+        write_window_update(s.id, s.credit);
+        s.recv_window += s.credit;
+        s.credit = 0;
+    }
+
+    if (s.request_done && s.tunnel && !s.upload_failed)
+    {
+        shutdown(s.fd, SHUT_WR);
+        s.upload_failed = true;
+    }
+}
+
+bool Http2Session::parse_response_head(Stream &s)
+{
+    for (;;)
+    {
+        size_t end = s.response.find("\r\n\r\n");
+        if (end == string::npos)
+            return s.response.size() <= MAX_RESPONSE_HEADER;
+
+        size_t line_end = s.response.find("\r\n");
+        size_t space = s.response.find(' ');
+        if (s.response.compare(0, 5, "HTTP/") != 0 || space > line_end)
+            return false;
+
+        int status = atoi(s.response.c_str() + space + 1);
+        if (status < 100 || status > 999)
+            return false;
+
+        // Interim responses are not relayed
+        if (status < 200)
+        {
+            s.response.erase(0, end + 4);
+            continue;
+        }
+
+        // Header names listed in Connection: are dropped as well
+        vector<pair<string, string>> lines;
+        string listed;
+        size_t pos = line_end + 2;
+        while (pos < end + 2)
+        {
+            size_t eol = s.response.find("\r\n", pos);
+            size_t colon = s.response.find(':', pos);
+            if (colon != string::npos && colon < eol)
+            {
+                string name = s.response.substr(pos, colon - pos);
+                for (char &c : name)
+                    c = tolower(static_cast<unsigned char>(c));
+
+                size_t v = s.response.find_first_not_of(" \t", colon + 1);
+                size_t v_end = eol;
+                while (v_end > v && (s.response[v_end - 1] == ' ' ||
+                                     s.response[v_end - 1] == '\t'))
+                    --v_end;
+                string value = v < eol ? s.response.substr(v, v_end - v) : "";
+
+                if (name == "transfer-encoding")
+                {
+                    string coding = value;
+                    for (char &c : coding)
+                        c = tolower(static_cast<unsigned char>(c));
+                    // HEAD, 204 and 304 responses have no body to decode
+                    s.chunked_response = coding.find("chunked") != string::npos &&
+                                         !s.head_request && status != 204 &&
+                                         status != 304;
+                }
+                else if (name == "connection")
+                {
+                    for (char &c : value)
+                        c = tolower(static_cast<unsigned char>(c));
+                    listed += "," + value + ",";
+                }
+                lines.emplace_back(move(name), move(value));
+            }
+            pos = eol + 2;
+        }
+
+        vector<HeaderField> fields{{":status", to_string(status)}};
+        for (auto &line : lines)
+        {
+            if (connection_specific(line.first) ||
+                listed.find("," + line.first + ",") != string::npos ||
+                line.first.empty())
+                continue;
+            fields.push_back({move(line.first), move(line.second)});
+        }
+
+        s.response.erase(0, end + 4);
+        write_headers(s.id, fields, false);
+        s.headers_sent = true;
+
+        // Body bytes that arrived with the header
+        if (s.chunked_response)
+        {
+            string raw;
+            raw.swap(s.response);
+            if (!append_response(s, raw.data(), raw.size()))
+                return true;
+        }
+        if (s.tunnel)
+        {
+            s.upload += s.held;
+            s.held.clear();
+            write_upload(s);
+        }
+        return true;
+    }
+}
+
+void Http2Session::read_response(Stream &s)
+{
+    char buffer[DEFAULT_MAX_FRAME];
+    ssize_t n = recv(s.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    if (n <= 0)
+    {
+        // A chunked body that stops short must not look complete
+        if (s.chunked_response && !s.response_chunks.done())
+        {
+            reset_stream(s, INTERNAL_ERROR);
+            return;
+        }
+        s.read_closed = true;
+    }
+    else if (s.headers_sent && s.chunked_response)
+    {
+        if (!append_response(s, buffer, n))
+            return;
+    }
+    else
+    {
+        s.response.append(buffer, n);
+    }
+
+    if (!s.headers_sent && !parse_response_head(s))
+    {
+        write_headers(s.id, {{":status", "502"}}, true);
+        end_response(s);
+        return;
+    }
+    if (!s.done)
+        flush_stream(s);
+}
+
+// Upstream requests with a chunked body are sent as HTTP/1.1, so the
+// response may be chunked too; HTTP/2 frames the data itself (RFC 7540
+// 8.1), so only the chunk payload is kept. False if the stream was reset.
+bool Http2Session::append_response(Stream &s, const char *data, size_t len)
+{
+    s.response_chunks.feed(data, len, &s.response);
+    if (s.response_chunks.failed())
+    {
+        reset_stream(s, INTERNAL_ERROR);
+        return false;
+    }
+    if (s.response_chunks.done())
+        s.read_closed = true;
+    return true;
+}
+
+void Http2Session::flush_stream(Stream &s)
+{
+    if (s.done)
+        return;
+
+    if (!s.headers_sent)
+    {
+        // The handler gave up before a complete response header
+        if (s.read_closed)
+        {
+            write_headers(s.id, {{":status", "502"}}, true);
+            end_response(s);
+        }
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < s.response.size() && pending_output() < OUTPUT_LIMIT)
+    {
+        int64_t len = min<int64_t>({static_cast<int64_t>(s.response.size() - offset),
+                                    s.send_window, conn_send_window,
+                                    static_cast<int64_t>(peer_max_frame)});
+        if (len <= 0)
+            break;
+
+        write_frame(FRAME_DATA, 0, s.id, s.response.data() + offset, len);
+        offset += len;
+        s.send_window -= len;
+        conn_send_window -= len;
+    }
+    s.response.erase(0, offset);
+
+    if (s.response.empty() && s.read_closed)
+    {
+        write_frame(FRAME_DATA, FLAG_END_STREAM, s.id, nullptr, 0);
+        end_response(s);
+    }
+}
+
+// Frames pending responses, starting after the stream served first
+// last time so one stream cannot keep the connection window to itself
+void Http2Session::flush_streams()
+{
+    if (streams.empty())
+        return;
+
+    auto it = streams.upper_bound(flush_from);
+    for (size_t n = streams.size(); n > 0; --n, ++it)
+    {
+        if (it == streams.end())
+            it = streams.begin();
+        flush_stream(*it->second);
+        flush_from = it->first;
+    }
+}
+
+void Http2Session::end_response(Stream &s)
+{
+    // The response is complete; the rest of the request is not needed
+    if (!s.request_done)
+        write_rst(s.id, NO_ERROR);
+    s.done = true;
+}
+
+void Http2Session::reset_stream(Stream &s, uint32_t code)
+{
+    write_rst(s.id, code);
+    s.done = true;
+}
+
+void Http2Session::reap()
+{
+    for (auto it = streams.begin(); it != streams.end();)
+    {
+        if (!it->second->done)
+        {
+            ++it;
+            continue;
+        }
+
+        // The handler sees the socketpair close and finishes on its own
+        shutdown(it->second->fd, SHUT_RDWR);
+        close(it->second->fd);
+        it = streams.erase(it);
+    }
+}
+
+void Http2Session::handle_frame(uint8_t type, uint8_t flags, uint32_t id,
+                                const uint8_t *payload, size_t len)
+{
+    if (in_header_block && (type != FRAME_CONTINUATION || id != header_stream))
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type)
+    {
+    case FRAME_DATA:
+        on_data(flags, id, payload, len);
+        break;
+
+    case FRAME_HEADERS:
+        on_headers(flags, id, payload, len);
+        break;
+
+    case FRAME_CONTINUATION:
+        if (!in_header_block)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        if (header_block.size() + len > MAX_HEADER_BLOCK)
+        {
+            connection_error(ENHANCE_YOUR_CALM);
+            return;
+        }
+        header_block.append(reinterpret_cast<const char *>(payload), len);
+        if (flags & FLAG_END_HEADERS)
+            on_header_block();
+        break;
+
+    case FRAME_PRIORITY:
+        if (id == 0 || len != 5)
+            connection_error(id == 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+        break;
+
+    case FRAME_RST_STREAM:
+    {
+        if (id == 0 || id > last_stream_id || len != 4)
+        {
+            connection_error(len != 4 ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+            return;
+        }
+        Stream *s = find_stream(id);
+        if (s)
+            s->done = true;
+        break;
+    }
+
+    case FRAME_SETTINGS:
+        on_settings(flags, id, payload, len);
+        break;
+
+    case FRAME_PUSH_PROMISE:
+        connection_error(PROTOCOL_ERROR);
+        break;
+
+    case FRAME_PING:
+        if (id != 0 || len != 8)
+        {
+            connection_error(id != 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+            return;
+        }
+        if (!(flags & FLAG_ACK))
+            write_frame(FRAME_PING, FLAG_ACK, 0,
+                        reinterpret_cast<const char *>(payload), len);
+        break;
+
+    case FRAME_GOAWAY:
+        if (id != 0)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        // Streams already started run to completion
+        goaway_received = true;
+        break;
+
+    case FRAME_WINDOW_UPDATE:
+        on_window_update(id, payload, len);
+        break;
+
+    default:
+        // Unknown frame types are ignored
+        break;
+    }
+}
+
+void Http2Session::process_input()
+{
+    size_t pos = 0;
+
+    if (!preface_seen)
+    {
+        if (in.size() < CLIENT_PREFACE_LENGTH)
+        {
+            if (in.compare(0, in.size(), CLIENT_PREFACE, in.size()) != 0)
+                connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        if (in.compare(0, CLIENT_PREFACE_LENGTH, CLIENT_PREFACE) != 0)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        preface_seen = true;
+        pos = CLIENT_PREFACE_LENGTH;
+    }
+
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(in.data());
+    while (!closing && in.size() - pos >= FRAME_HEADER_LENGTH)
+    {
+        const uint8_t *h = data + pos;
+        size_t len = (size_t(h[0]) << 16) | (size_t(h[1]) << 8) | h[2];
+        if (len > DEFAULT_MAX_FRAME)
+        {
+            connection_error(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (in.size() - pos < FRAME_HEADER_LENGTH + len)
+            break;
+
+        handle_frame(h[3], h[4], get32(h + 5) & 0x7fffffff,
+                     h + FRAME_HEADER_LENGTH, len);
+        pos += FRAME_HEADER_LENGTH + len;
+    }
+    in.erase(0, pos);
+}
+
+// An upgraded request is stream 1, half-closed from the client's side
+bool Http2Session::start_upgraded(const HttpRequest &req)
+{
+    string settings;
+    if (!base64url_decode(req.http2_settings, settings) ||
+        settings.size() % 6 != 0)
+        return false;
+
+    if (send(task.client_fd, SWITCHING_PROTOCOLS,
+             sizeof(SWITCHING_PROTOCOLS) - 1, MSG_NOSIGNAL) <= 0)
+        return false;
+
+    apply_settings(reinterpret_cast<const uint8_t *>(settings.data()),
+                   settings.size());
+
+    last_stream_id = 1;
+    add_stream(1, req.raw_request.substr(0, req.header_length), true);
+    in = req.raw_request.substr(req.header_length);
+    return true;
+}
+
+size_t Http2Session::run(const HttpRequest &req)
+{
+    stream_limit = max_streams.load();
+    local_window = initial_window.load();
+
+    if (req.h2c_upgrade)
+    {
+        if (!start_upgraded(req))
+        {
+            send(task.client_fd, BAD_REQUEST, sizeof(BAD_REQUEST) - 1,
+                 MSG_NOSIGNAL);
+            return 0;
+        }
+    }
+    else
+    {
+        in = req.raw_request;
+    }
+
+    record_http2_connection();
+
+    // Server preface: our settings, and a larger connection window
+    char settings[18];
+    uint32_t values[][2] = {{SETTINGS_MAX_CONCURRENT_STREAMS, uint32_t(stream_limit)},
+                            {SETTINGS_INITIAL_WINDOW_SIZE, uint32_t(local_window)},
+                            {SETTINGS_MAX_HEADER_LIST_SIZE, MAX_REQUEST_HEADER}};
+    for (int i = 0; i < 3; ++i)
+    {
+        settings[i * 6] = static_cast<char>(values[i][0] >> 8);
+        settings[i * 6 + 1] = static_cast<char>(values[i][0]);
+        put32(settings + i * 6 + 2, values[i][1]);
+    }
+    write_frame(FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+    write_window_update(0, CONNECTION_WINDOW - DEFAULT_WINDOW);
+    conn_recv_window = CONNECTION_WINDOW;
+
+    int flags = fcntl(task.client_fd, F_GETFL);
+    fcntl(task.client_fd, F_SETFL, flags | O_NONBLOCK);
+
+    vector<pollfd> fds;
+    vector<Stream *> polled;
+    char buffer[DEFAULT_MAX_FRAME + FRAME_HEADER_LENGTH];
+
+    while (!client_gone)
+    {
+        process_input();
+        reap();
+        send_output();
+        account_memory();
+
+        if (closing || (goaway_received && streams.empty()))
+            break;
+
+        fds.clear();
+        polled.clear();
+
+        short client_events = 0;
+        if (pending_output() < OUTPUT_LIMIT)
+            client_events |= POLLIN;
+        if (pending_output() > 0)
+            client_events |= POLLOUT;
+        fds.push_back({task.client_fd, client_events, 0});
+
+        for (auto &entry : streams)
+        {
+            Stream &s = *entry.second;
+            short events = 0;
+            if (!s.upload.empty())
+                events |= POLLOUT;
+            if (!s.read_closed && pending_output() < OUTPUT_LIMIT &&
+                (!s.headers_sent ||
+                 (s.response.empty() && s.send_window > 0 &&
+                  conn_send_window > 0)))
+                events |= POLLIN;
+            if (events == 0)
+                continue;
+            fds.push_back({s.fd, events, 0});
+            polled.push_back(&s);
+        }
+
+        int ready = poll(fds.data(), fds.size(), g_socket_timeout * 1000);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+            break;
+
+        // An idle connection is closed like an idle HTTP/1 client
+        if (ready == 0)
+        {
+            if (streams.empty())
+                break;
+            continue;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = recv(task.client_fd, buffer, sizeof(buffer), 0);
+            if (n > 0)
+            {
+                in.append(buffer, n);
+                timeouts_touch();
+            }
+            else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                                errno != EINTR))
+            {
+                client_gone = true;
+            }
+        }
+
+        for (size_t i = 0; i < polled.size(); ++i)
+        {
+            short revents = fds[i + 1].revents;
+            Stream &s = *polled[i];
+            if (s.done)
+                continue;
+            if (revents & POLLOUT)
+                write_upload(s);
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+                read_response(s);
+        }
+    }
+
+    if (!client_gone && !closing)
+        connection_error(NO_ERROR);
+
+    // Best effort: a GOAWAY or the end of a response may still be queued
+    fcntl(task.client_fd, F_SETFL, flags);
+    if (!client_gone && pending_output() > 0)
+        send(task.client_fd, out.data() + out_offset, pending_output(),
+             MSG_NOSIGNAL);
+
+    for (auto &entry : streams)
+        entry.second->done = true;
+    reap();
+    memory.resize(0);
+
+    unique_lock<mutex> lock(workers->lock);
+    workers->idle.wait(lock, [this] { return workers->active == 0; });
+    return workers->bytes;
+}
+
+size_t serve_http2(const Task &task, const HttpRequest &req)
+{
+    ThreadPool *pool = ThreadPool::current();
+    if (pool)
+        pool->begin_multiplexing(task.client_ip);
+
+    size_t bytes;
+    {
+        Http2Session session(task);
+        bytes = session.run(req);
+    }
+
+    if (pool)
+        pool->end_multiplexing();
+
+    timeouts_end();
+    close(task.client_fd);
+    return bytes;
+}
@@ -1,18 +1,87 @@
 #include <unistd.h>
+#include <atomic>
 #include <sys/socket.h>
 #include <vector>
 #include "http_parser.h"
+#include "memory_budget.h"
 #include <cerrno>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <strings.h>
+#include <algorithm>
 
 using namespace std;
 
-extern size_t g_buffer_size;
-extern int g_default_http_port;
+extern atomic<size_t> g_buffer_size;
+extern atomic<int> g_default_http_port;
+
+// First line of a prior-knowledge HTTP/2 connection (RFC 7540 3.5)
+static const string HTTP2_PREFACE_LINE = "PRI * HTTP/2.0\r\n\r\n";
+
+// Case-insensitive lookup of a header value in the first header_length
+// bytes of the request
+static bool find_header(const string &headers, size_t header_length,
+                        const string &name, string &value)
+{
+    size_t pos = headers.find("\r\n");
+    while (pos != string::npos && pos + 2 < header_length)
+    {
+        size_t start = pos + 2;
+        size_t end = headers.find("\r\n", start);
+        if (end == string::npos || end == start || end > header_length)
+            return false;
+
+        size_t colon = headers.find(':', start);
+        if (colon != string::npos && colon < end &&
+            colon - start == name.size() &&
+            strncasecmp(headers.c_str() + start, name.c_str(), name.size()) == 0)
+        {
+            size_t v = headers.find_first_not_of(" \t", colon + 1);
+            value = (v == string::npos || v >= end)
+                        ? ""
+                        : headers.substr(v, end - v);
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+static void parse_request_headers(HttpRequest &req)
+{
+    const string &headers = req.raw_request;
+    size_t length = req.header_length;
+    string value;
+
+    if (find_header(headers, length, "Transfer-Encoding", value))
+    {
+        for (char &c : value)
+            c = tolower(c);
+        req.chunked = value.find("chunked") != string::npos;
+    }
+
+    // Transfer-Encoding takes precedence over Content-Length
+    if (!req.chunked && find_header(headers, length, "Content-Length", value))
+        req.content_length = strtoll(value.c_str(), nullptr, 10);
+
+    if (find_header(headers, length, "Accept-Encoding", value))
+        req.accept_encoding = value;
+
+    if (find_header(headers, length, "Upgrade", value) &&
+        find_header(headers, length, "HTTP2-Settings", req.http2_settings))
+    {
+        for (char &c : value)
+            c = tolower(c);
+        req.h2c_upgrade = value.find("h2c") != string::npos;
+    }
+}
 
 bool parse_http_request(int client_fd, HttpRequest &req)
 {
     vector<char> buffer(g_buffer_size);
     string data;
+    MemoryCharge memory(MEM_REQUESTS, buffer.size());
 
     while (data.find("\r\n\r\n") == string::npos)
     {
@@ -23,6 +92,7 @@ bool parse_http_request(int client_fd, HttpRequest &req)
         if (bytes > 0)
         {
             data.append(buffer.data(), bytes);
+            memory.resize(buffer.size() + data.capacity());
 
             if (data.size() > 8192)
                 return false; // header too large (DoS protection)
@@ -44,20 +114,37 @@ bool parse_http_request(int client_fd, HttpRequest &req)
         return false;
     }
 
-    req.raw_request = data;
-    size_t line_end = data.find("\r\n");
+    // Keep the received bytes as they are; the forwarder rewrites the
+    // request line and headers as scatter-gather segments over them
+    req.raw_request.swap(data);
+    const string &raw = req.raw_request;
+
+    // HTTP/2 connection preface: the rest of it follows the blank line
+    if (raw.compare(0, HTTP2_PREFACE_LINE.size(), HTTP2_PREFACE_LINE) == 0)
+    {
+        req.method = "PRI";
+        req.version = "2.0";
+        req.request_line_length = HTTP2_PREFACE_LINE.size() - 4;
+        req.header_length = HTTP2_PREFACE_LINE.size();
+        return true;
+    }
+
+    size_t line_end = raw.find("\r\n");
     if (line_end == string::npos)
         return false;
 
-    string request_line = data.substr(0, line_end);
-    size_t m1 = request_line.find(' ');
-    size_t m2 = request_line.find(' ', m1 + 1);
-    if (m1 == string::npos || m2 == string::npos)
+    size_t m1 = raw.find(' ');
+    size_t m2 = m1 == string::npos ? string::npos : raw.find(' ', m1 + 1);
+    if (m1 == string::npos || m2 == string::npos || m2 > line_end)
         return false;
 
-    req.method = request_line.substr(0, m1);
-    string uri = request_line.substr(m1 + 1, m2 - m1 - 1);
+    req.method = raw.substr(0, m1);
+    string uri = raw.substr(m1 + 1, m2 - m1 - 1);
     req.port = g_default_http_port;
+    req.request_line_length = line_end;
+
+    if (raw.compare(m2 + 1, 5, "HTTP/") == 0)
+        req.version = raw.substr(m2 + 6, line_end - m2 - 6);
 
     if (req.method == "CONNECT")
     {
@@ -75,21 +162,142 @@ bool parse_http_request(int client_fd, HttpRequest &req)
         size_t slash = rest.find('/');
         req.host = (slash == string::npos) ? rest : rest.substr(0, slash);
         req.path = (slash == string::npos) ? "/" : rest.substr(slash);
+
+        if (slash != string::npos)
+        {
+            req.path_offset = m1 + 1 + 7 + slash;
+            req.path_length = req.path.size();
+        }
     }
     else
     {
         req.path = uri;
-        size_t host_pos = data.find("\r\nHost:");
+        req.path_offset = m1 + 1;
+        req.path_length = uri.size();
+
+        size_t host_pos = raw.find("\r\nHost:");
         if (host_pos == string::npos)
             return false;
         size_t start = host_pos + 7;
-        size_t end = data.find("\r\n", start);
-        req.host = data.substr(start, end - start);
+        size_t end = raw.find("\r\n", start);
+        req.host = raw.substr(start, end - start);
         while (!req.host.empty() && req.host[0] == ' ')
             req.host.erase(0, 1);
     }
 
-    string new_line = req.method + " " + req.path + " HTTP/1.0";
-    req.raw_request.replace(0, line_end, new_line);
+    // "host:port" in the URI or Host header selects the origin port
+    size_t colon = req.host.rfind(':');
+    if (colon != string::npos && req.host.find(']') == string::npos)
+    {
+        int port = atoi(req.host.c_str() + colon + 1);
+        if (port <= 0 || port > 65535)
+            return false;
+        req.port = port;
+        req.host.erase(colon);
+    }
+
+    req.header_length = raw.find("\r\n\r\n") + 4;
+    parse_request_headers(req);
     return true;
 }
+
+size_t ChunkedDecoder::feed(const char *data, size_t len, string *payload)
+{
+    size_t i = 0;
+
+    while (i < len && state != DONE && state != FAILED)
+    {
+        char c = data[i];
+
+        switch (state)
+        {
+        case SIZE:
+            if (isxdigit(static_cast<unsigned char>(c)))
+            {
+                int digit = isdigit(static_cast<unsigned char>(c))
+                                ? c - '0'
+                                : tolower(c) - 'a' + 10;
+                if (remaining > (SIZE_MAX >> 4))
+                {
+                    state = FAILED;
+                    break;
+                }
+                remaining = remaining * 16 + digit;
+                size_digits = true;
+            }
+            else if (c == ';' || c == ' ' || c == '\t')
+                state = SIZE_EXT;
+            else if (c == '\r')
+                state = SIZE_LF;
+            else
+                state = FAILED;
+            ++i;
+            break;
+
+        case SIZE_EXT:
+            if (c == '\r')
+                state = SIZE_LF;
+            ++i;
+            break;
+
+        case SIZE_LF:
+            if (c != '\n' || !size_digits)
+            {
+                state = FAILED;
+                break;
+            }
+            ++i;
+            size_digits = false;
+            state = remaining > 0 ? DATA : TRAILER;
+            line_length = 0;
+            break;
+
+        case DATA:
+        {
+            size_t take = min(remaining, len - i);
+            if (payload)
+                payload->append(data + i, take);
+            remaining -= take;
+            i += take;
+            if (remaining == 0)
+                state = DATA_CR;
+            break;
+        }
+
+        case DATA_CR:
+            state = c == '\r' ? DATA_LF : FAILED;
+            ++i;
+            break;
+
+        case DATA_LF:
+            state = c == '\n' ? SIZE : FAILED;
+            ++i;
+            break;
+
+        case TRAILER:
+            // Trailer fields until an empty line
+            if (c == '\r')
+                state = TRAILER_LF;
+            else
+                ++line_length;
+            ++i;
+            break;
+
+        case TRAILER_LF:
+            if (c != '\n')
+            {
+                state = FAILED;
+                break;
+            }
+            ++i;
+            state = line_length == 0 ? DONE : TRAILER;
+            line_length = 0;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return i;
+}
@@ -11,6 +11,7 @@ using namespace std;
 static ofstream log_file;
 static mutex log_mutex;
 static string log_filename;
+static ino_t log_inode = 0; // file the stream has open
 
 // Default: 5 MB
 static size_t MAX_LOG_SIZE = 5 * 1024 * 1024;
@@ -25,17 +26,27 @@ static string current_timestamp()
     return string(buf);
 }
 
-static size_t file_size(const string &path)
+static void open_log_file()
 {
+    log_file.open(log_filename, ios::out | ios::app);
+
     struct stat st{};
-    if (stat(path.c_str(), &st) == 0)
-        return st.st_size;
-    return 0;
+    log_inode = stat(log_filename.c_str(), &st) == 0 ? st.st_ino : 0;
 }
 
 static void rotate_log_if_needed()
 {
-    if (file_size(log_filename) < MAX_LOG_SIZE)
+    // Prefork workers share the file: whichever process rotates it,
+    // the others follow once the name points at a new file
+    struct stat st{};
+    if (stat(log_filename.c_str(), &st) != 0 || st.st_ino != log_inode)
+    {
+        log_file.close();
+        open_log_file();
+        return;
+    }
+
+    if ((size_t)st.st_size < MAX_LOG_SIZE)
         return;
 
     log_file.close();
@@ -44,18 +55,19 @@ static void rotate_log_if_needed()
     remove(rotated.c_str()); // overwrite old rotation
     rename(log_filename.c_str(), rotated.c_str());
 
-    log_file.open(log_filename, ios::app);
+    open_log_file();
 }
 
 void set_log_max_size(size_t bytes)
 {
+    lock_guard<mutex> lock(log_mutex);
     MAX_LOG_SIZE = bytes;
 }
 
 void init_logger(const string &filename)
 {
     log_filename = filename;
-    log_file.open(log_filename, ios::out | ios::app);
+    open_log_file();
 
     if (!log_file.is_open())
     {
@@ -8,23 +8,88 @@
 #include "logger.h"
 #include "config.h"
 #include "metrics.h"
+#include "trace.h"
+#include "timeouts.h"
+#include "access_log.h"
+#include "capture.h"
+#include "upgrade.h"
+#include "upstream_pool.h"
+#include "prefork.h"
 
 using namespace std;
 
-extern size_t g_buffer_size;
-extern int g_default_http_port;
-extern int g_socket_timeout;
-
 void handle_signal(int)
 {
     cout << "\n[INFO] Caught termination signal" << endl;
     request_shutdown();
 }
 
-int main(int argc, char *argv[])
+void handle_trace_signal(int)
+{
+    request_trace_dump();
+}
+
+void handle_reload_signal(int)
+{
+    request_reload();
+}
+
+void handle_upgrade_signal(int)
+{
+    request_upgrade();
+}
+
+static void install_signal_handlers()
 {
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    signal(SIGUSR1, handle_trace_signal);
+    signal(SIGHUP, handle_reload_signal);
+    signal(SIGUSR2, handle_upgrade_signal);
+}
+
+// Everything that starts threads or owns per-process files; in prefork
+// mode this runs in each worker after fork
+static int serve(const RuntimeConfig &cfg)
+{
+    install_signal_handlers();
+
+    if (cfg.access_log_format == "binary" || cfg.access_log_format == "both")
+    {
+        if (!init_access_log(cfg.access_log_dir, cfg.access_log_segment_size))
+            return 1;
+    }
+
+    init_tracing(cfg.trace_sample_rate,
+                 cfg.trace_buffer_spans,
+                 cfg.trace_file);
+    init_timeouts();
+    init_upstreams();
+
+    log_event("==================================================");
+    log_event("SERVER START");
+    log_event("==================================================");
+
+    cout << "[INFO] Starting proxy on "
+         << cfg.listen_address << ":"
+         << cfg.listen_port << endl;
+
+    start_server(cfg);
+
+    cout << "[INFO] Proxy stopped cleanly" << endl;
+    stop_upstreams();
+    stop_timeouts();
+    flush_access_log();
+    flush_capture();
+    stop_metrics();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    install_signal_handlers();
+
+    init_upgrade(argc, argv);
 
     RuntimeConfig cfg;
     if (!load_config("config/proxy.conf", cfg))
@@ -41,30 +106,26 @@ int main(int argc, char *argv[])
         cfg.listen_port = port;
     }
 
-    g_buffer_size = cfg.buffer_size;
-    g_default_http_port = cfg.default_http_port;
-    g_socket_timeout = cfg.socket_timeout;
+    publish_runtime_config(cfg);
 
     if (!load_blocklist(cfg.blocklist_file))
         return 1;
 
+    if (cfg.reverse_proxy && !load_upstreams(cfg.upstreams_file))
+        return 1;
+
     init_logger(cfg.log_file);
     set_log_max_size(cfg.max_log_size);
-    init_metrics(cfg.metrics_file);
 
-    log_event("==================================================");
-    log_event("SERVER START");
-    log_event("==================================================");
+    // Workers inherit the capture descriptor; records are appended in
+    // whole buffers, so processes do not interleave within one
+    if (!cfg.capture_file.empty() && !init_capture(cfg.capture_file))
+        return 1;
 
-    cout << "[INFO] Starting proxy on "
-         << cfg.listen_address << ":"
-         << cfg.listen_port << endl;
+    init_metrics(cfg.metrics_file);
 
-    start_server(cfg.listen_address,
-                 cfg.listen_port,
-                 cfg.thread_pool_size);
+    if (cfg.worker_processes > 0)
+        return run_prefork(cfg, serve);
 
-    cout << "[INFO] Proxy stopped cleanly" << endl;
-    stop_metrics();
-    return 0;
+    return serve(cfg);
 }
@@ -0,0 +1,177 @@
+#include "memory_budget.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+static atomic<size_t> budget(0);
+static atomic<int> pause_percent(80);
+
+static atomic<size_t> pool_bytes[MEM_POOL_COUNT];
+static atomic<size_t> total_bytes(0);
+static atomic<size_t> peak_bytes(0);
+
+static atomic<size_t> connection_peak_max(0);
+static atomic<uint64_t> connection_peak_sum(0);
+static atomic<uint64_t> connection_count(0);
+static atomic<uint64_t> rejected_connections(0);
+static atomic<uint64_t> paused_reads(0);
+
+// Bytes charged on this thread since its connection scope opened
+static thread_local bool in_connection = false;
+static thread_local size_t connection_bytes = 0;
+static thread_local size_t connection_peak = 0;
+
+const char *memory_pool_name(int pool)
+{
+    switch (pool)
+    {
+    case MEM_RELAY_BUFFERS:
+        return "relay_buffers";
+    case MEM_REQUESTS:
+        return "requests";
+    case MEM_COMPRESSION:
+        return "compression";
+    case MEM_QUEUE:
+        return "queue";
+    case MEM_METRICS:
+        return "metrics";
+    default:
+        return "unknown";
+    }
+}
+
+void set_memory_settings(const MemorySettings &settings)
+{
+    budget.store(settings.budget);
+    pause_percent.store(max(1, min(100, settings.pause_percent)));
+}
+
+void memory_charge(MemoryPool pool, size_t bytes)
+{
+    if (bytes == 0)
+        return;
+
+    pool_bytes[pool].fetch_add(bytes, memory_order_relaxed);
+    size_t total = total_bytes.fetch_add(bytes, memory_order_relaxed) + bytes;
+
+    size_t peak = peak_bytes.load(memory_order_relaxed);
+    while (total > peak &&
+           !peak_bytes.compare_exchange_weak(peak, total, memory_order_relaxed))
+    {
+    }
+
+    if (in_connection)
+    {
+        connection_bytes += bytes;
+        connection_peak = max(connection_peak, connection_bytes);
+    }
+}
+
+void memory_release(MemoryPool pool, size_t bytes)
+{
+    if (bytes == 0)
+        return;
+
+    pool_bytes[pool].fetch_sub(bytes, memory_order_relaxed);
+    total_bytes.fetch_sub(bytes, memory_order_relaxed);
+
+    // Charges taken before the scope opened may be released inside it
+    if (in_connection)
+        connection_bytes -= min(connection_bytes, bytes);
+}
+
+MemoryCharge::MemoryCharge(MemoryPool pool, size_t bytes)
+    : pool(pool), bytes(bytes)
+{
+    memory_charge(pool, bytes);
+}
+
+MemoryCharge::~MemoryCharge()
+{
+    memory_release(pool, bytes);
+}
+
+void MemoryCharge::resize(size_t new_bytes)
+{
+    if (new_bytes > bytes)
+        memory_charge(pool, new_bytes - bytes);
+    else
+        memory_release(pool, bytes - new_bytes);
+    bytes = new_bytes;
+}
+
+ConnectionMemoryScope::ConnectionMemoryScope()
+{
+    in_connection = true;
+    connection_bytes = 0;
+    connection_peak = 0;
+}
+
+ConnectionMemoryScope::~ConnectionMemoryScope()
+{
+    in_connection = false;
+
+    size_t peak = connection_peak_max.load(memory_order_relaxed);
+    while (connection_peak > peak &&
+           !connection_peak_max.compare_exchange_weak(peak, connection_peak,
+                                                      memory_order_relaxed))
+    {
+    }
+    connection_peak_sum.fetch_add(connection_peak, memory_order_relaxed);
+    connection_count.fetch_add(1, memory_order_relaxed);
+}
+
+bool memory_admit_connection()
+{
+    size_t limit = budget.load(memory_order_relaxed);
+    if (limit == 0 || total_bytes.load(memory_order_relaxed) < limit)
+        return true;
+
+    rejected_connections.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+bool memory_under_pressure()
+{
+    size_t limit = budget.load(memory_order_relaxed);
+    if (limit == 0)
+        return false;
+
+    return total_bytes.load(memory_order_relaxed) >=
+           limit / 100 * pause_percent.load(memory_order_relaxed);
+}
+
+void memory_pause_reads(int max_ms)
+{
+    if (!memory_under_pressure())
+        return;
+
+    paused_reads.fetch_add(1, memory_order_relaxed);
+
+    // Not reading lets the peer's TCP window fill; other connections
+    // finishing or shrinking their buffers bring usage back down
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(max_ms);
+    while (memory_under_pressure() && chrono::steady_clock::now() < deadline)
+        this_thread::sleep_for(chrono::milliseconds(5));
+}
+
+MemorySnapshot memory_snapshot()
+{
+    MemorySnapshot snap{};
+    snap.budget = budget.load();
+    snap.used = total_bytes.load();
+    snap.peak = peak_bytes.load();
+    for (int i = 0; i < MEM_POOL_COUNT; ++i)
+        snap.pools[i] = pool_bytes[i].load();
+
+    uint64_t count = connection_count.load();
+    snap.connection_peak_max = connection_peak_max.load();
+    snap.connection_peak_avg = count ? connection_peak_sum.load() / count : 0;
+    snap.rejected_connections = rejected_connections.load();
+    snap.paused_reads = paused_reads.load();
+    return snap;
+}
@@ -1,6 +1,9 @@
 #include "metrics.h"
+#include "memory_budget.h"
+#include "shared_metrics.h"
 
 #include <unordered_map>
+#include <map>
 #include <mutex>
 #include <chrono>
 #include <fstream>
@@ -10,18 +13,80 @@
 using namespace std;
 
 static unordered_map<string, size_t> host_counts;
+static unordered_map<string, size_t> rule_hits;
 
-static size_t total_requests = 0;
-static size_t allowed_requests = 0;
-static size_t blocked_requests = 0;
-static size_t total_bytes = 0;
+// host_counts is pruned to its busiest half when it outgrows this
+static size_t max_hosts = 1000;
+static size_t counter_bytes = 0;
+static MemoryCharge counter_memory(MEM_METRICS);
+
+struct WorkerCounters
+{
+    int cpu = -1;
+    size_t connections = 0;
+    size_t local_connections = 0;
+    size_t bytes = 0;
+    uint64_t busy_us = 0;
+};
+
+static map<size_t, WorkerCounters> worker_counters;
+
+static uint64_t counters[METRIC_COUNT];
+
+// Set in prefork workers: counts go to this process's slot of the
+// shared region and the supervisor writes metrics_file
+static SharedMetricsSlot *shared_slot = nullptr;
 
 static chrono::steady_clock::time_point start_time;
 static string metrics_path;
 
 static mutex metrics_mutex;
 
-static void write_metrics_locked()
+
+// Holds metrics_mutex, except in a prefork worker where every update
+// is an atomic on the shared slot
+class MetricsLock
+{
+public:
+    MetricsLock() : lock(metrics_mutex, defer_lock)
+    {
+        if (!shared_slot)
+            lock.lock();
+    }
+
+private:
+    unique_lock<mutex> lock;
+};
+
+static void count(MetricCounter counter, uint64_t n = 1)
+{
+    if (shared_slot)
+        shared_slot->counters[counter].fetch_add(n, memory_order_relaxed);
+    else
+        counters[counter] += n;
+}
+
+template <typename Map>
+static vector<pair<string, uint64_t>> top_entries(const Map &entries)
+{
+    vector<pair<string, uint64_t>> top(entries.begin(), entries.end());
+    size_t limit = min<size_t>(5, top.size());
+    partial_sort(top.begin(), top.begin() + limit, top.end(),
+                 [](const auto &a, const auto &b)
+                 {
+                     return a.second > b.second;
+                 });
+    top.resize(limit);
+    return top;
+}
+
+// Shared by the single-process writer and the prefork supervisor;
+// extra holds the per-worker or per-process lines
+static void write_metrics_file(const uint64_t *values,
+                               const vector<pair<string, uint64_t>> &top_hosts,
+                               const vector<pair<string, uint64_t>> &top_rules,
+                               const MemorySnapshot &mem,
+                               const string &extra)
 {
     auto now = chrono::steady_clock::now();
     double elapsed_minutes =
@@ -31,36 +96,72 @@ static void write_metrics_locked()
         60.0;
 
     double rpm = (elapsed_minutes > 0.0)
-                     ? total_requests / elapsed_minutes
+                     ? values[M_TOTAL_REQUESTS] / elapsed_minutes
                      : 0.0;
 
-    vector<pair<string, size_t>> top(host_counts.begin(),
-                                     host_counts.end());
-
-    sort(top.begin(), top.end(),
-         [](const auto &a, const auto &b)
-         {
-             return a.second > b.second;
-         });
-
     ofstream out(metrics_path, ios::out); // overwrite
     if (!out.is_open())
         return;
 
-    out << "total_requests=" << total_requests << "\n";
-    out << "allowed_requests=" << allowed_requests << "\n";
-    out << "blocked_requests=" << blocked_requests << "\n";
-    out << "bytes_transferred=" << total_bytes << "\n";
-    out << "requests_per_min=" << rpm << "\n";
+    for (int i = 0; i < METRIC_COUNT; ++i)
+    {
+        out << metric_counter_name(i) << "=" << values[i] << "\n";
+
+        if (i == M_BYTES_TRANSFERRED)
+            out << "requests_per_min=" << rpm << "\n";
+
+        if (i == M_COMPRESSION_BYTES_OUT)
+        {
+            uint64_t in = values[M_COMPRESSION_BYTES_IN];
+            uint64_t compressed = values[M_COMPRESSION_BYTES_OUT];
+            out << "compression_bytes_saved="
+                << (in > compressed ? in - compressed : 0) << "\n";
+        }
+    }
 
     out << "top_hosts=";
-    size_t limit = min<size_t>(5, top.size());
-    for (size_t i = 0; i < limit; ++i)
+    for (const auto &entry : top_hosts)
+        out << entry.first << "(" << entry.second << ") ";
+    out << "\n";
+
+    out << "top_block_rules=";
+    for (const auto &entry : top_rules)
+        out << entry.first << "(" << entry.second << ") ";
+    out << "\n";
+
+    out << "memory_budget=" << mem.budget << "\n";
+    out << "memory_used=" << mem.used << "\n";
+    out << "memory_peak=" << mem.peak << "\n";
+    for (int i = 0; i < MEM_POOL_COUNT; ++i)
+        out << "memory_" << memory_pool_name(i) << "=" << mem.pools[i] << "\n";
+    out << "memory_connection_peak_max=" << mem.connection_peak_max << "\n";
+    out << "memory_connection_peak_avg=" << mem.connection_peak_avg << "\n";
+    out << "memory_rejected_connections=" << mem.rejected_connections << "\n";
+    out << "memory_paused_reads=" << mem.paused_reads << "\n";
+
+    out << extra;
+}
+
+static void write_metrics_locked()
+{
+    // The supervisor aggregates prefork workers' slots instead
+    if (shared_slot)
+        return;
+
+    string workers;
+    for (const auto &entry : worker_counters)
     {
-        out << top[i].first << "("
-            << top[i].second << ") ";
+        const WorkerCounters &w = entry.second;
+        workers += "worker_" + to_string(entry.first) +
+                   "=cpu:" + to_string(w.cpu) +
+                   " connections:" + to_string(w.connections) +
+                   " local:" + to_string(w.local_connections) +
+                   " bytes:" + to_string(w.bytes) +
+                   " busy_ms:" + to_string(w.busy_us / 1000) + "\n";
     }
-    out << "\n";
+
+    write_metrics_file(counters, top_entries(host_counts),
+                       top_entries(rule_hits), memory_snapshot(), workers);
 }
 
 void init_metrics(const string &metrics_file)
@@ -70,38 +171,280 @@ void init_metrics(const string &metrics_file)
     metrics_path = metrics_file;
 
     host_counts.clear();
-    total_requests = 0;
-    allowed_requests = 0;
-    blocked_requests = 0;
-    total_bytes = 0;
+    rule_hits.clear();
+    worker_counters.clear();
+    for (uint64_t &value : counters)
+        value = 0;
 
     start_time = chrono::steady_clock::now();
+    counter_bytes = 0;
+    counter_memory.resize(0);
 
     write_metrics_locked(); // refresh file
 }
 
-void record_allowed(const string &host, size_t bytes)
+void metrics_use_shared_slot(SharedMetricsSlot *slot)
 {
     lock_guard<mutex> lock(metrics_mutex);
+    shared_slot = slot;
+}
 
-    ++total_requests;
-    ++allowed_requests;
-    total_bytes += bytes;
-    ++host_counts[host];
+void publish_process_metrics()
+{
+    if (shared_slot)
+        shared_store_memory(*shared_slot, memory_snapshot());
+}
 
-    write_metrics_locked();
+void write_shared_metrics(const SharedMetricsSlot *slots, size_t count)
+{
+    lock_guard<mutex> lock(metrics_mutex);
+
+    SharedMetricsTotals totals;
+    collect_shared_metrics(slots, count, totals);
+
+    string processes;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const SharedMetricsSlot &slot = slots[i];
+        processes += "process_" + to_string(i) +
+                     "=pid:" + to_string(slot.pid.load()) +
+                     " restarts:" + to_string(slot.restarts.load()) +
+                     " requests:" +
+                     to_string(slot.counters[M_TOTAL_REQUESTS].load()) +
+                     " bytes:" +
+                     to_string(slot.counters[M_BYTES_TRANSFERRED].load()) +
+                     " memory_used:" + to_string(slot.memory.used.load()) +
+                     "\n";
+    }
+
+    // Thread indexes are per process, so worker lines are per process too
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (size_t n = 0; n < SHARED_WORKER_ENTRIES; ++n)
+        {
+            const SharedWorkerCounters &w = slots[i].workers[n];
+            uint64_t connections = w.connections.load();
+            if (connections == 0)
+                continue;
+            processes += "process_" + to_string(i) + "_worker_" + to_string(n) +
+                         "=cpu:" + to_string(w.cpu.load()) +
+                         " connections:" + to_string(connections) +
+                         " local:" + to_string(w.local_connections.load()) +
+                         " bytes:" + to_string(w.bytes.load()) +
+                         " busy_ms:" + to_string(w.busy_us.load() / 1000) + "\n";
+        }
+    }
+    processes += "dropped_counter_names=" + to_string(totals.dropped_names) + "\n";
+
+    write_metrics_file(totals.counters, top_entries(totals.hosts),
+                       top_entries(totals.rules), totals.memory, processes);
 }
 
-void record_blocked()
+// Approximate heap footprint of one counter map entry
+static size_t counter_entry_bytes(const string &key)
+{
+    return key.capacity() + sizeof(pair<const string, size_t>) +
+           2 * sizeof(void *);
+}
+
+static void account_counters_locked()
+{
+    size_t bytes = 0;
+    for (const auto &entry : host_counts)
+        bytes += counter_entry_bytes(entry.first);
+    for (const auto &entry : rule_hits)
+        bytes += counter_entry_bytes(entry.first);
+    counter_bytes = bytes;
+    counter_memory.resize(counter_bytes);
+}
+
+// Keeps the busiest half so the top hosts survive; hosts seen only
+// once or twice (scans, random subdomains) are what gets dropped
+static void prune_hosts_locked()
+{
+    vector<pair<string, size_t>> entries(host_counts.begin(),
+                                         host_counts.end());
+    size_t keep = max<size_t>(1, max_hosts / 2);
+    nth_element(entries.begin(), entries.begin() + keep, entries.end(),
+                [](const auto &a, const auto &b)
+                {
+                    return a.second > b.second;
+                });
+    entries.resize(keep);
+
+    host_counts.clear();
+    host_counts.insert(entries.begin(), entries.end());
+    account_counters_locked();
+}
+
+void set_metrics_max_hosts(size_t limit)
 {
     lock_guard<mutex> lock(metrics_mutex);
+    max_hosts = max<size_t>(2, limit);
+    if (host_counts.size() > max_hosts)
+        prune_hosts_locked();
+}
+
+static void count_host_locked(const string &host)
+{
+    if (shared_slot)
+    {
+        shared_count_host(*shared_slot, host);
+        return;
+    }
+
+    auto inserted = host_counts.emplace(host, 0);
+    ++inserted.first->second;
+    if (inserted.second)
+    {
+        if (host_counts.size() > max_hosts)
+            prune_hosts_locked();
+        else
+            counter_bytes += counter_entry_bytes(host);
+        counter_memory.resize(counter_bytes);
+    }
+}
+
+static void count_rule_locked(const string &rule)
+{
+    if (shared_slot)
+    {
+        shared_count_rule(*shared_slot, rule);
+        return;
+    }
+
+    if (++rule_hits[rule] == 1)
+        account_counters_locked();
+}
+
+void record_allowed(const string &host, size_t bytes)
+{
+    MetricsLock lock;
+
+    count(M_TOTAL_REQUESTS);
+    count(M_ALLOWED_REQUESTS);
+    count(M_BYTES_TRANSFERRED, bytes);
+    count_host_locked(host);
+
+    write_metrics_locked();
+}
+
+void record_blocked(const string &rule)
+{
+    MetricsLock lock;
+
+    count(M_TOTAL_REQUESTS);
+    count(M_BLOCKED_REQUESTS);
+    count_rule_locked(rule);
+
+    write_metrics_locked();
+}
+
+void record_rate_limited()
+{
+    MetricsLock lock;
+
+    count(M_TOTAL_REQUESTS);
+    count(M_RATE_LIMITED_REQUESTS);
+
+    write_metrics_locked();
+}
+
+void record_throttled(size_t bytes, size_t delay_ms)
+{
+    MetricsLock lock;
+
+    count(M_THROTTLED_BYTES, bytes);
+    count(M_THROTTLE_DELAY_MS, delay_ms);
+}
+
+void record_timeouts(size_t header, size_t idle, size_t lifetime)
+{
+    MetricsLock lock;
+
+    count(M_HEADER_TIMEOUTS, header);
+    count(M_IDLE_TIMEOUTS, idle);
+    count(M_LIFETIME_TIMEOUTS, lifetime);
 
-    ++total_requests;
-    ++blocked_requests;
+    write_metrics_locked();
+}
+
+void record_compression(size_t bytes_in, size_t bytes_out, uint64_t cpu_us)
+{
+    MetricsLock lock;
+
+    count(M_COMPRESSED_RESPONSES);
+    count(M_COMPRESSION_BYTES_IN, bytes_in);
+    count(M_COMPRESSION_BYTES_OUT, bytes_out);
+    count(M_COMPRESSION_CPU_US, cpu_us);
+}
+
+void record_upstream_unavailable()
+{
+    MetricsLock lock;
+
+    count(M_TOTAL_REQUESTS);
+    count(M_UPSTREAM_UNAVAILABLE);
+
+    write_metrics_locked();
+}
+
+void record_outlier_ejection()
+{
+    MetricsLock lock;
+
+    count(M_OUTLIER_EJECTIONS);
+
+    write_metrics_locked();
+}
+
+void record_http2_connection()
+{
+    MetricsLock lock;
+
+    count(M_HTTP2_CONNECTIONS);
+
+    write_metrics_locked();
+}
+
+void record_http2_stream(bool refused)
+{
+    MetricsLock lock;
+
+    count(refused ? M_HTTP2_REFUSED_STREAMS : M_HTTP2_STREAMS);
 
     write_metrics_locked();
 }
 
+void record_worker(size_t worker, int cpu, size_t bytes, uint64_t busy_us,
+                   bool local)
+{
+    if (shared_slot)
+    {
+        // Indexes are reused, so they stay far below the table size
+        if (worker >= SHARED_WORKER_ENTRIES)
+            return;
+        SharedWorkerCounters &w = shared_slot->workers[worker];
+        w.cpu.store(cpu, memory_order_relaxed);
+        w.connections.fetch_add(1, memory_order_relaxed);
+        if (local)
+            w.local_connections.fetch_add(1, memory_order_relaxed);
+        w.bytes.fetch_add(bytes, memory_order_relaxed);
+        w.busy_us.fetch_add(busy_us, memory_order_relaxed);
+        return;
+    }
+
+    lock_guard<mutex> lock(metrics_mutex);
+
+    WorkerCounters &w = worker_counters[worker];
+    w.cpu = cpu;
+    ++w.connections;
+    if (local)
+        ++w.local_connections;
+    w.bytes += bytes;
+    w.busy_us += busy_us;
+}
+
 void stop_metrics()
 {
     // nothing to do
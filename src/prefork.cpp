@@ -0,0 +1,285 @@
+#include "prefork.h"
+#include "server.h"
+#include "metrics.h"
+#include "shared_metrics.h"
+#include "logger.h"
+#include "blocklist.h"
+#include "upstream_pool.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static atomic<bool> stop_requested(false);
+static atomic<bool> reload_requested(false);
+static atomic<bool> trace_requested(false);
+static atomic<bool> upgrade_requested(false);
+
+// A worker that dies sooner than this after starting doubles its
+// restart delay, so one that cannot start does not spin
+static const int MIN_HEALTHY_SEC = 10;
+static const int FIRST_RESTART_MS = 100;
+static const int MAX_RESTART_MS = 10000;
+
+static const int METRICS_INTERVAL_MS = 1000;
+
+struct WorkerProcess
+{
+    pid_t pid = -1;
+    chrono::steady_clock::time_point started;
+    chrono::steady_clock::time_point restart_at;
+    int restart_delay_ms = FIRST_RESTART_MS;
+};
+
+static void handle_stop_signal(int)
+{
+    stop_requested.store(true);
+}
+
+static void handle_reload_signal(int)
+{
+    reload_requested.store(true);
+}
+
+static void handle_trace_signal(int)
+{
+    trace_requested.store(true);
+}
+
+static void handle_upgrade_signal(int)
+{
+    upgrade_requested.store(true);
+}
+
+static pid_t spawn_worker(size_t index, const RuntimeConfig &cfg,
+                          SharedMetricsSlot *slots, int listener,
+                          int (*serve)(const RuntimeConfig &))
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        metrics_use_shared_slot(&slots[index]);
+        if (listener >= 0)
+            set_inherited_listener(listener);
+        exit(serve(cfg));
+    }
+
+    slots[index].pid.store(pid);
+    log_event("WORKER START | index=" + to_string(index) +
+              " | pid=" + to_string(pid));
+    return pid;
+}
+
+static string describe_exit(int status)
+{
+    if (WIFSIGNALED(status))
+        return "signal " + to_string(WTERMSIG(status));
+    return "status " + to_string(WEXITSTATUS(status));
+}
+
+// Keeps the configuration that future workers start with in step with
+// the one running workers re-read on SIGHUP
+static void reload_supervisor_config(RuntimeConfig &cfg)
+{
+    RuntimeConfig next;
+    if (!reload_config(next) || !load_blocklist(next.blocklist_file) ||
+        (next.reverse_proxy && !load_upstreams(next.upstreams_file)))
+    {
+        log_event("CONFIG RELOAD FAILED | supervisor");
+        return;
+    }
+
+    // Fixed for the life of the supervisor
+    next.listen_address = cfg.listen_address;
+    next.listen_port = cfg.listen_port;
+    next.worker_processes = cfg.worker_processes;
+    next.reuseport = cfg.reuseport;
+
+    publish_runtime_config(next);
+    set_log_max_size(next.max_log_size);
+    cfg = next;
+}
+
+static void signal_workers(const vector<WorkerProcess> &workers, int sig)
+{
+    for (const WorkerProcess &w : workers)
+    {
+        if (w.pid > 0)
+            kill(w.pid, sig);
+    }
+}
+
+static int find_worker(const vector<WorkerProcess> &workers, pid_t pid)
+{
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        if (workers[i].pid == pid)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+int run_prefork(const RuntimeConfig &initial, int (*serve)(const RuntimeConfig &))
+{
+    RuntimeConfig cfg = initial;
+    size_t count = static_cast<size_t>(cfg.worker_processes);
+
+    SharedMetricsSlot *slots = create_shared_metrics(count);
+    if (!slots)
+        return 1;
+
+    int listener = -1;
+    if (!cfg.reuseport)
+    {
+        listener = open_listen_socket(cfg);
+        if (listener < 0)
+        {
+            destroy_shared_metrics(slots, count);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, handle_stop_signal);
+    signal(SIGTERM, handle_stop_signal);
+    signal(SIGHUP, handle_reload_signal);
+    signal(SIGUSR1, handle_trace_signal);
+    signal(SIGUSR2, handle_upgrade_signal);
+
+    cout << "[INFO] Supervisor " << getpid() << " starting " << count
+         << " worker processes"
+         << (cfg.reuseport ? " (SO_REUSEPORT)" : "") << endl;
+
+    vector<WorkerProcess> workers(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        workers[i].pid = spawn_worker(i, cfg, slots, listener, serve);
+        workers[i].started = chrono::steady_clock::now();
+    }
+
+    auto next_metrics = chrono::steady_clock::now();
+
+    while (!stop_requested.load())
+    {
+        if (reload_requested.exchange(false))
+        {
+            reload_supervisor_config(cfg);
+            signal_workers(workers, SIGHUP);
+        }
+
+        if (trace_requested.exchange(false))
+            signal_workers(workers, SIGUSR1);
+
+        if (upgrade_requested.exchange(false))
+        {
+            log_event("UPGRADE FAILED | not supported with worker_processes");
+            cerr << "[ERROR] Hot upgrade needs worker_processes = 0; "
+                    "restart the supervisor instead"
+                 << endl;
+        }
+
+        int status = 0;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            int index = find_worker(workers, pid);
+            if (index < 0)
+                continue;
+
+            WorkerProcess &w = workers[index];
+            auto now = chrono::steady_clock::now();
+            if (now - w.started < chrono::seconds(MIN_HEALTHY_SEC))
+                w.restart_delay_ms = min(w.restart_delay_ms * 2, MAX_RESTART_MS);
+            else
+                w.restart_delay_ms = FIRST_RESTART_MS;
+
+            w.pid = -1;
+            w.restart_at = now + chrono::milliseconds(w.restart_delay_ms);
+            shared_retire_process(slots[index]);
+
+            log_event("WORKER EXIT | index=" + to_string(index) +
+                      " | pid=" + to_string(pid) + " | " +
+                      describe_exit(status) + " | restart_ms=" +
+                      to_string(w.restart_delay_ms));
+            cerr << "[ERROR] Worker " << index << " (pid " << pid
+                 << ") exited with " << describe_exit(status)
+                 << "; restarting" << endl;
+        }
+
+        auto now = chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i)
+        {
+            WorkerProcess &w = workers[i];
+            if (w.pid > 0 || now < w.restart_at)
+                continue;
+
+            w.pid = spawn_worker(i, cfg, slots, listener, serve);
+            w.started = now;
+            if (w.pid > 0)
+                slots[i].restarts.fetch_add(1);
+            else
+                w.restart_at = now + chrono::milliseconds(MAX_RESTART_MS);
+        }
+
+        if (now >= next_metrics)
+        {
+            write_shared_metrics(slots, count);
+            next_metrics = now + chrono::milliseconds(METRICS_INTERVAL_MS);
+        }
+
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+
+    cout << "\n[INFO] Stopping worker processes" << endl;
+
+    // New connections are refused while the workers drain
+    if (listener >= 0)
+        close(listener);
+    signal_workers(workers, SIGTERM);
+
+    size_t running = count_if(workers.begin(), workers.end(),
+                              [](const WorkerProcess &w)
+                              {
+                                  return w.pid > 0;
+                              });
+    while (running > 0)
+    {
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        int index = find_worker(workers, pid);
+        if (index < 0)
+            continue;
+        workers[index].pid = -1;
+        shared_retire_process(slots[index]);
+        --running;
+    }
+
+    write_shared_metrics(slots, count);
+    destroy_shared_metrics(slots, count);
+
+    log_event("SUPERVISOR STOP");
+    return 0;
+}
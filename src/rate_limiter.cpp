@@ -0,0 +1,231 @@
+#include "rate_limiter.h"
+#include "metrics.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <algorithm>
+
+using namespace std;
+
+struct ClientBucket
+{
+    mutex bucket_mutex;
+    double byte_tokens = 0;
+    double request_tokens = 0;
+    double last_refill = 0; // seconds on the steady clock
+
+    atomic<double> last_seen{0};
+};
+
+using BucketMap = unordered_map<string, shared_ptr<ClientBucket>>;
+
+// Lookups load the shard's current map without locking; inserts and
+// evictions copy the map under the shard mutex and publish the copy.
+struct Shard
+{
+    shared_ptr<const BucketMap> map = make_shared<const BucketMap>();
+    mutex write_mutex;
+};
+
+static const size_t SHARD_COUNT = 64;
+static Shard shards[SHARD_COUNT];
+
+static atomic<double> bytes_per_sec(0);
+static atomic<double> burst_bytes(1024 * 1024);
+static atomic<double> requests_per_sec(0);
+static atomic<double> burst_requests(20);
+static atomic<int> max_request_wait_ms(2000);
+static atomic<int> idle_evict_sec(60);
+
+static atomic<double> last_sweep(0);
+
+// Per-connection state of the calling worker
+static thread_local shared_ptr<ClientBucket> current_bucket;
+static thread_local size_t throttled_bytes = 0;
+static thread_local double throttled_secs = 0;
+
+static double now_secs()
+{
+    return chrono::duration<double>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void set_rate_limits(const RateLimitSettings &settings)
+{
+    bytes_per_sec.store(settings.bytes_per_sec);
+    burst_bytes.store(settings.burst_bytes);
+    requests_per_sec.store(settings.requests_per_sec);
+    burst_requests.store(settings.burst_requests);
+    max_request_wait_ms.store(settings.max_request_wait_ms);
+    idle_evict_sec.store(settings.idle_evict_sec);
+}
+
+static shared_ptr<ClientBucket> find_bucket(const string &client_ip)
+{
+    Shard &shard = shards[hash<string>{}(client_ip) % SHARD_COUNT];
+
+    shared_ptr<const BucketMap> map = atomic_load(&shard.map);
+    auto it = map->find(client_ip);
+    if (it != map->end())
+        return it->second;
+
+    lock_guard<mutex> lock(shard.write_mutex);
+
+    // Another worker may have inserted it meanwhile
+    map = atomic_load(&shard.map);
+    it = map->find(client_ip);
+    if (it != map->end())
+        return it->second;
+
+    auto bucket = make_shared<ClientBucket>();
+    bucket->byte_tokens = burst_bytes.load();
+    bucket->request_tokens = burst_requests.load();
+    bucket->last_refill = now_secs();
+
+    auto updated = make_shared<BucketMap>(*map);
+    (*updated)[client_ip] = bucket;
+    atomic_store(&shard.map, shared_ptr<const BucketMap>(updated));
+
+    return bucket;
+}
+
+// Caller holds bucket_mutex
+static void refill(ClientBucket &bucket, double now)
+{
+    double elapsed = max(0.0, now - bucket.last_refill);
+    bucket.last_refill = now;
+
+    bucket.byte_tokens = min(burst_bytes.load(),
+                             bucket.byte_tokens + elapsed * bytes_per_sec.load());
+    bucket.request_tokens = min(burst_requests.load(),
+                                bucket.request_tokens + elapsed * requests_per_sec.load());
+}
+
+static void sleep_secs(double secs)
+{
+    this_thread::sleep_for(chrono::duration<double>(secs));
+}
+
+bool rate_limit_admit(const string &client_ip)
+{
+    throttled_bytes = 0;
+    throttled_secs = 0;
+
+    if (bytes_per_sec.load() <= 0 && requests_per_sec.load() <= 0)
+    {
+        current_bucket.reset();
+        return true;
+    }
+
+    current_bucket = find_bucket(client_ip);
+
+    double now = now_secs();
+    current_bucket->last_seen.store(now);
+
+    double rate = requests_per_sec.load();
+    if (rate <= 0)
+        return true;
+
+    double wait = 0;
+    {
+        lock_guard<mutex> lock(current_bucket->bucket_mutex);
+        refill(*current_bucket, now);
+
+        if (current_bucket->request_tokens < 1.0)
+        {
+            wait = (1.0 - current_bucket->request_tokens) / rate;
+            if (wait * 1000.0 > max_request_wait_ms.load())
+                return false;
+        }
+        current_bucket->request_tokens -= 1.0;
+    }
+
+    if (wait > 0)
+    {
+        throttled_secs += wait;
+        sleep_secs(wait);
+    }
+    return true;
+}
+
+void rate_limit_pace(size_t bytes)
+{
+    if (!current_bucket)
+        return;
+
+    double rate = bytes_per_sec.load();
+    if (rate <= 0)
+        return;
+
+    double now = now_secs();
+    current_bucket->last_seen.store(now);
+
+    // Tokens may go negative: the debt is repaid by sleeping, which
+    // spreads the transfer evenly instead of stalling on an empty bucket.
+    double wait = 0;
+    {
+        lock_guard<mutex> lock(current_bucket->bucket_mutex);
+        refill(*current_bucket, now);
+        current_bucket->byte_tokens -= bytes;
+        if (current_bucket->byte_tokens < 0)
+            wait = -current_bucket->byte_tokens / rate;
+    }
+
+    if (wait > 0)
+    {
+        throttled_bytes += bytes;
+        throttled_secs += wait;
+        sleep_secs(wait);
+    }
+}
+
+void rate_limit_release()
+{
+    if (throttled_bytes > 0 || throttled_secs > 0)
+        record_throttled(throttled_bytes,
+                         static_cast<size_t>(throttled_secs * 1000.0));
+
+    current_bucket.reset();
+    throttled_bytes = 0;
+    throttled_secs = 0;
+}
+
+void evict_idle_rate_limits()
+{
+    double now = now_secs();
+    double idle = idle_evict_sec.load();
+
+    // Cheap to call from a hot loop: sweeps at most once per second
+    double last = last_sweep.load();
+    if (now - last < 1.0 ||
+        !last_sweep.compare_exchange_strong(last, now))
+        return;
+
+    for (Shard &shard : shards)
+    {
+        shared_ptr<const BucketMap> map = atomic_load(&shard.map);
+        if (map->empty())
+            continue;
+
+        lock_guard<mutex> lock(shard.write_mutex);
+        map = atomic_load(&shard.map);
+
+        auto updated = make_shared<BucketMap>();
+        for (const auto &entry : *map)
+        {
+            // A bucket still bound to a worker is never idle
+            if (entry.second.use_count() > 1 ||
+                now - entry.second->last_seen.load() < idle)
+                updated->insert(entry);
+        }
+
+        if (updated->size() != map->size())
+            atomic_store(&shard.map, shared_ptr<const BucketMap>(updated));
+    }
+}
@@ -0,0 +1,225 @@
+#include "request_rewriter.h"
+
+#include <sys/socket.h>
+#include <climits>
+#include <atomic>
+#include <cstring>
+#include <strings.h>
+
+using namespace std;
+
+static atomic<bool> add_via(true);
+static atomic<bool> add_x_forwarded_for(false);
+
+static const char HTTP_10[] = " HTTP/1.0";
+static const char HTTP_11[] = " HTTP/1.1";
+static const char ROOT_PATH[] = "/";
+static const char CRLF[] = "\r\n";
+
+void set_rewrite(const RewriteSettings &settings)
+{
+    add_via.store(settings.add_via);
+    add_x_forwarded_for.store(settings.add_x_forwarded_for);
+}
+
+static bool name_is(const char *line, size_t name_len, const char *name)
+{
+    return name_len == strlen(name) && strncasecmp(line, name, name_len) == 0;
+}
+
+// Header names listed in Connection: are hop-by-hop as well
+static bool listed_in(const string &tokens, const char *line, size_t name_len)
+{
+    size_t pos = 0;
+    while (pos < tokens.size())
+    {
+        size_t comma = tokens.find(',', pos);
+        if (comma == string::npos)
+            comma = tokens.size();
+
+        size_t start = tokens.find_first_not_of(" \t", pos);
+        size_t end = comma;
+        while (end > start && (tokens[end - 1] == ' ' || tokens[end - 1] == '\t'))
+            --end;
+
+        if (start < end && end - start == name_len &&
+            strncasecmp(tokens.c_str() + start, line, name_len) == 0)
+            return true;
+        pos = comma + 1;
+    }
+    return false;
+}
+
+static bool hop_by_hop(const char *line, size_t name_len)
+{
+    // Transfer-Encoding is relayed: the body is forwarded with its framing
+    static const char *names[] = {"Connection", "Keep-Alive",
+                                  "Proxy-Connection", "Proxy-Authorization",
+                                  "TE", "Upgrade"};
+    for (const char *name : names)
+    {
+        if (name_is(line, name_len, name))
+            return true;
+    }
+    return false;
+}
+
+void RequestRewrite::keep(const char *data, size_t len)
+{
+    if (len == 0)
+        return;
+
+    total += len;
+
+    // Adjacent kept spans collapse into one segment
+    if (!segments.empty())
+    {
+        iovec &last = segments.back();
+        if (static_cast<char *>(last.iov_base) + last.iov_len == data)
+        {
+            last.iov_len += len;
+            return;
+        }
+    }
+    segments.push_back({const_cast<char *>(data), len});
+}
+
+void RequestRewrite::insert(string text)
+{
+    inserted.push_back(move(text));
+    const string &stored = inserted.back();
+    total += stored.size();
+    segments.push_back({const_cast<char *>(stored.data()), stored.size()});
+}
+
+RequestRewrite::RequestRewrite(const HttpRequest &req, const string &client_ip)
+{
+    const string &raw = req.raw_request;
+    const char *base = raw.data();
+
+    // Request line: "<method> <path> HTTP/1.0". A chunked body is relayed
+    // with its framing, which HTTP/1.0 does not allow (RFC 9112 6.1), so
+    // such requests go out as HTTP/1.1 with Connection: close instead
+    keep(base, req.method.size() + 1);
+    if (req.path_length > 0)
+        keep(base + req.path_offset, req.path_length);
+    else
+        keep(ROOT_PATH, 1);
+    if (req.chunked)
+        keep(HTTP_11, sizeof(HTTP_11) - 1);
+    else
+        keep(HTTP_10, sizeof(HTTP_10) - 1);
+    keep(CRLF, 2);
+
+    // First pass: collect Connection tokens
+    string connection_tokens;
+    size_t headers_end = req.header_length - 2; // before the blank line
+    size_t pos = req.request_line_length + 2;
+    while (pos < headers_end)
+    {
+        size_t end = raw.find("\r\n", pos);
+        size_t colon = raw.find(':', pos);
+        if (colon < end && name_is(base + pos, colon - pos, "Connection"))
+        {
+            if (!connection_tokens.empty())
+                connection_tokens += ',';
+            connection_tokens.append(base + colon + 1, end - colon - 1);
+        }
+        pos = end + 2;
+    }
+
+    bool via = add_via.load();
+    bool xff = add_x_forwarded_for.load();
+    bool host_seen = false;
+    string via_value = req.version + " proxy";
+
+    pos = req.request_line_length + 2;
+    while (pos < headers_end)
+    {
+        size_t end = raw.find("\r\n", pos);
+        size_t colon = raw.find(':', pos);
+        size_t name_len = colon < end ? colon - pos : 0;
+        const char *line = base + pos;
+
+        if (name_len > 0 &&
+            (hop_by_hop(line, name_len) ||
+             listed_in(connection_tokens, line, name_len)))
+        {
+            pos = end + 2;
+            continue;
+        }
+
+        if (name_len > 0 && name_is(line, name_len, "Host"))
+            host_seen = true;
+
+        // Extend an existing Via / X-Forwarded-For list in place
+        if (via && name_len > 0 && name_is(line, name_len, "Via"))
+        {
+            keep(line, end - pos);
+            insert(", " + via_value);
+            keep(base + end, 2);
+            via = false;
+        }
+        else if (xff && name_len > 0 &&
+                 name_is(line, name_len, "X-Forwarded-For"))
+        {
+            keep(line, end - pos);
+            insert(", " + client_ip);
+            keep(base + end, 2);
+            xff = false;
+        }
+        else
+        {
+            keep(line, end + 2 - pos);
+        }
+        pos = end + 2;
+    }
+
+    if (via)
+        insert("Via: " + via_value + "\r\n");
+    if (xff)
+        insert("X-Forwarded-For: " + client_ip + "\r\n");
+    if (req.chunked)
+    {
+        // HTTP/1.1 requires Host; the client's Connection was dropped above
+        if (!host_seen)
+            insert("Host: " + req.host +
+                   (req.port != 80 ? ":" + to_string(req.port) : "") + "\r\n");
+        insert("Connection: close\r\n");
+    }
+
+    // Blank line and any body bytes that arrived with the header
+    keep(base + headers_end, raw.size() - headers_end);
+}
+
+bool RequestRewrite::send_to(int fd)
+{
+    size_t index = 0;
+
+    while (index < segments.size())
+    {
+        msghdr msg{};
+        msg.msg_iov = &segments[index];
+        msg.msg_iovlen = min<size_t>(segments.size() - index, IOV_MAX);
+
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+
+        // Partial write: skip what was sent and resume mid-segment
+        size_t sent = n;
+        while (index < segments.size() && sent >= segments[index].iov_len)
+        {
+            sent -= segments[index].iov_len;
+            ++index;
+        }
+        if (sent > 0)
+        {
+            segments[index].iov_base =
+                static_cast<char *>(segments[index].iov_base) + sent;
+            segments[index].iov_len -= sent;
+        }
+    }
+
+    return true;
+}
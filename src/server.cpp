@@ -6,14 +6,36 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <cerrno>
 #include <atomic>
 #include <iostream>
 #include "logger.h"
+#include "trace.h"
+#include "config.h"
+#include "socket_tuning.h"
+#include "rate_limiter.h"
+#include "access_log.h"
+#include "timeouts.h"
+#include "blocklist.h"
+#include "upgrade.h"
+#include "cpu_affinity.h"
+#include "upstream_pool.h"
+#include "memory_budget.h"
+#include "metrics.h"
+
+#include <chrono>
+#include <thread>
 
 using namespace std;
 
 static atomic<bool> shutdown_requested(false);
+static atomic<bool> reload_requested(false);
+static atomic<bool> upgrade_requested(false);
+static atomic<int> drain_timeout(30);
 static int listen_fd = -1;
+static int inherited_listen_fd = -1; // prefork: opened by the supervisor
 
 void request_shutdown()
 {
@@ -26,19 +48,125 @@ void request_shutdown()
     }
 }
 
-void start_server(const string &address, int port, int thread_pool_size)
+void request_reload()
+{
+    reload_requested.store(true);
+}
+
+void request_upgrade()
+{
+    upgrade_requested.store(true);
+}
+
+static AutoscaleSettings autoscale_settings(const RuntimeConfig &cfg)
+{
+    AutoscaleSettings settings;
+    settings.enabled = cfg.autoscale;
+    settings.min_size = cfg.min_threads > 0 ? cfg.min_threads : 1;
+    settings.max_size = cfg.max_threads > 0 ? cfg.max_threads : 1;
+    settings.target_wait_ms = cfg.autoscale_target_wait_ms;
+    return settings;
+}
+
+static FairnessSettings fairness_settings(const RuntimeConfig &cfg)
+{
+    FairnessSettings settings;
+    settings.max_active_per_client =
+        cfg.max_connections_per_client > 0 ? cfg.max_connections_per_client : 0;
+    settings.quantum_ms = cfg.fair_quantum_ms;
+    return settings;
+}
+
+// Listening address and port are not reloadable; everything read per
+// request is republished and the pool is resized in place.
+static void reload_runtime_config(ThreadPool &pool)
+{
+    RuntimeConfig cfg;
+    if (!reload_config(cfg))
+    {
+        log_event("CONFIG RELOAD FAILED");
+        return;
+    }
+
+    // Rules are recompiled off to the side; a failed load keeps the old set
+    if (!load_blocklist(cfg.blocklist_file))
+    {
+        log_event("CONFIG RELOAD FAILED | blocklist");
+        return;
+    }
+
+    // Pools are swapped before requests are routed to them
+    if (cfg.reverse_proxy && !load_upstreams(cfg.upstreams_file))
+    {
+        log_event("CONFIG RELOAD FAILED | upstreams");
+        return;
+    }
+
+    publish_runtime_config(cfg);
+    set_log_max_size(cfg.max_log_size);
+    init_tracing(cfg.trace_sample_rate,
+                 cfg.trace_buffer_spans,
+                 cfg.trace_file);
+
+    pool.set_autoscale(autoscale_settings(cfg));
+    pool.set_fairness(fairness_settings(cfg));
+    pool.resize(cfg.thread_pool_size);
+    drain_timeout.store(cfg.drain_timeout);
+
+    log_event("CONFIG RELOAD | threads=" + to_string(cfg.thread_pool_size) +
+              " | buffer_size=" + to_string(cfg.buffer_size) +
+              " | socket_timeout=" + to_string(cfg.socket_timeout) +
+              " | autoscale=" + (cfg.autoscale ? "on" : "off"));
+
+    cout << "[INFO] Configuration reloaded" << endl;
+}
+
+// Let in-flight connections finish, then close whatever is left once
+// drain_timeout passes so shutdown and upgrades are bounded
+static void drain(ThreadPool &pool)
+{
+    auto deadline = chrono::steady_clock::now() +
+                    chrono::seconds(max(0, drain_timeout.load()));
+
+    while (pool.pending() > 0 && chrono::steady_clock::now() < deadline)
+    {
+        flush_access_log_if_stale();
+        publish_process_metrics();
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+
+    size_t remaining = pool.pending();
+    if (remaining > 0)
+    {
+        size_t closed = timeouts_shutdown_all();
+        log_event("DRAIN TIMEOUT | pending=" + to_string(remaining) +
+                  " | closed=" + to_string(closed));
+    }
+}
+
+static bool open_listener(const string &address, int port, bool reuseport)
 {
-    shutdown_requested.store(false);
     listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0)
     {
         perror("socket");
-        return;
+        return false;
     }
 
     int opt = 1;
     setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
+    // Each prefork worker binds its own socket and the kernel spreads
+    // incoming connections across them
+    if (reuseport &&
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        perror("setsockopt(SO_REUSEPORT)");
+    tune_listen_socket(listen_fd);
+
+    // Another process may accept the connection poll reported (during a
+    // hot upgrade both share this socket), so accept must not block
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = inet_addr(address.c_str());
@@ -49,7 +177,7 @@ void start_server(const string &address, int port, int thread_pool_size)
         perror("bind");
         close(listen_fd);
         listen_fd = -1;
-        return;
+        return false;
     }
 
     if (listen(listen_fd, SOMAXCONN) < 0)
@@ -57,19 +185,122 @@ void start_server(const string &address, int port, int thread_pool_size)
         perror("listen");
         close(listen_fd);
         listen_fd = -1;
-        return;
+        return false;
     }
 
-    ThreadPool pool(thread_pool_size);
+    return true;
+}
+
+int open_listen_socket(const RuntimeConfig &cfg)
+{
+    if (!open_listener(cfg.listen_address, cfg.listen_port, false))
+        return -1;
+
+    int fd = listen_fd;
+    listen_fd = -1;
+    return fd;
+}
+
+void set_inherited_listener(int fd)
+{
+    inherited_listen_fd = fd;
+}
+
+void start_server(const RuntimeConfig &cfg)
+{
+    const string &address = cfg.listen_address;
+    int port = cfg.listen_port;
+
+    shutdown_requested.store(false);
+    drain_timeout.store(cfg.drain_timeout);
+
+    listen_fd = inherited_listen_fd;
+    inherited_listen_fd = -1;
+    if (listen_fd < 0)
+    {
+        listen_fd = upgrade_inherited_listener();
+        if (listen_fd >= 0)
+            cout << "[INFO] Took over listening socket from previous process"
+                 << endl;
+        else if (!open_listener(address, port,
+                                cfg.worker_processes > 0 && cfg.reuseport))
+            return;
+    }
+
+    ThreadPool pool(cfg.thread_pool_size);
+    pool.set_autoscale(autoscale_settings(cfg));
+    pool.set_fairness(fairness_settings(cfg));
 
     cout << "[INFO] Server listening on "
          << address << ":" << port << endl;
 
+    trace_name_thread("acceptor");
+    upgrade_notify_ready();
+
+    int upgrade_fd = -1;
+    bool handed_off = false;
+
     while (!shutdown_requested.load())
     {
+        if (trace_dump_pending())
+            dump_traces();
+
+        if (reload_requested.exchange(false))
+            reload_runtime_config(pool);
+
+        // Runs at least every poll timeout, idle or not
+        evict_idle_rate_limits();
+        flush_access_log_if_stale();
+        publish_process_metrics();
+
+        if (upgrade_requested.exchange(false) && upgrade_fd < 0)
+        {
+            upgrade_fd = upgrade_start(listen_fd);
+            log_event(upgrade_fd >= 0 ? "UPGRADE STARTED"
+                                      : "UPGRADE FAILED | could not start new binary");
+        }
+
+        // Wake up periodically so signal-driven requests are serviced.
+        // While an upgrade is pending, keep accepting until the new
+        // process reports on the handoff channel.
+        pollfd pfds[2] = {};
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = upgrade_fd;
+        pfds[1].events = POLLIN;
+
+        int ready = poll(pfds, upgrade_fd >= 0 ? 2 : 1, 500);
+        if (ready <= 0)
+        {
+            if (ready < 0 && errno != EINTR && !shutdown_requested.load())
+                perror("poll");
+            continue;
+        }
+
+        if (upgrade_fd >= 0 && pfds[1].revents)
+        {
+            handed_off = upgrade_finish(upgrade_fd);
+            upgrade_fd = -1;
+
+            if (handed_off)
+            {
+                log_event("UPGRADE | new process accepting, draining");
+                cout << "[INFO] New process is accepting; draining" << endl;
+                break;
+            }
+
+            log_event("UPGRADE FAILED | new process exited before ready");
+            cerr << "[ERROR] Upgrade failed; continuing to serve" << endl;
+            continue;
+        }
+
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+
         sockaddr_in client{};
         socklen_t len = sizeof(client);
 
+        uint64_t accept_start = trace_now_us();
         int client_fd = accept(listen_fd,
                                (sockaddr *)&client,
                                &len);
@@ -81,20 +312,46 @@ void start_server(const string &address, int port, int thread_pool_size)
             continue;  // transient error
         }
 
+        // Over the memory budget: refuse now rather than queue the work
+        if (!memory_admit_connection())
+        {
+            static const char unavailable[] =
+                "HTTP/1.0 503 Service Unavailable\r\n"
+                "Retry-After: 1\r\n"
+                "Content-Length: 0\r\n\r\n";
+            send(client_fd, unavailable, sizeof(unavailable) - 1,
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(client_fd);
+            log_event(string("MEMORY REJECT | ") + inet_ntoa(client.sin_addr));
+            continue;
+        }
+
         Task task;
         task.client_fd = client_fd;
         task.client_ip = inet_ntoa(client.sin_addr);
         task.client_port = ntohs(client.sin_port);
+        task.trace_id = trace_sample();
+        task.incoming_cpu = incoming_cpu(client_fd);
+
+        trace_record(task.trace_id, "accept", accept_start, trace_now_us());
 
         pool.enqueue(task);
     }
 
-    log_event("==================================================");
-    log_event("SERVER STOP");
-    log_event("==================================================");
-
+    // Stop accepting; the new process (if any) keeps its own copy
     if (listen_fd != -1)
+    {
         close(listen_fd);
+        listen_fd = -1;
+    }
+    if (upgrade_fd >= 0)
+        upgrade_abort(upgrade_fd);
+
+    drain(pool);
+
+    log_event("==================================================");
+    log_event(handed_off ? "SERVER STOP (upgraded)" : "SERVER STOP");
+    log_event("==================================================");
 
     cout << "[INFO] Server shutdown complete" << endl;
 }
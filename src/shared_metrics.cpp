@@ -0,0 +1,244 @@
+#include "shared_metrics.h"
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+using namespace std;
+
+enum
+{
+    ENTRY_EMPTY,
+    ENTRY_CLAIMING,
+    ENTRY_READY
+};
+
+// Probes before a name is given up as not fitting
+static const size_t MAX_PROBES = 32;
+
+const char *metric_counter_name(int counter)
+{
+    switch (counter)
+    {
+    case M_TOTAL_REQUESTS:
+        return "total_requests";
+    case M_ALLOWED_REQUESTS:
+        return "allowed_requests";
+    case M_BLOCKED_REQUESTS:
+        return "blocked_requests";
+    case M_BYTES_TRANSFERRED:
+        return "bytes_transferred";
+    case M_RATE_LIMITED_REQUESTS:
+        return "rate_limited_requests";
+    case M_THROTTLED_BYTES:
+        return "throttled_bytes";
+    case M_THROTTLE_DELAY_MS:
+        return "throttle_delay_ms";
+    case M_HEADER_TIMEOUTS:
+        return "header_timeouts";
+    case M_IDLE_TIMEOUTS:
+        return "idle_timeouts";
+    case M_LIFETIME_TIMEOUTS:
+        return "lifetime_timeouts";
+    case M_COMPRESSED_RESPONSES:
+        return "compressed_responses";
+    case M_COMPRESSION_BYTES_IN:
+        return "compression_bytes_in";
+    case M_COMPRESSION_BYTES_OUT:
+        return "compression_bytes_out";
+    case M_COMPRESSION_CPU_US:
+        return "compression_cpu_us";
+    case M_UPSTREAM_UNAVAILABLE:
+        return "upstream_unavailable";
+    case M_OUTLIER_EJECTIONS:
+        return "outlier_ejections";
+    case M_HTTP2_CONNECTIONS:
+        return "http2_connections";
+    case M_HTTP2_STREAMS:
+        return "http2_streams";
+    case M_HTTP2_REFUSED_STREAMS:
+        return "http2_refused_streams";
+    default:
+        return "unknown";
+    }
+}
+
+SharedMetricsSlot *create_shared_metrics(size_t count)
+{
+    size_t bytes = count * sizeof(SharedMetricsSlot);
+    void *region = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        cerr << "[ERROR] Cannot map shared metrics region" << endl;
+        return nullptr;
+    }
+
+    // Anonymous pages are zero-filled, which is every atomic's initial
+    // value; construct them anyway so the objects formally exist
+    SharedMetricsSlot *slots = static_cast<SharedMetricsSlot *>(region);
+    for (size_t i = 0; i < count; ++i)
+        new (&slots[i]) SharedMetricsSlot();
+    return slots;
+}
+
+void destroy_shared_metrics(SharedMetricsSlot *slots, size_t count)
+{
+    if (slots)
+        munmap(slots, count * sizeof(SharedMetricsSlot));
+}
+
+static uint64_t hash_name(const string &name)
+{
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (unsigned char c : name)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// A claim in progress is skipped rather than waited for, since its
+// owner may have died; the same name can then land in two entries and
+// collect_shared_metrics() adds them back together
+static void count_name(SharedNameCount *table, size_t size,
+                       atomic<uint64_t> &dropped, const string &full_name)
+{
+    string name = full_name.substr(0, SHARED_NAME_LEN - 1);
+    uint64_t h = hash_name(name);
+
+    for (size_t probe = 0; probe < MAX_PROBES; ++probe)
+    {
+        SharedNameCount &entry = table[(h + probe) % size];
+        uint32_t state = entry.state.load(memory_order_acquire);
+
+        if (state == ENTRY_EMPTY)
+        {
+            if (entry.state.compare_exchange_strong(state, ENTRY_CLAIMING,
+                                                    memory_order_acquire))
+            {
+                memcpy(entry.name, name.c_str(), name.size() + 1);
+                entry.count.store(1, memory_order_relaxed);
+                entry.state.store(ENTRY_READY, memory_order_release);
+                return;
+            }
+            // Lost the race; state now holds what the winner set
+        }
+
+        if (state == ENTRY_READY && name == entry.name)
+        {
+            entry.count.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    dropped.fetch_add(1, memory_order_relaxed);
+}
+
+void shared_count_host(SharedMetricsSlot &slot, const string &host)
+{
+    count_name(slot.hosts, SHARED_HOST_ENTRIES, slot.dropped_names, host);
+}
+
+void shared_count_rule(SharedMetricsSlot &slot, const string &rule)
+{
+    count_name(slot.rules, SHARED_RULE_ENTRIES, slot.dropped_names, rule);
+}
+
+// The worker's accept thread is the only writer while it lives
+static void store_max(atomic<uint64_t> &target, uint64_t value)
+{
+    if (value > target.load(memory_order_relaxed))
+        target.store(value, memory_order_relaxed);
+}
+
+void shared_store_memory(SharedMetricsSlot &slot, const MemorySnapshot &mem)
+{
+    SharedMemoryGauges &g = slot.memory;
+    g.budget.store(mem.budget, memory_order_relaxed);
+    g.used.store(mem.used, memory_order_relaxed);
+    store_max(g.peak, mem.peak);
+    for (int i = 0; i < MEM_POOL_COUNT; ++i)
+        g.pools[i].store(mem.pools[i], memory_order_relaxed);
+    store_max(g.connection_peak_max, mem.connection_peak_max);
+    g.connection_peak_avg.store(mem.connection_peak_avg, memory_order_relaxed);
+    g.rejected_connections.store(mem.rejected_connections, memory_order_relaxed);
+    g.paused_reads.store(mem.paused_reads, memory_order_relaxed);
+}
+
+void shared_retire_process(SharedMetricsSlot &slot)
+{
+    SharedMemoryGauges &g = slot.memory;
+    g.carried_rejected.fetch_add(g.rejected_connections.exchange(0));
+    g.carried_paused.fetch_add(g.paused_reads.exchange(0));
+    g.used.store(0);
+    for (int i = 0; i < MEM_POOL_COUNT; ++i)
+        g.pools[i].store(0);
+    slot.pid.store(0);
+}
+
+static void collect_names(const SharedNameCount *table, size_t size,
+                          unordered_map<string, uint64_t> &out)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (table[i].state.load(memory_order_acquire) != ENTRY_READY)
+            continue;
+        out[table[i].name] += table[i].count.load(memory_order_relaxed);
+    }
+}
+
+void collect_shared_metrics(const SharedMetricsSlot *slots, size_t count,
+                            SharedMetricsTotals &totals)
+{
+    memset(totals.counters, 0, sizeof(totals.counters));
+    totals.hosts.clear();
+    totals.rules.clear();
+    totals.dropped_names = 0;
+    totals.memory = MemorySnapshot{};
+
+    uint64_t avg_sum = 0;
+    size_t avg_count = 0;
+
+    for (size_t s = 0; s < count; ++s)
+    {
+        const SharedMetricsSlot &slot = slots[s];
+
+        for (int i = 0; i < METRIC_COUNT; ++i)
+            totals.counters[i] += slot.counters[i].load(memory_order_relaxed);
+
+        collect_names(slot.hosts, SHARED_HOST_ENTRIES, totals.hosts);
+        collect_names(slot.rules, SHARED_RULE_ENTRIES, totals.rules);
+        totals.dropped_names += slot.dropped_names.load(memory_order_relaxed);
+
+        // Budgets are per process, so usage and budget add up; the
+        // summed peak is an upper bound as processes peak at different times
+        const SharedMemoryGauges &g = slot.memory;
+        MemorySnapshot &mem = totals.memory;
+        mem.budget += g.budget.load(memory_order_relaxed);
+        mem.used += g.used.load(memory_order_relaxed);
+        mem.peak += g.peak.load(memory_order_relaxed);
+        for (int i = 0; i < MEM_POOL_COUNT; ++i)
+            mem.pools[i] += g.pools[i].load(memory_order_relaxed);
+        mem.connection_peak_max =
+            max<size_t>(mem.connection_peak_max,
+                        g.connection_peak_max.load(memory_order_relaxed));
+        mem.rejected_connections +=
+            g.rejected_connections.load(memory_order_relaxed) +
+            g.carried_rejected.load(memory_order_relaxed);
+        mem.paused_reads += g.paused_reads.load(memory_order_relaxed) +
+                            g.carried_paused.load(memory_order_relaxed);
+
+        uint64_t avg = g.connection_peak_avg.load(memory_order_relaxed);
+        if (avg > 0)
+        {
+            avg_sum += avg;
+            ++avg_count;
+        }
+    }
+
+    totals.memory.connection_peak_avg = avg_count ? avg_sum / avg_count : 0;
+}
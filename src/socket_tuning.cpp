@@ -0,0 +1,201 @@
+#include "socket_tuning.h"
+#include "memory_budget.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+extern atomic<size_t> g_buffer_size;
+extern atomic<size_t> g_max_buffer_size;
+extern atomic<bool> g_adaptive_buffers;
+
+static atomic<bool> tcp_nodelay(false);
+static atomic<int> so_sndbuf(0);
+static atomic<int> so_rcvbuf(0);
+static atomic<int> tcp_notsent_lowat(0);
+static atomic<bool> tcp_quickack(false);
+static atomic<int> tcp_fastopen(0);
+
+// Grow after this many consecutive full reads
+static const int GROW_AFTER = 2;
+// Shrink after this many consecutive reads under a quarter of the buffer
+static const int SHRINK_AFTER = 8;
+// A gap this long between reads counts as idle
+static const uint64_t IDLE_MS = 1000;
+
+// Minimum-size buffers released by a worker's connections are reused by
+// its next connection. They stay cache-warm, and with pinned workers they
+// stay on the NUMA node where the worker first touched them.
+static const size_t MAX_SPARE_BUFFERS = 2;
+static thread_local vector<vector<char>> spare_buffers;
+static thread_local MemoryCharge spare_memory(MEM_RELAY_BUFFERS);
+
+static void account_spares()
+{
+    size_t bytes = 0;
+    for (const auto &b : spare_buffers)
+        bytes += b.size();
+    spare_memory.resize(bytes);
+}
+
+void set_socket_tuning(const SocketTuning &tuning)
+{
+    tcp_nodelay.store(tuning.tcp_nodelay);
+    so_sndbuf.store(tuning.so_sndbuf);
+    so_rcvbuf.store(tuning.so_rcvbuf);
+    tcp_notsent_lowat.store(tuning.tcp_notsent_lowat);
+    tcp_quickack.store(tuning.tcp_quickack);
+    tcp_fastopen.store(tuning.tcp_fastopen);
+}
+
+static void set_int_option(int fd, int level, int name, int value)
+{
+    setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+static void apply_common(int fd)
+{
+    if (tcp_nodelay.load())
+        set_int_option(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+
+    if (so_sndbuf.load() > 0)
+        set_int_option(fd, SOL_SOCKET, SO_SNDBUF, so_sndbuf.load());
+
+    if (so_rcvbuf.load() > 0)
+        set_int_option(fd, SOL_SOCKET, SO_RCVBUF, so_rcvbuf.load());
+
+#ifdef TCP_NOTSENT_LOWAT
+    if (tcp_notsent_lowat.load() > 0)
+        set_int_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                       tcp_notsent_lowat.load());
+#endif
+
+    rearm_quickack(fd);
+}
+
+void tune_listen_socket(int fd)
+{
+#ifdef TCP_FASTOPEN
+    if (tcp_fastopen.load() > 0)
+        set_int_option(fd, IPPROTO_TCP, TCP_FASTOPEN, tcp_fastopen.load());
+#endif
+
+    // Accepted sockets inherit buffer sizes from the listener
+    if (so_sndbuf.load() > 0)
+        set_int_option(fd, SOL_SOCKET, SO_SNDBUF, so_sndbuf.load());
+    if (so_rcvbuf.load() > 0)
+        set_int_option(fd, SOL_SOCKET, SO_RCVBUF, so_rcvbuf.load());
+}
+
+void tune_client_socket(int fd)
+{
+    apply_common(fd);
+}
+
+void tune_upstream_socket(int fd)
+{
+    apply_common(fd);
+
+#ifdef TCP_FASTOPEN_CONNECT
+    if (tcp_fastopen.load() > 0)
+        set_int_option(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+#endif
+}
+
+void rearm_quickack(int fd)
+{
+#ifdef TCP_QUICKACK
+    if (tcp_quickack.load())
+        set_int_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+#else
+    (void)fd;
+#endif
+}
+
+static uint64_t now_ms()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+RelayBuffer::RelayBuffer()
+    : min_size(max<size_t>(512, g_buffer_size.load())),
+      max_size(max(min_size, g_max_buffer_size.load())),
+      adaptive(g_adaptive_buffers.load()),
+      memory(MEM_RELAY_BUFFERS)
+{
+    if (!spare_buffers.empty() && spare_buffers.back().size() == min_size)
+    {
+        buffer.swap(spare_buffers.back());
+        spare_buffers.pop_back();
+    }
+    else
+    {
+        spare_buffers.clear(); // buffer_size changed
+        buffer.resize(min_size);
+    }
+    account_spares();
+    memory.resize(buffer.size());
+}
+
+RelayBuffer::~RelayBuffer()
+{
+    if (buffer.size() == min_size && spare_buffers.size() < MAX_SPARE_BUFFERS &&
+        !memory_under_pressure())
+    {
+        spare_buffers.push_back(move(buffer));
+        account_spares();
+    }
+}
+
+void RelayBuffer::resize(size_t new_size)
+{
+    // Swap rather than resize so shrinking actually releases memory
+    vector<char>(new_size).swap(buffer);
+    memory.resize(new_size);
+    full_reads = 0;
+    short_reads = 0;
+}
+
+void RelayBuffer::record_read(size_t bytes)
+{
+    if (!adaptive)
+        return;
+
+    uint64_t now = now_ms();
+    bool was_idle = last_read_ms != 0 && now - last_read_ms > IDLE_MS;
+    last_read_ms = now;
+
+    // Over the memory threshold buffers drop to their minimum and stay there
+    bool pressure = memory_under_pressure();
+
+    if ((was_idle || pressure) && buffer.size() > min_size)
+    {
+        resize(min_size);
+        return;
+    }
+
+    if (bytes == buffer.size())
+    {
+        short_reads = 0;
+        if (++full_reads >= GROW_AFTER && buffer.size() < max_size && !pressure)
+            resize(min(buffer.size() * 2, max_size));
+    }
+    else if (bytes < buffer.size() / 4)
+    {
+        full_reads = 0;
+        if (++short_reads >= SHRINK_AFTER && buffer.size() > min_size)
+            resize(max(buffer.size() / 2, min_size));
+    }
+    else
+    {
+        full_reads = 0;
+        short_reads = 0;
+    }
+}
@@ -1,45 +1,460 @@
 #include "thread_pool.h"
 #include "client_handler.h"
+#include "logger.h"
+#include "trace.h"
+#include "metrics.h"
+#include "cpu_affinity.h"
+#include "memory_budget.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+
+static thread_local ThreadPool *current_pool = nullptr;
+
+// Set while this worker's task multiplexes HTTP/2 streams
+static thread_local bool task_multiplexed = false;
+
+// How long a client's scheduling state outlives its last task
+static const int CLIENT_IDLE_SEC = 60;
 
 ThreadPool::ThreadPool(size_t size) : stop(false)
 {
-    for (size_t i = 0; i < size; ++i)
     {
-        workers.emplace_back(&ThreadPool::worker, this);
+        unique_lock<mutex> lock(queue_mutex);
+        target_size = max<size_t>(1, size);
+        while (live_workers < target_size)
+            spawn_worker_locked();
     }
+
+    monitor_thread = thread(&ThreadPool::monitor, this);
+}
+
+// Takes the lowest index not held by a live or unreaped worker, so
+// indexes (CPU placement, worker_N metrics) stay within the largest
+// pool size however often autoscaling replaces workers
+void ThreadPool::spawn_worker_locked()
+{
+    size_t index = 0;
+    while (workers.count(index))
+        ++index;
+
+    ++live_workers;
+    workers.emplace(index, thread(&ThreadPool::worker, this, index));
 }
 
-void ThreadPool::worker()
+void ThreadPool::worker(size_t index)
 {
+    trace_name_thread("worker-" + to_string(index));
+    current_pool = this;
+
     while (true)
     {
         Task task;
+        int cpu = apply_worker_affinity(index);
 
         {
             unique_lock<mutex> lock(queue_mutex);
+            // On stop, stay until busy workers finish too: a running
+            // HTTP/2 session may still enqueue its streams
             condition.wait(lock, [this]
-                           { return stop || !tasks.empty(); });
+                           { return (stop && queued_tasks == 0 && busy_workers == 0) ||
+                                    dispatchable_locked() ||
+                                    (!stop && live_workers > wanted_workers_locked()); });
+
+            if (stop && queued_tasks == 0 && busy_workers == 0)
+                return;
 
-            if (stop && tasks.empty())
+            if (!stop && live_workers > wanted_workers_locked())
+            {
+                // Pool shrank: retire this worker
+                --live_workers;
+                exited.push_back(index);
                 return;
+            }
 
-            task = tasks.front();
-            tasks.pop();
+            if (!pick_task_locked(task, cpu))
+                continue;
+
+            uint64_t now = trace_now_us();
+            wait_sum_us += now - min(now, task.enqueue_us);
+            ++wait_count;
+            ++busy_workers;
         }
 
-        handle_client(task);
+        trace_record(task.trace_id, "queue_wait",
+                     task.enqueue_us, trace_now_us());
+
+        task_multiplexed = false;
+        uint64_t start_us = trace_now_us();
+        size_t bytes = handle_client(task);
+        uint64_t service_us = trace_now_us() - start_us;
+
+        if (task.on_done)
+            task.on_done(bytes);
+
+        // A session's bytes are counted by the tasks of its streams
+        record_worker(index, cpu, task_multiplexed ? 0 : bytes, service_us,
+                      cpu >= 0 && task.incoming_cpu == cpu);
+        finish_task(task.client_ip, service_us, task_multiplexed);
+    }
+}
+
+bool ThreadPool::dispatchable_locked()
+{
+    if (queued_tasks == 0)
+        return false;
+    if (fairness.max_active_per_client == 0)
+        return true;
+
+    for (const string &ip : ring)
+    {
+        if (clients[ip].active < fairness.max_active_per_client)
+            return true;
+    }
+    return false;
+}
+
+// Memory a queued connection holds until a worker takes it
+static size_t queued_bytes(const Task &task)
+{
+    return sizeof(Task) + task.client_ip.size();
+}
+
+void ThreadPool::take_task_locked(size_t ring_pos, Task &task)
+{
+    string ip = ring[ring_pos];
+    ring.erase(ring.begin() + ring_pos);
+
+    ClientQueue &cq = clients[ip];
+    task = cq.tasks.front();
+    cq.tasks.pop();
+    cq.deficit -= cq.cost_ms;
+    ++cq.active;
+    --queued_tasks;
+    memory_release(MEM_QUEUE, queued_bytes(task));
+
+    if (cq.tasks.empty())
+    {
+        cq.in_ring = false;
+        cq.deficit = 0;
+    }
+    else
+    {
+        ring.push_back(ip); // next client gets the following turn
+    }
+}
+
+// Deficit round robin keyed by client IP. A task costs its client's
+// average service time, so a client holding long tunnels is charged more
+// per connection than one making quick requests. Clients at their
+// concurrency cap are skipped until one of their tasks finishes. Rather
+// than looping over empty rounds, the credit for the rounds needed by the
+// nearest eligible client is added in one step. Among clients that may
+// go now, a pinned worker prefers one whose connection arrived on its CPU.
+bool ThreadPool::pick_task_locked(Task &task, int cpu)
+{
+    size_t cap = fairness.max_active_per_client;
+    double quantum = max(0.001, fairness.quantum_ms);
+
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        double rounds_needed = -1;
+        long first_ready = -1;
+
+        for (size_t i = 0; i < ring.size(); ++i)
+        {
+            ClientQueue &cq = clients[ring[i]];
+            if (cap > 0 && cq.active >= cap)
+                continue;
+
+            if (cq.deficit >= cq.cost_ms)
+            {
+                if (cpu < 0 || cq.tasks.front().incoming_cpu == cpu)
+                {
+                    take_task_locked(i, task);
+                    return true;
+                }
+                if (first_ready < 0)
+                    first_ready = i;
+                continue;
+            }
+
+            double rounds = ceil((cq.cost_ms - cq.deficit) / quantum);
+            if (rounds_needed < 0 || rounds < rounds_needed)
+                rounds_needed = rounds;
+        }
+
+        if (first_ready >= 0)
+        {
+            take_task_locked(first_ready, task);
+            return true;
+        }
+
+        if (rounds_needed < 0)
+            return false; // every queued client is at its cap
+
+        for (const string &ip : ring)
+        {
+            ClientQueue &cq = clients[ip];
+            if (cap == 0 || cq.active < cap)
+                cq.deficit += rounds_needed * quantum;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::finish_task(const string &client_ip, uint64_t service_us,
+                             bool multiplexed)
+{
+    bool stopping;
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        --busy_workers;
+        stopping = stop;
+
+        auto it = clients.find(client_ip);
+        if (it != clients.end())
+        {
+            ClientQueue &cq = it->second;
+
+            // begin_multiplexing() already released the client's slot
+            if (!multiplexed)
+            {
+                --cq.active;
+
+                double ms = max(1.0, service_us / 1000.0);
+                cq.cost_ms = 0.8 * cq.cost_ms + 0.2 * ms;
+            }
+
+            if (cq.active == 0 && cq.tasks.empty())
+                cq.idle_since = chrono::steady_clock::now();
+        }
+    }
+
+    // A capped client may have become eligible again; on stop, idle
+    // workers wait for the last busy one
+    if (stopping)
+        condition.notify_all();
+    else
+        condition.notify_one();
+}
+
+ThreadPool *ThreadPool::current()
+{
+    return current_pool;
+}
+
+void ThreadPool::begin_multiplexing(const string &client_ip)
+{
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        if (task_multiplexed)
+            return;
+        task_multiplexed = true;
+
+        auto it = clients.find(client_ip);
+        if (it != clients.end() && it->second.active > 0)
+            --it->second.active;
+
+        ++multiplexing;
+        while (!stop && live_workers < wanted_workers_locked())
+            spawn_worker_locked();
+    }
+    condition.notify_all();
+}
+
+void ThreadPool::end_multiplexing()
+{
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        if (multiplexing > 0)
+            --multiplexing;
     }
+    // The stand-in worker retires once idle
+    condition.notify_all();
 }
 
 void ThreadPool::enqueue(Task task)
 {
     {
         unique_lock<mutex> lock(queue_mutex);
-        tasks.push(task);
+        task.enqueue_us = trace_now_us();
+
+        ClientQueue &cq = clients[task.client_ip];
+        cq.tasks.push(task);
+        ++queued_tasks;
+        memory_charge(MEM_QUEUE, queued_bytes(task));
+
+        if (!cq.in_ring)
+        {
+            cq.in_ring = true;
+            ring.push_back(task.client_ip);
+        }
     }
     condition.notify_one();
 }
 
+void ThreadPool::resize(size_t size)
+{
+    size = max<size_t>(1, size);
+    size_t previous;
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        previous = target_size;
+        target_size = size;
+        while (live_workers < wanted_workers_locked())
+            spawn_worker_locked();
+    }
+    condition.notify_all();
+
+    if (previous != size)
+        log_event("THREAD POOL RESIZE | " + to_string(previous) +
+                  " -> " + to_string(size));
+
+    reap_workers();
+}
+
+size_t ThreadPool::size()
+{
+    unique_lock<mutex> lock(queue_mutex);
+    return target_size;
+}
+
+size_t ThreadPool::pending()
+{
+    unique_lock<mutex> lock(queue_mutex);
+    return queued_tasks + busy_workers;
+}
+
+void ThreadPool::set_fairness(const FairnessSettings &settings)
+{
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        fairness = settings;
+    }
+    condition.notify_all();
+}
+
+void ThreadPool::set_autoscale(const AutoscaleSettings &settings)
+{
+    unique_lock<mutex> lock(queue_mutex);
+    autoscale = settings;
+    autoscale.min_size = max<size_t>(1, autoscale.min_size);
+    autoscale.max_size = max(autoscale.min_size, autoscale.max_size);
+}
+
+// Join workers that retired after a shrink
+void ThreadPool::reap_workers()
+{
+    vector<thread> finished;
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        for (size_t index : exited)
+        {
+            auto it = workers.find(index);
+            if (it == workers.end())
+                continue;
+            finished.push_back(move(it->second));
+            workers.erase(it);
+        }
+        exited.clear();
+    }
+
+    for (thread &t : finished)
+        t.join();
+}
+
+// Sizes the pool from the queue wait and utilization seen since the
+// previous sample: grow quickly while tasks are waiting, shrink one
+// worker at a time once the pool is mostly idle.
+void ThreadPool::autoscale_step()
+{
+    size_t current;
+    size_t wanted;
+    double avg_wait_ms;
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        if (!autoscale.enabled)
+            return;
+
+        double instant = live_workers > 0
+                             ? static_cast<double>(busy_workers) / live_workers
+                             : 0.0;
+        utilization = 0.7 * utilization + 0.3 * instant;
+
+        avg_wait_ms = wait_count > 0
+                          ? wait_sum_us / 1000.0 / wait_count
+                          : 0.0;
+        // Tasks still queued count as waiting too
+        uint64_t now = trace_now_us();
+        for (const string &ip : ring)
+        {
+            const Task &head = clients[ip].tasks.front();
+            uint64_t oldest = now - min(now, head.enqueue_us);
+            avg_wait_ms = max(avg_wait_ms, oldest / 1000.0);
+        }
+        wait_sum_us = 0;
+        wait_count = 0;
+
+        current = target_size;
+        wanted = current;
+
+        if (avg_wait_ms > autoscale.target_wait_ms)
+            wanted = current + max<size_t>(1, current / 4);
+        else if (utilization < 0.5 && avg_wait_ms < autoscale.target_wait_ms / 4.0)
+            wanted = current - 1;
+
+        wanted = min(max(wanted, autoscale.min_size), autoscale.max_size);
+    }
+
+    if (wanted != current)
+    {
+        log_event("AUTOSCALE | wait_ms=" + to_string(avg_wait_ms) +
+                  " | utilization=" + to_string(utilization));
+        resize(wanted);
+    }
+}
+
+// Drops clients idle for CLIENT_IDLE_SEC. Until then a returning client
+// keeps its cost, so one that holds long tunnels cannot reset its charge
+// by letting its queue drain between bursts.
+void ThreadPool::evict_idle_clients()
+{
+    unique_lock<mutex> lock(queue_mutex);
+    auto cutoff = chrono::steady_clock::now() - chrono::seconds(CLIENT_IDLE_SEC);
+
+    for (auto it = clients.begin(); it != clients.end();)
+    {
+        const ClientQueue &cq = it->second;
+        if (cq.active == 0 && cq.tasks.empty() && cq.idle_since < cutoff)
+            it = clients.erase(it);
+        else
+            ++it;
+    }
+}
+
+void ThreadPool::monitor()
+{
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            monitor_condition.wait_for(lock, chrono::seconds(1),
+                                       [this]
+                                       { return stop; });
+            if (stop)
+                return;
+        }
+
+        autoscale_step();
+        reap_workers();
+        evict_idle_clients();
+    }
+}
+
 ThreadPool::~ThreadPool()
 {
     {
@@ -47,7 +462,10 @@ ThreadPool::~ThreadPool()
         stop = true;
     }
     condition.notify_all();
+    monitor_condition.notify_all();
+
+    monitor_thread.join();
 
-    for (thread &worker : workers)
-        worker.join();
+    for (auto &entry : workers)
+        entry.second.join();
 }
@@ -0,0 +1,257 @@
+#include "timeouts.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+using namespace std;
+
+enum TimeoutKind
+{
+    TIMEOUT_HEADER,
+    TIMEOUT_IDLE,
+    TIMEOUT_LIFETIME
+};
+
+// Wheel resolution
+static const int TICK_MS = 100;
+static const uint64_t TICKS_PER_SEC = 1000 / TICK_MS;
+
+struct ConnectionTimers
+{
+    int client_fd = -1;
+    int server_fd = -1;
+
+    TimerNode header;
+    TimerNode idle;
+    TimerNode lifetime;
+
+    atomic<uint64_t> last_activity{0}; // tick
+    bool expired = false;
+};
+
+static mutex timer_mutex;
+static unique_ptr<TimerWheel> wheel;
+static thread timer_thread;
+static condition_variable timer_condition;
+static bool running = false;
+
+// Connections currently being served, for forced shutdown
+static unordered_set<ConnectionTimers *> active_connections;
+
+// Coarse clock published by the timer thread, so touching a connection
+// is a relaxed load and store
+static atomic<uint64_t> current_tick(0);
+
+static atomic<int> header_timeout(10);
+static atomic<int> idle_timeout(300);
+static atomic<int> max_lifetime(3600);
+
+// A worker serves one connection at a time, so its timer state is reused
+static thread_local ConnectionTimers conn;
+static thread_local bool conn_active = false;
+
+static uint64_t clock_tick()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+               .count() /
+           TICK_MS;
+}
+
+// Caller holds timer_mutex
+static void shutdown_connection(ConnectionTimers *c)
+{
+    if (c->client_fd >= 0)
+        shutdown(c->client_fd, SHUT_RDWR);
+    if (c->server_fd >= 0)
+        shutdown(c->server_fd, SHUT_RDWR);
+}
+
+// Caller holds timer_mutex. Returns false if the timer was re-armed.
+static bool fire(TimerNode *node)
+{
+    ConnectionTimers *c = static_cast<ConnectionTimers *>(node->owner);
+
+    if (node->kind == TIMEOUT_IDLE)
+    {
+        // Activity only updates a timestamp; re-arm lazily from it here
+        uint64_t due = c->last_activity.load(memory_order_relaxed) +
+                       idle_timeout.load() * TICKS_PER_SEC;
+        if (due > wheel->now())
+        {
+            wheel->insert(node, due);
+            return false;
+        }
+    }
+
+    wheel->cancel(&c->header);
+    wheel->cancel(&c->idle);
+    wheel->cancel(&c->lifetime);
+    c->expired = true;
+    shutdown_connection(c);
+    return true;
+}
+
+static void timer_loop()
+{
+    vector<TimerNode *> expired;
+
+    unique_lock<mutex> lock(timer_mutex);
+    while (running)
+    {
+        timer_condition.wait_for(lock, chrono::milliseconds(TICK_MS));
+
+        uint64_t now = clock_tick();
+        current_tick.store(now, memory_order_relaxed);
+
+        expired.clear();
+        wheel->advance(now, expired);
+
+        size_t fired[3] = {0, 0, 0};
+        for (TimerNode *node : expired)
+        {
+            ConnectionTimers *c = static_cast<ConnectionTimers *>(node->owner);
+
+            // An earlier expiry in this batch may have closed the connection
+            if (!c->expired && fire(node))
+                ++fired[node->kind];
+        }
+
+        if (fired[0] || fired[1] || fired[2])
+        {
+            // Metrics persist to disk; keep that outside the wheel lock
+            lock.unlock();
+            record_timeouts(fired[TIMEOUT_HEADER],
+                            fired[TIMEOUT_IDLE],
+                            fired[TIMEOUT_LIFETIME]);
+            lock.lock();
+        }
+    }
+}
+
+void set_timeouts(const TimeoutSettings &settings)
+{
+    header_timeout.store(settings.header_timeout);
+    idle_timeout.store(settings.idle_timeout);
+    max_lifetime.store(settings.max_lifetime);
+}
+
+void init_timeouts()
+{
+    lock_guard<mutex> lock(timer_mutex);
+    if (running)
+        return;
+
+    uint64_t now = clock_tick();
+    current_tick.store(now);
+    wheel.reset(new TimerWheel(now));
+
+    running = true;
+    timer_thread = thread(timer_loop);
+}
+
+void stop_timeouts()
+{
+    {
+        lock_guard<mutex> lock(timer_mutex);
+        if (!running)
+            return;
+        running = false;
+    }
+    timer_condition.notify_all();
+    timer_thread.join();
+}
+
+static void arm(TimerNode &node, int kind, int seconds)
+{
+    node.kind = kind;
+    node.owner = &conn;
+    if (seconds > 0)
+        wheel->insert(&node, wheel->now() + seconds * TICKS_PER_SEC);
+}
+
+void timeouts_begin(int client_fd)
+{
+    lock_guard<mutex> lock(timer_mutex);
+    if (!running)
+        return;
+
+    conn.client_fd = client_fd;
+    conn.server_fd = -1;
+    conn.last_activity.store(current_tick.load(memory_order_relaxed));
+    conn.expired = false;
+    conn_active = true;
+    active_connections.insert(&conn);
+
+    arm(conn.header, TIMEOUT_HEADER, header_timeout.load());
+    arm(conn.lifetime, TIMEOUT_LIFETIME, max_lifetime.load());
+}
+
+void timeouts_header_done()
+{
+    if (!conn_active)
+        return;
+
+    lock_guard<mutex> lock(timer_mutex);
+    wheel->cancel(&conn.header);
+
+    conn.last_activity.store(current_tick.load(memory_order_relaxed));
+    arm(conn.idle, TIMEOUT_IDLE, idle_timeout.load());
+}
+
+void timeouts_watch_upstream(int server_fd)
+{
+    if (!conn_active)
+        return;
+
+    lock_guard<mutex> lock(timer_mutex);
+    conn.server_fd = server_fd;
+
+    // Deadline passed while the upstream was being set up
+    if (conn.expired)
+        shutdown(server_fd, SHUT_RDWR);
+}
+
+void timeouts_touch()
+{
+    if (conn_active)
+        conn.last_activity.store(current_tick.load(memory_order_relaxed),
+                                 memory_order_relaxed);
+}
+
+void timeouts_end()
+{
+    if (!conn_active)
+        return;
+
+    lock_guard<mutex> lock(timer_mutex);
+    wheel->cancel(&conn.header);
+    wheel->cancel(&conn.idle);
+    wheel->cancel(&conn.lifetime);
+    conn.client_fd = -1;
+    conn.server_fd = -1;
+    conn_active = false;
+    active_connections.erase(&conn);
+}
+
+size_t timeouts_shutdown_all()
+{
+    lock_guard<mutex> lock(timer_mutex);
+    if (!running)
+        return 0;
+
+    for (ConnectionTimers *c : active_connections)
+    {
+        c->expired = true;
+        shutdown_connection(c);
+    }
+    return active_connections.size();
+}
@@ -0,0 +1,107 @@
+#include "timer_wheel.h"
+
+static void unlink_node(TimerNode *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+    node->linked = false;
+}
+
+static void push_back(TimerNode *head, TimerNode *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+    node->linked = true;
+}
+
+TimerWheel::TimerWheel(uint64_t start_tick) : current(start_tick)
+{
+    for (int l = 0; l < LEVELS; ++l)
+    {
+        for (int s = 0; s < SLOTS; ++s)
+        {
+            slots[l][s].prev = &slots[l][s];
+            slots[l][s].next = &slots[l][s];
+        }
+    }
+}
+
+void TimerWheel::place(TimerNode *node)
+{
+    // During a cascade a node may be due on the tick being processed
+    if (node->expires < current)
+        node->expires = current;
+
+    uint64_t delta = node->expires - current;
+
+    // Clamp to the wheel's range; the owner re-arms on expiry
+    const uint64_t range = 1ULL << (SLOT_BITS * LEVELS);
+    if (delta >= range)
+    {
+        node->expires = current + range - 1;
+        delta = range - 1;
+    }
+
+    int level = 0;
+    while (level < LEVELS - 1 &&
+           delta >= (1ULL << (SLOT_BITS * (level + 1))))
+        ++level;
+
+    int slot = (node->expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+    push_back(&slots[level][slot], node);
+}
+
+void TimerWheel::insert(TimerNode *node, uint64_t expires)
+{
+    if (node->linked)
+        unlink_node(node);
+
+    // Slot for the current tick was already processed: fire on the next
+    node->expires = expires > current ? expires : current + 1;
+    place(node);
+}
+
+void TimerWheel::cancel(TimerNode *node)
+{
+    if (node->linked)
+        unlink_node(node);
+}
+
+// Redistributes the level's current slot into the levels below it
+void TimerWheel::cascade(int level)
+{
+    int index = (current >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+    if (index == 0 && level + 1 < LEVELS)
+        cascade(level + 1);
+
+    TimerNode *head = &slots[level][index];
+    while (head->next != head)
+    {
+        TimerNode *node = head->next;
+        unlink_node(node);
+        place(node);
+    }
+}
+
+void TimerWheel::advance(uint64_t now, vector<TimerNode *> &expired)
+{
+    while (current < now)
+    {
+        ++current;
+
+        if ((current & (SLOTS - 1)) == 0)
+            cascade(1);
+
+        TimerNode *head = &slots[0][current & (SLOTS - 1)];
+        while (head->next != head)
+        {
+            TimerNode *node = head->next;
+            unlink_node(node);
+            expired.push_back(node);
+        }
+    }
+}
@@ -0,0 +1,238 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+struct TraceEvent
+{
+    const char *name;
+    uint64_t trace_id;
+    uint64_t start_us;
+    uint64_t dur_us;
+};
+
+// One ring per thread. The owning thread is the only writer; the mutex
+// is uncontended except while a dump is copying the events out.
+struct TraceRing
+{
+    mutex ring_mutex;
+    vector<TraceEvent> events;
+    size_t next = 0;
+    size_t count = 0;
+    int tid = 0;
+    string thread_name;
+};
+
+static vector<shared_ptr<TraceRing>> rings;
+static vector<TraceRing *> free_rings; // rings of threads that exited
+static mutex rings_mutex;
+
+// Hands the thread's ring back for reuse when the thread exits, so
+// short-lived threads (retired pool workers) do not add a ring each
+struct RingOwner
+{
+    TraceRing *ring = nullptr;
+
+    ~RingOwner()
+    {
+        if (!ring)
+            return;
+        lock_guard<mutex> lock(rings_mutex);
+        free_rings.push_back(ring);
+    }
+};
+
+static thread_local RingOwner local_ring;
+static thread_local uint64_t current_trace_id = 0;
+
+// Rewritten by a reload while workers read them
+static atomic<double> sample_rate(0.0);
+static atomic<size_t> ring_capacity(4096);
+static string trace_path; // guarded by rings_mutex
+
+static atomic<uint64_t> next_trace_id(1);
+static atomic<bool> dump_requested(false);
+
+static const auto trace_epoch = chrono::steady_clock::now();
+
+void init_tracing(double rate, size_t capacity, const string &output_file)
+{
+    sample_rate.store(rate);
+    ring_capacity.store(capacity > 0 ? capacity : 1);
+
+    lock_guard<mutex> lock(rings_mutex);
+    trace_path = output_file;
+}
+
+uint64_t trace_now_us()
+{
+    return chrono::duration_cast<chrono::microseconds>(
+               chrono::steady_clock::now() - trace_epoch)
+        .count();
+}
+
+uint64_t trace_sample()
+{
+    double rate = sample_rate.load(memory_order_relaxed);
+    if (rate <= 0.0)
+        return 0;
+
+    if (rate < 1.0)
+    {
+        static thread_local minstd_rand rng(random_device{}());
+        uniform_real_distribution<double> dist(0.0, 1.0);
+        if (dist(rng) >= rate)
+            return 0;
+    }
+
+    return next_trace_id.fetch_add(1);
+}
+
+void trace_set_current(uint64_t trace_id)
+{
+    current_trace_id = trace_id;
+}
+
+uint64_t trace_current()
+{
+    return current_trace_id;
+}
+
+static TraceRing *get_local_ring()
+{
+    if (local_ring.ring)
+        return local_ring.ring;
+
+    size_t capacity = ring_capacity.load();
+    lock_guard<mutex> lock(rings_mutex);
+
+    // A ring left by an exited thread starts over under the new owner
+    if (!free_rings.empty())
+    {
+        TraceRing *ring = free_rings.back();
+        free_rings.pop_back();
+
+        lock_guard<mutex> ring_lock(ring->ring_mutex);
+        ring->events.assign(capacity, TraceEvent{});
+        ring->next = 0;
+        ring->count = 0;
+        ring->thread_name = "thread-" + to_string(ring->tid);
+        local_ring.ring = ring;
+        return ring;
+    }
+
+    auto ring = make_shared<TraceRing>();
+    ring->events.resize(capacity);
+    ring->tid = static_cast<int>(rings.size()) + 1;
+    ring->thread_name = "thread-" + to_string(ring->tid);
+    rings.push_back(ring);
+
+    local_ring.ring = ring.get();
+    return local_ring.ring;
+}
+
+void trace_name_thread(const string &name)
+{
+    TraceRing *ring = get_local_ring();
+    lock_guard<mutex> lock(ring->ring_mutex);
+    ring->thread_name = name;
+}
+
+void trace_record(uint64_t trace_id, const char *name,
+                  uint64_t start_us, uint64_t end_us)
+{
+    if (trace_id == 0)
+        return;
+
+    TraceRing *ring = get_local_ring();
+    lock_guard<mutex> lock(ring->ring_mutex);
+
+    TraceEvent &ev = ring->events[ring->next];
+    ev.name = name;
+    ev.trace_id = trace_id;
+    ev.start_us = start_us;
+    ev.dur_us = end_us > start_us ? end_us - start_us : 0;
+
+    ring->next = (ring->next + 1) % ring->events.size();
+    if (ring->count < ring->events.size())
+        ++ring->count;
+}
+
+void request_trace_dump()
+{
+    dump_requested.store(true);
+}
+
+bool trace_dump_pending()
+{
+    return dump_requested.load();
+}
+
+bool dump_traces()
+{
+    dump_requested.store(false);
+
+    vector<shared_ptr<TraceRing>> snapshot;
+    string path;
+    {
+        lock_guard<mutex> lock(rings_mutex);
+        snapshot = rings;
+        path = trace_path;
+    }
+
+    ofstream out(path, ios::out); // overwrite
+    if (!out.is_open())
+    {
+        cerr << "[ERROR] Cannot open trace file: "
+             << path << endl;
+        return false;
+    }
+
+    size_t total = 0;
+    bool first = true;
+    out << "{\"traceEvents\":[\n";
+
+    for (const auto &ring : snapshot)
+    {
+        vector<TraceEvent> events;
+        string thread_name;
+        {
+            lock_guard<mutex> lock(ring->ring_mutex);
+            size_t cap = ring->events.size();
+            size_t start = (ring->next + cap - ring->count) % cap;
+            for (size_t i = 0; i < ring->count; ++i)
+                events.push_back(ring->events[(start + i) % cap]);
+            thread_name = ring->thread_name;
+        }
+
+        out << (first ? "" : ",\n")
+            << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+            << ring->tid << ",\"args\":{\"name\":\"" << thread_name << "\"}}";
+        first = false;
+
+        for (const auto &ev : events)
+        {
+            out << ",\n{\"name\":\"" << ev.name
+                << "\",\"cat\":\"proxy\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                << ring->tid
+                << ",\"ts\":" << ev.start_us
+                << ",\"dur\":" << ev.dur_us
+                << ",\"args\":{\"trace_id\":" << ev.trace_id << "}}";
+        }
+        total += events.size();
+    }
+
+    out << "\n]}\n";
+
+    cout << "[INFO] Wrote " << total << " trace spans to "
+         << path << endl;
+    return true;
+}
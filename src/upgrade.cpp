@@ -0,0 +1,226 @@
+#include "upgrade.h"
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+extern char **environ;
+
+// Descriptor number of the handoff channel in the new process
+static const int CHANNEL_FD = 3;
+static const char *CHANNEL_ENV = "PROXY_UPGRADE_FD";
+
+static string exe_path;
+static vector<string> exe_args;
+static pid_t child_pid = -1;
+
+// Only valid in a process started by an upgrade
+static int parent_channel = -1;
+
+void init_upgrade(int argc, char *argv[])
+{
+    char buf[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    if (n > 0)
+    {
+        buf[n] = '\0';
+        // A replaced binary shows up as "<path> (deleted)"
+        exe_path = buf;
+        const string deleted = " (deleted)";
+        if (exe_path.size() > deleted.size() &&
+            exe_path.compare(exe_path.size() - deleted.size(),
+                             deleted.size(), deleted) == 0)
+            exe_path.erase(exe_path.size() - deleted.size());
+    }
+    else
+    {
+        exe_path = argv[0];
+    }
+
+    exe_args.assign(argv, argv + argc);
+}
+
+static bool send_fd(int channel, int fd)
+{
+    char byte = 'L';
+    iovec iov{&byte, 1};
+
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(channel, &msg, MSG_NOSIGNAL) == 1;
+}
+
+static int recv_fd(int channel)
+{
+    char byte;
+    iovec iov{&byte, 1};
+
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+int upgrade_inherited_listener()
+{
+    const char *value = getenv(CHANNEL_ENV);
+    if (!value)
+        return -1;
+
+    int channel = atoi(value);
+    unsetenv(CHANNEL_ENV);
+    fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+    int fd = recv_fd(channel);
+    if (fd < 0)
+    {
+        cerr << "[ERROR] Upgrade handoff failed, binding a new socket" << endl;
+        close(channel);
+        return -1;
+    }
+
+    parent_channel = channel;
+    return fd;
+}
+
+void upgrade_notify_ready()
+{
+    if (parent_channel < 0)
+        return;
+
+    char byte = 'R';
+    send(parent_channel, &byte, 1, MSG_NOSIGNAL);
+    close(parent_channel);
+    parent_channel = -1;
+}
+
+int upgrade_start(int listen_fd)
+{
+    if (child_pid > 0)
+        return -1; // an upgrade is already in progress
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return -1;
+    }
+
+    // Everything exec needs is built before fork: only async-signal-safe
+    // calls are allowed in the child of a multithreaded process
+    vector<char *> args;
+    for (string &arg : exe_args)
+        args.push_back(&arg[0]);
+    args.push_back(nullptr);
+
+    string channel_var = string(CHANNEL_ENV) + "=" + to_string(CHANNEL_FD);
+    vector<char *> env;
+    for (char **e = environ; *e; ++e)
+    {
+        if (strncmp(*e, CHANNEL_ENV, strlen(CHANNEL_ENV)) != 0)
+            env.push_back(*e);
+    }
+    env.push_back(&channel_var[0]);
+    env.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        // Client and upstream sockets must not leak into the new process,
+        // or closing them here would no longer end those connections
+        dup2(fds[1], CHANNEL_FD); // dup2 clears FD_CLOEXEC
+        if (close_range(CHANNEL_FD + 1, ~0U, 0) < 0)
+        {
+            for (int fd = CHANNEL_FD + 1; fd < 1024; ++fd)
+                close(fd);
+        }
+
+        execve(exe_path.c_str(), args.data(), env.data());
+        _exit(127);
+    }
+
+    close(fds[1]);
+
+    if (!send_fd(fds[0], listen_fd))
+    {
+        cerr << "[ERROR] Could not pass listening socket to new process"
+             << endl;
+        close(fds[0]);
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+        return -1;
+    }
+
+    child_pid = pid;
+    return fds[0];
+}
+
+bool upgrade_finish(int channel_fd)
+{
+    char byte = 0;
+    ssize_t n = recv(channel_fd, &byte, 1, 0);
+    close(channel_fd);
+
+    if (n == 1 && byte == 'R')
+        return true;
+
+    // The new process failed before it was ready; make sure it is gone
+    upgrade_abort(-1);
+    return false;
+}
+
+void upgrade_abort(int channel_fd)
+{
+    if (channel_fd >= 0)
+        close(channel_fd);
+
+    if (child_pid > 0)
+    {
+        kill(child_pid, SIGTERM);
+        waitpid(child_pid, nullptr, 0);
+    }
+    child_pid = -1;
+}
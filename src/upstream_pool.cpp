@@ -0,0 +1,363 @@
+#include "upstream_pool.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+using Pool = vector<shared_ptr<Backend>>;
+using PoolMap = unordered_map<string, Pool>;
+
+// Pools are replaced as a whole on reload; readers load the current map
+static shared_ptr<const PoolMap> pools = make_shared<const PoolMap>();
+
+static mutex settings_mutex;
+static UpstreamSettings settings;
+static atomic<int> policy(BALANCE_LEAST_CONN);
+static atomic<int> eject_after_failures(5);
+static atomic<int> ejection_sec(30);
+
+static mutex checker_mutex;
+static condition_variable checker_condition;
+static thread checker_thread;
+static bool checker_running = false;
+
+static atomic<unsigned> round_robin(0);
+
+static int64_t now_ms()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void set_upstream_settings(const UpstreamSettings &new_settings)
+{
+    {
+        lock_guard<mutex> lock(settings_mutex);
+        settings = new_settings;
+    }
+    policy.store(new_settings.policy);
+    eject_after_failures.store(new_settings.eject_after_failures);
+    ejection_sec.store(new_settings.ejection_sec);
+    checker_condition.notify_all();
+}
+
+static bool resolve_backend(const string &name, sockaddr_in &addr)
+{
+    size_t colon = name.rfind(':');
+    if (colon == string::npos || colon == 0)
+        return false;
+
+    string host = name.substr(0, colon);
+    int port = atoi(name.c_str() + colon + 1);
+    if (port <= 0 || port > 65535)
+        return false;
+
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || !result)
+        return false;
+
+    addr = *reinterpret_cast<sockaddr_in *>(result->ai_addr);
+    addr.sin_port = htons(port);
+    freeaddrinfo(result);
+    return true;
+}
+
+bool load_upstreams(const string &filename)
+{
+    ifstream file(filename);
+    if (!file.is_open())
+    {
+        cerr << "[ERROR] Could not open upstreams file: "
+             << filename << endl;
+        return false;
+    }
+
+    auto loaded = make_shared<PoolMap>();
+    size_t backend_count = 0;
+
+    string line;
+    while (getline(file, line))
+    {
+        size_t hash = line.find('#');
+        if (hash != string::npos)
+            line.erase(hash);
+
+        istringstream words(line);
+        string vhost;
+        if (!(words >> vhost))
+            continue;
+
+        for (char &c : vhost)
+            c = tolower(c);
+
+        string name;
+        while (words >> name)
+        {
+            auto backend = make_shared<Backend>();
+            backend->name = name;
+            backend->vhost = vhost;
+            if (!resolve_backend(name, backend->addr))
+            {
+                cerr << "[ERROR] Invalid backend " << name
+                     << " for " << vhost << endl;
+                return false;
+            }
+            (*loaded)[vhost].push_back(backend);
+            ++backend_count;
+        }
+    }
+
+    atomic_store(&pools, shared_ptr<const PoolMap>(loaded));
+
+    cout << "[INFO] Loaded " << loaded->size() << " upstream pools with "
+         << backend_count << " backends" << endl;
+    return true;
+}
+
+static const Pool *find_pool(const PoolMap &map, const string &vhost)
+{
+    string key = vhost;
+    for (char &c : key)
+        c = tolower(c);
+
+    auto it = map.find(key);
+    if (it == map.end())
+        it = map.find("*");
+    return it == map.end() ? nullptr : &it->second;
+}
+
+bool has_upstream_pool(const string &vhost)
+{
+    shared_ptr<const PoolMap> map = atomic_load(&pools);
+    return find_pool(*map, vhost) != nullptr;
+}
+
+static bool usable(const Backend &b, int64_t now)
+{
+    return b.healthy.load(memory_order_relaxed) &&
+           b.ejected_until_ms.load(memory_order_relaxed) <= now;
+}
+
+// Expected cost of sending one more request: latency scaled by the
+// queue the request would join. Unsampled backends look cheapest so
+// they receive traffic and get measured.
+static double p2c_score(const Backend &b)
+{
+    return b.ewma_ms.load(memory_order_relaxed) *
+           (b.active.load(memory_order_relaxed) + 1);
+}
+
+shared_ptr<Backend> pick_backend(const string &vhost)
+{
+    shared_ptr<const PoolMap> map = atomic_load(&pools);
+    const Pool *pool = find_pool(*map, vhost);
+    if (!pool || pool->empty())
+        return nullptr;
+
+    int64_t now = now_ms();
+    vector<const shared_ptr<Backend> *> candidates;
+    candidates.reserve(pool->size());
+    for (const auto &b : *pool)
+    {
+        if (usable(*b, now))
+            candidates.push_back(&b);
+    }
+
+    if (candidates.empty())
+        return nullptr;
+
+    const shared_ptr<Backend> *chosen = nullptr;
+    size_t n = candidates.size();
+
+    if (policy.load() == BALANCE_P2C_EWMA && n > 1)
+    {
+        static thread_local minstd_rand rng(random_device{}());
+        size_t a = rng() % n;
+        size_t b = rng() % (n - 1);
+        if (b >= a)
+            ++b;
+        chosen = p2c_score(**candidates[a]) <= p2c_score(**candidates[b])
+                     ? candidates[a]
+                     : candidates[b];
+    }
+    else
+    {
+        // Least connections; ties rotate so equal backends share load
+        size_t start = round_robin.fetch_add(1, memory_order_relaxed) % n;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const shared_ptr<Backend> *b = candidates[(start + i) % n];
+            if (!chosen || (*b)->active.load(memory_order_relaxed) <
+                               (*chosen)->active.load(memory_order_relaxed))
+                chosen = b;
+        }
+    }
+
+    // The owning pointer keeps the backend alive across a pool reload
+    (*chosen)->active.fetch_add(1);
+    return *chosen;
+}
+
+void release_backend(const shared_ptr<Backend> &backend, bool success,
+                     uint64_t first_byte_us)
+{
+    backend->active.fetch_sub(1);
+
+    if (success)
+    {
+        backend->failures.store(0, memory_order_relaxed);
+
+        double sample = first_byte_us / 1000.0;
+        double old_ewma = backend->ewma_ms.load(memory_order_relaxed);
+        double updated = old_ewma == 0 ? sample : 0.8 * old_ewma + 0.2 * sample;
+        backend->ewma_ms.store(max(updated, 0.001), memory_order_relaxed);
+        return;
+    }
+
+    int limit = eject_after_failures.load();
+    if (limit <= 0 || backend->failures.fetch_add(1) + 1 < limit)
+        return;
+
+    backend->failures.store(0);
+    backend->ejected_until_ms.store(now_ms() + ejection_sec.load() * 1000LL);
+    record_outlier_ejection();
+    log_event("UPSTREAM EJECT | " + backend->vhost + " | " + backend->name +
+              " | " + to_string(limit) + " consecutive failures");
+}
+
+// Connects (and optionally sends a GET) with a deadline; true when the
+// backend accepts the connection and answers with a 2xx or 3xx status
+static bool probe(const Backend &b, const string &path, int timeout_ms)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+
+    int64_t deadline = now_ms() + timeout_ms;
+    auto wait_for = [&](short events)
+    {
+        pollfd pfd{fd, events, 0};
+        int64_t left = deadline - now_ms();
+        return left > 0 && poll(&pfd, 1, left) == 1;
+    };
+
+    bool ok = false;
+    int rc = connect(fd, (const sockaddr *)&b.addr, sizeof(b.addr));
+    if (rc == 0 || (errno == EINPROGRESS && wait_for(POLLOUT)))
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        ok = err == 0;
+    }
+
+    if (ok && !path.empty())
+    {
+        string host = b.vhost == "*" ? b.name : b.vhost;
+        string request = "GET " + path + " HTTP/1.0\r\nHost: " + host +
+                         "\r\nUser-Agent: proxy-health-check\r\n\r\n";
+        ok = send(fd, request.data(), request.size(), MSG_NOSIGNAL) ==
+             (ssize_t)request.size();
+
+        char status[16] = {};
+        size_t got = 0;
+        while (ok && got < 12 && wait_for(POLLIN))
+        {
+            ssize_t n = recv(fd, status + got, 12 - got, 0);
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        // "HTTP/1.x 2xx"
+        ok = got >= 12 && strncmp(status, "HTTP/", 5) == 0 &&
+             (status[9] == '2' || status[9] == '3');
+    }
+
+    close(fd);
+    return ok;
+}
+
+static void health_check_loop()
+{
+    unique_lock<mutex> lock(checker_mutex);
+    while (checker_running)
+    {
+        UpstreamSettings current;
+        {
+            lock_guard<mutex> settings_lock(settings_mutex);
+            current = settings;
+        }
+
+        int interval = current.health_check_interval > 0
+                           ? current.health_check_interval
+                           : 1;
+        checker_condition.wait_for(lock, chrono::seconds(interval));
+        if (!checker_running)
+            break;
+        if (current.health_check_interval <= 0)
+            continue;
+
+        lock.unlock();
+
+        shared_ptr<const PoolMap> map = atomic_load(&pools);
+        for (const auto &entry : *map)
+        {
+            for (const auto &b : entry.second)
+            {
+                bool ok = probe(*b, current.health_check_path,
+                                current.health_check_timeout_ms);
+                if (ok != b->healthy.exchange(ok))
+                    log_event(string("UPSTREAM HEALTH | ") + b->vhost + " | " +
+                              b->name + " | " + (ok ? "UP" : "DOWN"));
+            }
+        }
+
+        lock.lock();
+    }
+}
+
+void init_upstreams()
+{
+    lock_guard<mutex> lock(checker_mutex);
+    if (checker_running)
+        return;
+
+    checker_running = true;
+    checker_thread = thread(health_check_loop);
+}
+
+void stop_upstreams()
+{
+    {
+        lock_guard<mutex> lock(checker_mutex);
+        if (!checker_running)
+            return;
+        checker_running = false;
+    }
+    checker_condition.notify_all();
+    checker_thread.join();
+}
@@ -0,0 +1,35 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <iostream>
+
+// Assertions for the unit tests under tests/ (built and run by make
+// test). A failed CHECK is reported and the test carries on, so one run
+// lists every broken expectation; main() returns check_report().
+
+static int check_failures = 0;
+
+#define CHECK(cond)                                                       \
+    do                                                                    \
+    {                                                                     \
+        if (!(cond))                                                      \
+        {                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__                      \
+                      << ": CHECK failed: " << #cond << std::endl;        \
+            ++check_failures;                                             \
+        }                                                                 \
+    } while (0)
+
+// Prints the outcome; the process exit status
+inline int check_report(const char *test)
+{
+    if (check_failures)
+    {
+        std::cerr << test << ": " << check_failures << " failed" << std::endl;
+        return 1;
+    }
+    std::cout << test << ": ok" << std::endl;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,131 @@
+// Blocklist rule grammar and matcher checks.
+
+#include "blocklist.h"
+#include "check.h"
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+// Writes rules to a temporary file and loads them as the active set
+static bool load_rules(const string &rules)
+{
+    char path[] = "/tmp/test_blocklist.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return false;
+    close(fd);
+
+    {
+        ofstream file(path);
+        file << rules;
+    }
+    bool ok = load_blocklist(path);
+    unlink(path);
+    return ok;
+}
+
+// The rule that blocks host + path, or "" when none does
+static string match(const string &host, const string &path)
+{
+    string rule;
+    if (!is_blocked(host, path, rule))
+        return "";
+    return rule;
+}
+
+static void test_host_rules()
+{
+    CHECK(load_rules("# comment\n\nexample.com\nAds.Example.NET  \n"));
+
+    CHECK(match("example.com", "/") == "example.com");
+    CHECK(match("www.example.com", "/") == "example.com");
+    CHECK(match("a.b.example.com", "/x") == "example.com");
+    CHECK(match("EXAMPLE.com", "/") == "example.com");
+    CHECK(match("notexample.com", "/") == "");
+    CHECK(match("example.com.evil.org", "/") == "");
+    CHECK(match("example.org", "/example.com") == "");
+
+    // Trailing whitespace is trimmed and hosts are case-insensitive
+    CHECK(match("ads.example.net", "/") == "Ads.Example.NET");
+    CHECK(match("cdn.ads.example.net", "/") == "Ads.Example.NET");
+    CHECK(match("example.net", "/") == "");
+}
+
+static void test_glob_rules()
+{
+    CHECK(load_rules("*.ads.*\ntrack?.example.org\n"));
+
+    CHECK(match("x.ads.example.com", "/") == "*.ads.*");
+    CHECK(match("ads.example.com", "/") == "");
+    CHECK(match("track1.example.org", "/") == "track?.example.org");
+    CHECK(match("track12.example.org", "/") == "");
+
+    // Globs match the whole host, not a substring of it
+    CHECK(match("mytrack1.example.org", "/") == "");
+}
+
+static void test_path_rules()
+{
+    CHECK(load_rules("example.com/private/\n*/tracking/\n*.cdn.net/img\n"));
+
+    CHECK(match("example.com", "/private/a") == "example.com/private/");
+    CHECK(match("www.example.com", "/private/") == "example.com/private/");
+    CHECK(match("example.com", "/public/private/") == "");
+    CHECK(match("example.com", "/") == "");
+    CHECK(match("other.com", "/private/a") == "");
+
+    CHECK(match("any.host", "/tracking/pixel") == "*/tracking/");
+    CHECK(match("any.host", "/x/tracking/") == "");
+
+    CHECK(match("eu.cdn.net", "/img/a.png") == "*.cdn.net/img");
+    CHECK(match("eu.cdn.net", "/js/a.js") == "");
+    CHECK(match("cdn.net", "/img/a.png") == "");
+
+    // Paths keep their case
+    CHECK(match("example.com", "/PRIVATE/a") == "");
+}
+
+static void test_substring_rules()
+{
+    CHECK(load_rules("~Banner\n~she\n~he\n~hers\n"));
+
+    CHECK(match("banner.example.com", "/") == "~Banner");
+    CHECK(match("example.com", "/img/Banner.png") == "~Banner");
+
+    // Overlapping literals are reached through fail and dictionary links
+    CHECK(match("example.com", "/ushers") != "");
+    CHECK(match("example.com", "/ahe") == "~he");
+    CHECK(match("example.com", "/hxrs") == "");
+}
+
+static void test_invalid_rules()
+{
+    // Bad rules are skipped, the rest still load
+    CHECK(load_rules("~\n*\n/path-only\nvalid.com\n"));
+    CHECK(match("valid.com", "/") == "valid.com");
+    CHECK(match("x.org", "/path-only") == "");
+
+    // A missing file keeps the previous set
+    CHECK(!load_blocklist("/nonexistent/blocklist.txt"));
+    CHECK(match("valid.com", "/") == "valid.com");
+
+    CHECK(load_rules(""));
+    CHECK(match("valid.com", "/") == "");
+}
+
+int main()
+{
+    test_host_rules();
+    test_glob_rules();
+    test_path_rules();
+    test_substring_rules();
+    test_invalid_rules();
+
+    return check_report("test_blocklist");
+}
@@ -0,0 +1,118 @@
+// Chunked transfer-coding framing checks.
+
+#include "http_parser.h"
+#include "check.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+// Defined in config.cpp, which is not linked into this test
+atomic<size_t> g_buffer_size(4096);
+atomic<int> g_default_http_port(80);
+
+// Feeds text in pieces of step bytes; returns how many were consumed
+static size_t feed(ChunkedDecoder &decoder, const string &text, size_t step)
+{
+    size_t used = 0;
+    while (used < text.size() && !decoder.done() && !decoder.failed())
+    {
+        size_t len = min(step, text.size() - used);
+        used += decoder.feed(text.data() + used, len);
+    }
+    return used;
+}
+
+static void check_body(const string &body, size_t expected_length)
+{
+    // Every split of the input must give the same result
+    for (size_t step : {body.size(), size_t(1), size_t(2), size_t(7)})
+    {
+        ChunkedDecoder decoder;
+        string text = body + "NEXT";
+        size_t used = feed(decoder, text, step);
+        CHECK(decoder.done());
+        CHECK(!decoder.failed());
+        CHECK(used == expected_length);
+    }
+}
+
+static void check_fails(const string &body)
+{
+    for (size_t step : {body.size(), size_t(1)})
+    {
+        ChunkedDecoder decoder;
+        feed(decoder, body, step);
+        CHECK(decoder.failed());
+    }
+}
+
+static void test_valid()
+{
+    string simple = "5\r\nhello\r\n0\r\n\r\n";
+    check_body(simple, simple.size());
+
+    string hex = "a\r\n0123456789\r\nF\r\n0123456789abcde\r\n0\r\n\r\n";
+    check_body(hex, hex.size());
+
+    string extension = "5;name=value\r\nhello\r\n0 ; last\r\n\r\n";
+    check_body(extension, extension.size());
+
+    string trailer = "3\r\nabc\r\n0\r\nX-Sum: 1\r\nX-More: 2\r\n\r\n";
+    check_body(trailer, trailer.size());
+
+    string leading_zeros = "0005\r\nhello\r\n000\r\n\r\n";
+    check_body(leading_zeros, leading_zeros.size());
+}
+
+// Payload extraction drops sizes, extensions, CRLFs and trailers
+static void test_payload()
+{
+    string body = "5;x=1\r\nhello\r\n6\r\n world\r\n0\r\nX-Sum: 1\r\n\r\n";
+    for (size_t step : {body.size(), size_t(1), size_t(3)})
+    {
+        ChunkedDecoder decoder;
+        string payload;
+        for (size_t used = 0; used < body.size();)
+        {
+            size_t len = min(step, body.size() - used);
+            used += decoder.feed(body.data() + used, len, &payload);
+        }
+        CHECK(decoder.done());
+        CHECK(payload == "hello world");
+    }
+}
+
+static void test_incomplete()
+{
+    ChunkedDecoder decoder;
+    string partial = "5\r\nhel";
+    CHECK(decoder.feed(partial.data(), partial.size()) == partial.size());
+    CHECK(!decoder.done() && !decoder.failed());
+}
+
+static void test_invalid()
+{
+    check_fails("\r\n");               // no size digits
+    check_fails("5x\r\nhello\r\n");    // junk after the size
+    check_fails("5\rhello\r\n");       // CR without LF
+    check_fails("5\r\nhelloXX");       // data longer than the size
+    check_fails("3\r\nabc\r\n0\r\n\rX");
+    check_fails("-1\r\n");
+
+    // Sizes that would overflow size_t
+    check_fails("1" + string(sizeof(size_t) * 2, '0') + "\r\n");
+}
+
+int main()
+{
+    test_valid();
+    test_payload();
+    test_incomplete();
+    test_invalid();
+
+    return check_report("test_chunked");
+}
@@ -0,0 +1,114 @@
+// Response compression: header rewriting and the encoded body.
+
+#include "compressor.h"
+#include "check.h"
+
+#include <zlib.h>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+static const string BODY(4096, 'a');
+
+// Runs a response through a compressor as one chunk
+static string compress_response(const string &head, const string &method = "GET")
+{
+    ResponseCompressor compressor(method, "gzip, deflate");
+    string response = head + "\r\n" + BODY;
+    string out, tail;
+    compressor.feed(response.data(), response.size(), out);
+    compressor.finish(tail);
+    return out + tail;
+}
+
+static string header_block(const string &response)
+{
+    return response.substr(0, response.find("\r\n\r\n") + 4);
+}
+
+static string gunzip(const string &data)
+{
+    z_stream zs{};
+    inflateInit2(&zs, 15 + 16);
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in = data.size();
+
+    string out;
+    char buffer[16 * 1024];
+    int rc;
+    do
+    {
+        zs.next_out = reinterpret_cast<Bytef *>(buffer);
+        zs.avail_out = sizeof(buffer);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        out.append(buffer, sizeof(buffer) - zs.avail_out);
+    } while (rc == Z_OK);
+    inflateEnd(&zs);
+    return rc == Z_STREAM_END ? out : "";
+}
+
+static const string OK_TEXT =
+    "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 4096\r\n";
+
+static void test_body_and_length()
+{
+    string response = compress_response(OK_TEXT + "ETag: \"abc\"\r\n");
+    string head = header_block(response);
+
+    CHECK(head.find("Content-Encoding: gzip\r\n") != string::npos);
+    CHECK(head.find("Content-Length") == string::npos);
+    CHECK(head.find("ETag: W/\"abc\"\r\n") != string::npos);
+    CHECK(head.find("Vary: Accept-Encoding\r\n") != string::npos);
+    CHECK(gunzip(response.substr(head.size())) == BODY);
+}
+
+// The origin's Vary is kept and extended, never replaced
+static void test_vary()
+{
+    string head = header_block(compress_response(OK_TEXT + "Vary: Cookie\r\n"));
+    CHECK(head.find("Vary: Cookie, Accept-Encoding\r\n") != string::npos);
+    CHECK(head.find("Vary:", head.find("Vary:") + 1) == string::npos);
+
+    head = header_block(compress_response(OK_TEXT + "Vary: Origin\r\n"
+                                                    "vary: Authorization\r\n"));
+    CHECK(head.find("Vary: Origin, Accept-Encoding\r\n") != string::npos);
+    CHECK(head.find("vary: Authorization\r\n") != string::npos);
+
+    head = header_block(compress_response(OK_TEXT + "Vary: Origin\r\n"
+                                                    "Vary: accept-encoding\r\n"));
+    CHECK(head.find("Vary: Origin\r\n") != string::npos);
+    CHECK(head.find("Vary: accept-encoding\r\n") != string::npos);
+    CHECK(head.find("Accept-Encoding") == string::npos);
+
+    head = header_block(compress_response(OK_TEXT + "Vary: *\r\n"));
+    CHECK(head.find("Vary: *\r\n") != string::npos);
+    CHECK(head.find("Accept-Encoding") == string::npos);
+}
+
+static void test_passthrough()
+{
+    // Not compressed: the header, Vary and length included, is unchanged
+    string head = OK_TEXT + "Vary: Cookie\r\n";
+    CHECK(compress_response(head, "HEAD") == head + "\r\n" + BODY);
+
+    string no_content = "HTTP/1.0 204 No Content\r\nContent-Type: text/plain\r\n";
+    CHECK(compress_response(no_content) == no_content + "\r\n" + BODY);
+
+    string binary = "HTTP/1.0 200 OK\r\nContent-Type: image/png\r\n";
+    CHECK(compress_response(binary) == binary + "\r\n" + BODY);
+}
+
+int main()
+{
+    CompressionSettings settings;
+    settings.enabled = true;
+    settings.types = {"text/"};
+    set_compression(settings);
+
+    test_body_and_length();
+    test_vary();
+    test_passthrough();
+
+    return check_report("test_compressor");
+}
@@ -0,0 +1,162 @@
+// Forwarded HTTP requests as the origin receives them: a request is
+// parsed from a socketpair and relayed by forward_tcp() to a local origin.
+
+#include "forwarder.h"
+#include "check.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+static const char RESPONSE[] =
+    "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok";
+
+struct Exchange
+{
+    string origin_received; // request bytes as forwarded
+    string client_received; // response bytes relayed back
+};
+
+static int listen_local(int &port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 1) < 0)
+        return -1;
+
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr *)&addr, &len);
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// Sends request (with {port} replaced) through the proxy; the origin
+// reads until the request ends with end_marker, then answers
+static Exchange forward(string request, const string &end_marker)
+{
+    Exchange ex;
+    int port = 0;
+    int listener = listen_local(port);
+    if (listener < 0)
+        return ex;
+
+    size_t at;
+    while ((at = request.find("{port}")) != string::npos)
+        request.replace(at, 6, to_string(port));
+
+    thread origin([&ex, listener, &end_marker]
+                  {
+                      int fd = accept(listener, nullptr, nullptr);
+                      char buffer[4096];
+                      ssize_t n;
+                      while ((ex.origin_received.size() < end_marker.size() ||
+                              ex.origin_received.compare(
+                                  ex.origin_received.size() - end_marker.size(),
+                                  end_marker.size(), end_marker) != 0) &&
+                             (n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+                          ex.origin_received.append(buffer, n);
+                      send(fd, RESPONSE, sizeof(RESPONSE) - 1, MSG_NOSIGNAL);
+                      close(fd);
+                  });
+
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    send(fds[1], request.data(), request.size(), MSG_NOSIGNAL);
+
+    HttpRequest req;
+    if (parse_http_request(fds[0], req))
+        forward_tcp(fds[0], req, "127.0.0.1");
+    else
+        close(fds[0]);
+
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(fds[1], buffer, sizeof(buffer), 0)) > 0)
+        ex.client_received.append(buffer, n);
+    close(fds[1]);
+
+    // The origin may still wait if nothing was forwarded
+    shutdown(listener, SHUT_RDWR);
+    origin.join();
+    close(listener);
+    return ex;
+}
+
+static bool has(const string &text, const string &part)
+{
+    return text.find(part) != string::npos;
+}
+
+static bool starts(const string &text, const string &prefix)
+{
+    return text.compare(0, prefix.size(), prefix) == 0;
+}
+
+// A chunked body keeps its framing, which HTTP/1.0 cannot carry
+// (RFC 9112 6.1): the request goes out as HTTP/1.1 with Connection: close
+static void test_chunked_upload()
+{
+    Exchange ex = forward("POST http://127.0.0.1:{port}/upload HTTP/1.1\r\n"
+                          "Host: 127.0.0.1:{port}\r\n"
+                          "Transfer-Encoding: chunked\r\n"
+                          "Connection: keep-alive\r\n"
+                          "\r\n"
+                          "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n",
+                          "0\r\n\r\n");
+
+    const string &got = ex.origin_received;
+    CHECK(starts(got, "POST /upload HTTP/1.1\r\n"));
+    CHECK(has(got, "\r\nHost: 127.0.0.1:"));
+    CHECK(has(got, "\r\nTransfer-Encoding: chunked\r\n"));
+    CHECK(has(got, "\r\nConnection: close\r\n"));
+    CHECK(!has(got, "keep-alive"));
+    CHECK(has(got, "\r\n\r\n5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n"));
+    CHECK(starts(ex.client_received, "HTTP/1.1 200 OK\r\n"));
+}
+
+static void test_chunked_upload_without_host()
+{
+    Exchange ex = forward("PUT http://127.0.0.1:{port}/a HTTP/1.1\r\n"
+                          "Transfer-Encoding: chunked\r\n"
+                          "\r\n"
+                          "0\r\n\r\n",
+                          "0\r\n\r\n");
+
+    CHECK(starts(ex.origin_received, "PUT /a HTTP/1.1\r\n"));
+    CHECK(has(ex.origin_received, "\r\nHost: 127.0.0.1:"));
+}
+
+static void test_length_upload()
+{
+    Exchange ex = forward("POST http://127.0.0.1:{port}/form HTTP/1.1\r\n"
+                          "Host: 127.0.0.1:{port}\r\n"
+                          "Content-Length: 5\r\n"
+                          "\r\n"
+                          "hello",
+                          "hello");
+
+    const string &got = ex.origin_received;
+    CHECK(starts(got, "POST /form HTTP/1.0\r\n"));
+    CHECK(!has(got, "Connection:"));
+    CHECK(has(got, "\r\nContent-Length: 5\r\n"));
+    CHECK(has(got, "\r\n\r\nhello"));
+    CHECK(starts(ex.client_received, "HTTP/1.1 200 OK\r\n"));
+}
+
+int main()
+{
+    test_chunked_upload();
+    test_chunked_upload_without_host();
+    test_length_upload();
+
+    return check_report("test_forwarder");
+}
@@ -0,0 +1,194 @@
+// HPACK decoder and encoder checks against RFC 7541 Appendix C.
+
+#include "hpack.h"
+#include "check.h"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static vector<uint8_t> from_hex(const string &hex)
+{
+    vector<uint8_t> bytes;
+    string digits;
+    for (char c : hex)
+    {
+        if (c != ' ')
+            digits += c;
+    }
+    for (size_t i = 0; i + 1 < digits.size(); i += 2)
+        bytes.push_back(static_cast<uint8_t>(stoul(digits.substr(i, 2), nullptr, 16)));
+    return bytes;
+}
+
+static bool decode(HpackDecoder &decoder, const string &hex,
+                   vector<HeaderField> &headers)
+{
+    vector<uint8_t> block = from_hex(hex);
+    headers.clear();
+    return decoder.decode(block.data(), block.size(), headers);
+}
+
+static bool same(const vector<HeaderField> &got,
+                 const vector<HeaderField> &want)
+{
+    if (got.size() != want.size())
+        return false;
+    for (size_t i = 0; i < got.size(); ++i)
+    {
+        if (got[i].name != want[i].name || got[i].value != want[i].value)
+            return false;
+    }
+    return true;
+}
+
+static const vector<HeaderField> REQUEST_1 = {
+    {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+    {":authority", "www.example.com"}};
+static const vector<HeaderField> REQUEST_2 = {
+    {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+    {":authority", "www.example.com"}, {"cache-control", "no-cache"}};
+static const vector<HeaderField> REQUEST_3 = {
+    {":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"},
+    {":authority", "www.example.com"}, {"custom-key", "custom-value"}};
+
+// C.3: requests without Huffman coding, sharing one dynamic table
+static void test_requests_plain()
+{
+    HpackDecoder decoder;
+    vector<HeaderField> headers;
+
+    CHECK(decode(decoder, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+                 headers));
+    CHECK(same(headers, REQUEST_1));
+
+    CHECK(decode(decoder, "8286 84be 5808 6e6f 2d63 6163 6865", headers));
+    CHECK(same(headers, REQUEST_2));
+
+    CHECK(decode(decoder, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 "
+                          "746f 6d2d 7661 6c75 65",
+                 headers));
+    CHECK(same(headers, REQUEST_3));
+}
+
+// C.4: the same requests with Huffman-coded strings
+static void test_requests_huffman()
+{
+    HpackDecoder decoder;
+    vector<HeaderField> headers;
+
+    CHECK(decode(decoder, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", headers));
+    CHECK(same(headers, REQUEST_1));
+
+    CHECK(decode(decoder, "8286 84be 5886 a8eb 1064 9cbf", headers));
+    CHECK(same(headers, REQUEST_2));
+
+    CHECK(decode(decoder, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b "
+                          "b8e8 b4bf",
+                 headers));
+    CHECK(same(headers, REQUEST_3));
+}
+
+// C.6: responses with a 256-byte table, so entries are evicted
+static void test_responses_eviction()
+{
+    HpackDecoder decoder(256);
+    vector<HeaderField> headers;
+
+    CHECK(decode(decoder, "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 "
+                          "44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad "
+                          "1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+                 headers));
+    CHECK(same(headers, {{":status", "302"},
+                         {"cache-control", "private"},
+                         {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+                         {"location", "https://www.example.com"}}));
+
+    // ":status: 307" evicts ":status: 302"; the rest are table references
+    CHECK(decode(decoder, "4883 640e ffc1 c0bf", headers));
+    CHECK(same(headers, {{":status", "307"},
+                         {"cache-control", "private"},
+                         {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+                         {"location", "https://www.example.com"}}));
+
+    CHECK(decode(decoder, "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 "
+                          "e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 "
+                          "e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 "
+                          "0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+                 headers));
+    CHECK(same(headers, {{":status", "200"},
+                         {"cache-control", "private"},
+                         {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+                         {"location", "https://www.example.com"},
+                         {"content-encoding", "gzip"},
+                         {"set-cookie",
+                          "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}}));
+}
+
+// Padding must be a prefix of EOS (all ones) and shorter than 8 bits,
+// and EOS itself must not appear (RFC 7541 5.2)
+static void test_huffman_padding()
+{
+    string out;
+    vector<uint8_t> a = from_hex("1f"); // 'a' (00011) + 111
+    CHECK(huffman_decode(a.data(), a.size(), out) && out == "a");
+
+    vector<uint8_t> zero_padding = from_hex("18");
+    CHECK(!huffman_decode(zero_padding.data(), zero_padding.size(), out));
+
+    vector<uint8_t> long_padding = from_hex("1fff");
+    CHECK(!huffman_decode(long_padding.data(), long_padding.size(), out));
+
+    vector<uint8_t> eos = from_hex("ffff ffff");
+    CHECK(!huffman_decode(eos.data(), eos.size(), out));
+}
+
+static void test_errors()
+{
+    vector<HeaderField> headers;
+
+    // Index 62 with an empty dynamic table
+    HpackDecoder empty;
+    CHECK(!decode(empty, "be", headers));
+
+    // Table size update to 4096 above the advertised 256
+    HpackDecoder small(256);
+    CHECK(!decode(small, "3fe1 1f", headers));
+    HpackDecoder large(4096);
+    CHECK(decode(large, "3fe1 1f", headers));
+
+    // Truncated literal
+    HpackDecoder truncated;
+    CHECK(!decode(truncated, "400a 6375 7374", headers));
+}
+
+static void test_encode_round_trip()
+{
+    vector<HeaderField> fields = {{":status", "200"},
+                                  {"content-type", "text/html"},
+                                  {"x-custom", string(300, 'x')},
+                                  {"set-cookie", "a=b"}};
+    string block;
+    hpack_encode(fields, block);
+
+    HpackDecoder decoder;
+    vector<HeaderField> headers;
+    CHECK(decoder.decode(reinterpret_cast<const uint8_t *>(block.data()),
+                         block.size(), headers));
+    CHECK(same(headers, fields));
+}
+
+int main()
+{
+    test_requests_plain();
+    test_requests_huffman();
+    test_responses_eviction();
+    test_huffman_padding();
+    test_errors();
+    test_encode_round_trip();
+
+    return check_report("test_hpack");
+}
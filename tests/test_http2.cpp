@@ -0,0 +1,199 @@
+// HTTP/2 connection-level flow control checks: a session is run over a
+// socketpair and fed raw frames.
+
+#include "http2.h"
+#include "check.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const char CLIENT_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static const uint8_t FRAME_SETTINGS = 4;
+static const uint8_t FRAME_PING = 6;
+static const uint8_t FRAME_GOAWAY = 7;
+static const uint8_t FRAME_WINDOW_UPDATE = 8;
+static const uint8_t FLAG_ACK = 0x1;
+
+static const uint32_t NO_ERROR = 0x0;
+static const uint32_t PROTOCOL_ERROR = 0x1;
+static const uint32_t FLOW_CONTROL_ERROR = 0x3;
+
+static const uint32_t DEFAULT_WINDOW = 65535;
+static const uint32_t MAX_WINDOW = 0x7fffffff;
+
+static void put32(string &out, uint32_t v)
+{
+    out += static_cast<char>(v >> 24);
+    out += static_cast<char>(v >> 16);
+    out += static_cast<char>(v >> 8);
+    out += static_cast<char>(v);
+}
+
+static uint32_t get32(const string &in, size_t pos)
+{
+    return (uint32_t(uint8_t(in[pos])) << 24) | (uint32_t(uint8_t(in[pos + 1])) << 16) |
+           (uint32_t(uint8_t(in[pos + 2])) << 8) | uint8_t(in[pos + 3]);
+}
+
+static string frame(uint8_t type, uint8_t flags, uint32_t id, const string &payload)
+{
+    string out;
+    out += static_cast<char>(payload.size() >> 16);
+    out += static_cast<char>(payload.size() >> 8);
+    out += static_cast<char>(payload.size());
+    out += static_cast<char>(type);
+    out += static_cast<char>(flags);
+    put32(out, id);
+    return out + payload;
+}
+
+static string window_update(uint32_t id, uint32_t increment)
+{
+    string payload;
+    put32(payload, increment);
+    return frame(FRAME_WINDOW_UPDATE, 0, id, payload);
+}
+
+static string settings(uint16_t id, uint32_t value)
+{
+    string payload;
+    payload += static_cast<char>(id >> 8);
+    payload += static_cast<char>(id);
+    put32(payload, value);
+    return frame(FRAME_SETTINGS, 0, 0, payload);
+}
+
+struct SessionResult
+{
+    bool closed = false;     // the session ended and closed the socket
+    bool goaway = false;
+    uint32_t error = 0;      // GOAWAY error code
+    bool ping_acked = false;
+};
+
+// Runs a session, sends the preface and frames, and collects what the
+// server answers until it closes the connection
+static SessionResult run_session(const string &frames)
+{
+    SessionResult result;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return result;
+
+    Task task;
+    task.client_fd = fds[0];
+    task.client_ip = "127.0.0.1";
+    task.client_port = 40000;
+
+    HttpRequest req;
+    req.method = "PRI";
+    req.version = "2.0";
+
+    thread server([&task, &req] { serve_http2(task, req); });
+
+    string out = string(CLIENT_PREFACE) + frame(FRAME_SETTINGS, 0, 0, "") + frames;
+    send(fds[1], out.data(), out.size(), MSG_NOSIGNAL);
+
+    string in;
+    char buffer[4096];
+    pollfd pfd = {fds[1], POLLIN, 0};
+    while (poll(&pfd, 1, 5000) > 0)
+    {
+        ssize_t n = recv(fds[1], buffer, sizeof(buffer), 0);
+        if (n <= 0)
+        {
+            result.closed = n == 0;
+            break;
+        }
+        in.append(buffer, n);
+    }
+
+    if (!result.closed)
+        shutdown(fds[1], SHUT_RDWR); // let a stuck session end
+    server.join();
+    close(fds[1]);
+
+    for (size_t pos = 0; pos + 9 <= in.size();)
+    {
+        size_t len = (uint8_t(in[pos]) << 16) | (uint8_t(in[pos + 1]) << 8) |
+                     uint8_t(in[pos + 2]);
+        uint8_t type = in[pos + 3];
+        uint8_t flags = in[pos + 4];
+        if (pos + 9 + len > in.size())
+            break;
+        if (type == FRAME_GOAWAY && len >= 8)
+        {
+            result.goaway = true;
+            result.error = get32(in, pos + 13);
+        }
+        if (type == FRAME_PING && (flags & FLAG_ACK))
+            result.ping_acked = true;
+        pos += 9 + len;
+    }
+    return result;
+}
+
+static const string PING = frame(FRAME_PING, 0, 0, string(8, 'p'));
+static const string GOAWAY = frame(FRAME_GOAWAY, 0, 0, string(8, '\0'));
+
+static void test_window_up_to_limit()
+{
+    // Reaching exactly 2^31-1 is allowed; the session keeps serving
+    SessionResult r = run_session(window_update(0, MAX_WINDOW - DEFAULT_WINDOW) +
+                                  PING + GOAWAY);
+    CHECK(r.closed);
+    CHECK(r.ping_acked);
+    CHECK(r.goaway && r.error == NO_ERROR);
+}
+
+static void test_window_overflow()
+{
+    SessionResult r = run_session(window_update(0, MAX_WINDOW - DEFAULT_WINDOW) +
+                                  window_update(0, 1) + PING);
+    CHECK(r.closed);
+    CHECK(!r.ping_acked);
+    CHECK(r.goaway && r.error == FLOW_CONTROL_ERROR);
+
+    r = run_session(window_update(0, MAX_WINDOW));
+    CHECK(r.goaway && r.error == FLOW_CONTROL_ERROR);
+}
+
+static void test_zero_increment()
+{
+    SessionResult r = run_session(window_update(0, 0));
+    CHECK(r.closed);
+    CHECK(r.goaway && r.error == PROTOCOL_ERROR);
+}
+
+static void test_initial_window_setting()
+{
+    const uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+
+    SessionResult r = run_session(settings(SETTINGS_INITIAL_WINDOW_SIZE, MAX_WINDOW) +
+                                  PING + GOAWAY);
+    CHECK(r.ping_acked);
+    CHECK(r.goaway && r.error == NO_ERROR);
+
+    r = run_session(settings(SETTINGS_INITIAL_WINDOW_SIZE, MAX_WINDOW + 1u));
+    CHECK(r.closed);
+    CHECK(r.goaway && r.error == FLOW_CONTROL_ERROR);
+}
+
+int main()
+{
+    test_window_up_to_limit();
+    test_window_overflow();
+    test_zero_increment();
+    test_initial_window_setting();
+
+    return check_report("test_http2");
+}
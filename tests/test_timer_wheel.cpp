@@ -0,0 +1,110 @@
+// Timer wheel expiry and cascade checks.
+
+#include "timer_wheel.h"
+#include "check.h"
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// Inserts one timer per delay and advances tick by tick; each must fire
+// exactly on its own tick, including those cascaded down from upper levels
+static void check_fires_on_time(uint64_t start, const vector<uint64_t> &delays)
+{
+    TimerWheel wheel(start);
+    vector<TimerNode> nodes(delays.size());
+    uint64_t last = start;
+    for (size_t i = 0; i < delays.size(); ++i)
+    {
+        wheel.insert(&nodes[i], start + delays[i]);
+        last = max(last, start + delays[i]);
+    }
+
+    vector<uint64_t> fired_at(delays.size(), 0);
+    vector<TimerNode *> expired;
+    for (uint64_t tick = start + 1; tick <= last; ++tick)
+    {
+        expired.clear();
+        wheel.advance(tick, expired);
+        for (TimerNode *node : expired)
+        {
+            CHECK(!node->linked);
+            fired_at[node - nodes.data()] = tick;
+        }
+    }
+
+    for (size_t i = 0; i < delays.size(); ++i)
+    {
+        if (fired_at[i] != start + delays[i])
+        {
+            cerr << "  start " << start << " delay " << delays[i]
+                 << " fired at " << fired_at[i] << endl;
+        }
+        CHECK(fired_at[i] == start + delays[i]);
+    }
+}
+
+static void test_levels_and_cascades()
+{
+    vector<uint64_t> delays = {1, 2, 63, 64, 65, 127, 128, 4095, 4096,
+                               4097, 5000, 262143, 262144, 262145, 300000};
+    check_fires_on_time(0, delays);
+    check_fires_on_time(1, delays);
+    check_fires_on_time(63, delays);
+    check_fires_on_time(4095, delays);
+    check_fires_on_time(1000003, delays);
+}
+
+static void test_past_and_cancel()
+{
+    TimerWheel wheel(100);
+    TimerNode past, cancelled, rearmed;
+
+    // Already due: fires on the next tick rather than being lost
+    wheel.insert(&past, 50);
+    wheel.insert(&cancelled, 101);
+    wheel.cancel(&cancelled);
+    CHECK(!cancelled.linked);
+
+    // Inserting a linked node moves it
+    wheel.insert(&rearmed, 101);
+    wheel.insert(&rearmed, 200);
+
+    vector<TimerNode *> expired;
+    wheel.advance(101, expired);
+    CHECK(expired.size() == 1 && expired[0] == &past);
+
+    expired.clear();
+    wheel.advance(199, expired);
+    CHECK(expired.empty());
+    wheel.advance(200, expired);
+    CHECK(expired.size() == 1 && expired[0] == &rearmed);
+}
+
+static void test_clamped_to_range()
+{
+    // Beyond the wheel's range the timer fires at the edge; the owner
+    // compares the deadline and re-arms
+    const uint64_t range = 1ULL << (TimerWheel::SLOT_BITS * TimerWheel::LEVELS);
+    TimerWheel wheel(0);
+    TimerNode node;
+    wheel.insert(&node, range * 3);
+    CHECK(node.expires == range - 1);
+
+    vector<TimerNode *> expired;
+    wheel.advance(range - 2, expired);
+    CHECK(expired.empty());
+    wheel.advance(range - 1, expired);
+    CHECK(expired.size() == 1);
+}
+
+int main()
+{
+    test_levels_and_cascades();
+    test_past_and_cancel();
+    test_clamped_to_range();
+
+    return check_report("test_timer_wheel");
+}
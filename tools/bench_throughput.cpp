@@ -0,0 +1,199 @@
+// Relay throughput benchmark.
+//
+// Starts a local origin stub that answers "GET /<bytes>" with an object of
+// that size, then fetches each object size through the proxy via a CONNECT
+// tunnel and reports throughput and latency.
+//
+// Usage: ./bench_throughput [proxy_host] [proxy_port] [iterations]
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static bool send_all(int fd, const char *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+static void serve_origin_client(int fd)
+{
+    char req[1024];
+    ssize_t n = recv(fd, req, sizeof(req) - 1, 0);
+    if (n <= 0)
+    {
+        close(fd);
+        return;
+    }
+    req[n] = '\0';
+
+    size_t size = strtoull(req + 5, nullptr, 10); // "GET /<size>"
+    string header = "HTTP/1.0 200 OK\r\nContent-Length: " +
+                    to_string(size) + "\r\n\r\n";
+    send_all(fd, header.data(), header.size());
+
+    vector<char> chunk(64 * 1024, 'x');
+    while (size > 0)
+    {
+        size_t len = min(size, chunk.size());
+        if (!send_all(fd, chunk.data(), len))
+            break;
+        size -= len;
+    }
+    close(fd);
+}
+
+static int start_origin(int &port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0)
+    {
+        perror("origin");
+        exit(1);
+    }
+
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr *)&addr, &len);
+    port = ntohs(addr.sin_port);
+
+    thread([fd]
+           {
+               while (true)
+               {
+                   int c = accept(fd, nullptr, nullptr);
+                   if (c < 0)
+                       continue;
+                   thread(serve_origin_client, c).detach();
+               } })
+        .detach();
+
+    return fd;
+}
+
+// Returns bytes received, or 0 on failure
+static size_t fetch(const string &proxy_host, int proxy_port,
+                    int origin_port, size_t size)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(proxy_port);
+    inet_pton(AF_INET, proxy_host.c_str(), &addr.sin_addr);
+
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    string connect_req = "CONNECT 127.0.0.1:" + to_string(origin_port) +
+                         " HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    send_all(fd, connect_req.data(), connect_req.size());
+
+    // Read the "200 Connection Established" reply
+    string reply;
+    char c;
+    while (reply.find("\r\n\r\n") == string::npos && recv(fd, &c, 1, 0) == 1)
+        reply += c;
+
+    string get = "GET /" + to_string(size) + " HTTP/1.0\r\n\r\n";
+    send_all(fd, get.data(), get.size());
+
+    vector<char> buf(256 * 1024);
+    size_t total = 0;
+    while (true)
+    {
+        ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+
+    close(fd);
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    string proxy_host = argc > 1 ? argv[1] : "127.0.0.1";
+    int proxy_port = argc > 2 ? atoi(argv[2]) : 8080;
+    int iterations = argc > 3 ? atoi(argv[3]) : 20;
+
+    if (iterations < 1)
+    {
+        cerr << "[ERROR] iterations must be at least 1" << endl;
+        return 1;
+    }
+
+    int origin_port = 0;
+    start_origin(origin_port);
+
+    const size_t sizes[] = {1024, 16 * 1024, 256 * 1024,
+                            4 * 1024 * 1024, 32 * 1024 * 1024};
+
+    printf("%12s %12s %12s %12s\n",
+           "object", "MB/s", "p50_ms", "p99_ms");
+
+    for (size_t size : sizes)
+    {
+        vector<double> latencies;
+        size_t bytes = 0;
+        auto start = chrono::steady_clock::now();
+
+        for (int i = 0; i < iterations; ++i)
+        {
+            auto t0 = chrono::steady_clock::now();
+            size_t got = fetch(proxy_host, proxy_port, origin_port, size);
+            auto t1 = chrono::steady_clock::now();
+
+            if (got < size)
+            {
+                cerr << "[ERROR] short read for object size "
+                     << size << endl;
+                return 1;
+            }
+            bytes += got;
+            latencies.push_back(
+                chrono::duration<double, milli>(t1 - t0).count());
+        }
+
+        double secs = chrono::duration<double>(
+                          chrono::steady_clock::now() - start)
+                          .count();
+        sort(latencies.begin(), latencies.end());
+
+        printf("%12zu %12.1f %12.3f %12.3f\n",
+               size,
+               bytes / secs / (1024.0 * 1024.0),
+               latencies[latencies.size() / 2],
+               latencies[latencies.size() * 99 / 100]);
+    }
+
+    return 0;
+}
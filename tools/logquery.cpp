@@ -0,0 +1,447 @@
+// Offline query tool for binary access log segments.
+//
+// Maps each segment read-only and scans its fixed-size records, so large
+// logs are aggregated without parsing text or copying files into memory.
+//
+// Usage: ./logquery [--from TIME] [--to TIME] <command> [N] <dir|segment>...
+//
+// TIME is unix seconds or "YYYY-MM-DD HH:MM:SS" (local time).
+// Commands:
+//   summary          request counts, outcomes and bytes
+//   top-hosts [N]    hosts by request count (default 10)
+//   bytes-by-client [N]  clients by bytes relayed (default 10)
+//   blocked          requests denied by the blocklist, one per line
+//
+// With --from/--to, segments whose records all fall outside the window
+// are skipped without being mapped.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "access_log_format.h"
+
+using namespace std;
+
+enum Command
+{
+    CMD_NONE,
+    CMD_SUMMARY,
+    CMD_TOP_HOSTS,
+    CMD_BYTES_BY_CLIENT,
+    CMD_BLOCKED
+};
+
+// Resolved once from the command line so records are not matched by name
+struct Query
+{
+    Command command = CMD_NONE;
+    size_t limit = 10;
+    uint64_t from_us = 0;
+    uint64_t to_us = UINT64_MAX;
+};
+
+struct Totals
+{
+    uint64_t requests = 0;
+    uint64_t allowed = 0;
+    uint64_t blocked = 0;
+    uint64_t rate_limited = 0;
+    uint64_t unavailable = 0;
+    uint64_t bytes = 0;
+    uint64_t first_us = UINT64_MAX;
+    uint64_t last_us = 0;
+    uint64_t skipped_segments = 0;
+};
+
+struct Counter
+{
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+};
+
+static Totals totals;
+static unordered_map<string, Counter> by_host;
+static unordered_map<uint32_t, Counter> by_client; // network byte order
+
+static bool parse_time(const string &text, uint64_t &out_us)
+{
+    char *end = nullptr;
+    unsigned long long secs = strtoull(text.c_str(), &end, 10);
+    if (end && *end == '\0' && !text.empty())
+    {
+        out_us = secs * 1000000ULL;
+        return true;
+    }
+
+    struct tm tm{};
+    if (!strptime(text.c_str(), "%Y-%m-%d %H:%M:%S", &tm))
+        return false;
+    tm.tm_isdst = -1;
+
+    out_us = static_cast<uint64_t>(mktime(&tm)) * 1000000ULL;
+    return true;
+}
+
+static string format_time(uint64_t us)
+{
+    time_t secs = us / 1000000;
+    struct tm tm{};
+    localtime_r(&secs, &tm);
+
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    return buf;
+}
+
+static Command parse_command(const string &name)
+{
+    if (name == "summary")
+        return CMD_SUMMARY;
+    if (name == "top-hosts")
+        return CMD_TOP_HOSTS;
+    if (name == "bytes-by-client")
+        return CMD_BYTES_BY_CLIENT;
+    if (name == "blocked")
+        return CMD_BLOCKED;
+    return CMD_NONE;
+}
+
+// Row labels for print_top(); clients are kept as raw addresses and only
+// formatted for the rows printed
+static const string &key_name(const string &host)
+{
+    return host;
+}
+
+static string key_name(uint32_t client_ip)
+{
+    char buf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_ip, buf, sizeof(buf));
+    return buf;
+}
+
+static void visit(const Query &q, const AccessRecord &rec, const string &host)
+{
+    if (rec.timestamp_us < q.from_us || rec.timestamp_us >= q.to_us)
+        return;
+
+    totals.requests++;
+    totals.bytes += rec.bytes;
+    totals.first_us = min(totals.first_us, rec.timestamp_us);
+    totals.last_us = max(totals.last_us, rec.timestamp_us);
+
+    if (rec.outcome == OUTCOME_BLOCKED)
+        totals.blocked++;
+    else if (rec.outcome == OUTCOME_RATE_LIMITED)
+        totals.rate_limited++;
+    else if (rec.outcome == OUTCOME_UNAVAILABLE)
+        totals.unavailable++;
+    else
+        totals.allowed++;
+
+    if (q.command == CMD_TOP_HOSTS)
+    {
+        Counter &c = by_host[host];
+        c.requests++;
+        c.bytes += rec.bytes;
+    }
+    else if (q.command == CMD_BYTES_BY_CLIENT)
+    {
+        Counter &c = by_client[rec.client_ip];
+        c.requests++;
+        c.bytes += rec.bytes;
+    }
+    else if (q.command == CMD_BLOCKED && rec.outcome == OUTCOME_BLOCKED)
+    {
+        printf("%s %s:%u %s %s:%u %s %u\n",
+               format_time(rec.timestamp_us).c_str(),
+               key_name(rec.client_ip).c_str(), rec.client_port,
+               method_name(rec.method), host.c_str(), rec.port,
+               outcome_name(rec.outcome),
+               rec.status);
+    }
+}
+
+// Record timestamps are taken before the writer's lock, so a segment may
+// start with records slightly older than its first one
+static const uint64_t ORDER_SLACK_US = 1000000;
+
+// True when no record of the segment can fall inside the query window.
+// Every record was written before the file's last modification, and the
+// first access record follows at most one host record.
+static bool outside_range(const Query &q, int fd, const struct stat &st)
+{
+    uint64_t last_us = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000ULL +
+                       st.st_mtim.tv_nsec / 1000;
+    if (last_us < q.from_us)
+        return true;
+
+    char head[sizeof(SegmentHeader) + sizeof(HostRecord) + 255 +
+              sizeof(AccessRecord)];
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    if (n < static_cast<ssize_t>(sizeof(SegmentHeader)))
+        return false;
+
+    size_t offset = sizeof(SegmentHeader);
+    if (offset < static_cast<size_t>(n) && head[offset] == RECORD_HOST &&
+        offset + sizeof(HostRecord) <= static_cast<size_t>(n))
+    {
+        HostRecord rec;
+        memcpy(&rec, head + offset, sizeof(rec));
+        offset += sizeof(rec) + rec.name_length;
+    }
+
+    if (offset + sizeof(AccessRecord) > static_cast<size_t>(n) ||
+        head[offset] != RECORD_ACCESS)
+        return false;
+
+    AccessRecord rec;
+    memcpy(&rec, head + offset, sizeof(rec));
+    return q.to_us <= UINT64_MAX - ORDER_SLACK_US &&
+           rec.timestamp_us >= q.to_us + ORDER_SLACK_US;
+}
+
+static bool scan_segment(const Query &q, const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        cerr << "[ERROR] Cannot open " << path << endl;
+        return false;
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SegmentHeader))
+    {
+        close(fd);
+        cerr << "[ERROR] Not an access log segment: " << path << endl;
+        return false;
+    }
+
+    if ((q.from_us > 0 || q.to_us < UINT64_MAX) && outside_range(q, fd, st))
+    {
+        close(fd);
+        totals.skipped_segments++;
+        return true;
+    }
+
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        cerr << "[ERROR] Cannot map " << path << endl;
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char *base = static_cast<const char *>(map);
+    SegmentHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != ACCESS_LOG_VERSION)
+    {
+        munmap(map, size);
+        cerr << "[ERROR] Not an access log segment: " << path << endl;
+        return false;
+    }
+
+    vector<string> hosts;
+    size_t offset = sizeof(header);
+
+    // A segment still being written may end in a partial record; stop there
+    while (offset < size)
+    {
+        uint8_t type = base[offset];
+
+        if (type == RECORD_ACCESS)
+        {
+            if (offset + sizeof(AccessRecord) > size)
+                break;
+
+            AccessRecord rec;
+            memcpy(&rec, base + offset, sizeof(rec));
+            offset += sizeof(rec);
+
+            static const string unknown = "?";
+            visit(q, rec, rec.host_id < hosts.size() ? hosts[rec.host_id]
+                                                     : unknown);
+        }
+        else if (type == RECORD_HOST)
+        {
+            HostRecord rec;
+            if (offset + sizeof(rec) > size)
+                break;
+            memcpy(&rec, base + offset, sizeof(rec));
+            offset += sizeof(rec);
+
+            if (offset + rec.name_length > size)
+                break;
+            if (rec.host_id >= hosts.size())
+                hosts.resize(rec.host_id + 1);
+            hosts[rec.host_id].assign(base + offset, rec.name_length);
+            offset += rec.name_length;
+        }
+        else
+        {
+            cerr << "[ERROR] Corrupt record in " << path
+                 << " at offset " << offset << endl;
+            break;
+        }
+    }
+
+    munmap(map, size);
+    return true;
+}
+
+static void collect_segments(const string &path, vector<string> &out)
+{
+    struct stat st{};
+    if (stat(path.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+    {
+        out.push_back(path);
+        return;
+    }
+
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+        return;
+
+    vector<string> found;
+    while (dirent *entry = readdir(dir))
+    {
+        string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0)
+            found.push_back(path + "/" + name);
+    }
+    closedir(dir);
+
+    sort(found.begin(), found.end());
+    out.insert(out.end(), found.begin(), found.end());
+}
+
+template <typename Key>
+static void print_top(const unordered_map<Key, Counter> &counters,
+                      size_t limit, bool by_bytes, const char *label)
+{
+    vector<pair<Key, Counter>> rows(counters.begin(), counters.end());
+    sort(rows.begin(), rows.end(),
+         [by_bytes](const pair<Key, Counter> &a,
+                    const pair<Key, Counter> &b)
+         {
+             return by_bytes ? a.second.bytes > b.second.bytes
+                             : a.second.requests > b.second.requests;
+         });
+
+    if (rows.size() > limit)
+        rows.resize(limit);
+
+    printf("%-40s %12s %16s\n", label, "requests", "bytes");
+    for (const auto &row : rows)
+        printf("%-40s %12llu %16llu\n", key_name(row.first).c_str(),
+               (unsigned long long)row.second.requests,
+               (unsigned long long)row.second.bytes);
+}
+
+static void usage()
+{
+    cerr << "Usage: ./logquery [--from TIME] [--to TIME] "
+            "summary|top-hosts [N]|bytes-by-client [N]|blocked "
+            "<dir|segment>..."
+         << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    Query q;
+    vector<string> inputs;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+
+        if ((arg == "--from" || arg == "--to") && i + 1 < argc)
+        {
+            uint64_t &bound = arg == "--from" ? q.from_us : q.to_us;
+            if (!parse_time(argv[++i], bound))
+            {
+                cerr << "[ERROR] Bad time: " << argv[i] << endl;
+                return 1;
+            }
+        }
+        else if (q.command == CMD_NONE)
+        {
+            q.command = parse_command(arg);
+            if (q.command == CMD_NONE)
+            {
+                usage();
+                return 1;
+            }
+            if ((q.command == CMD_TOP_HOSTS ||
+                 q.command == CMD_BYTES_BY_CLIENT) &&
+                i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+                q.limit = strtoul(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            collect_segments(arg, inputs);
+        }
+    }
+
+    if (q.command == CMD_NONE)
+    {
+        usage();
+        return 1;
+    }
+
+    if (inputs.empty())
+        collect_segments("config/logs/access", inputs);
+
+    for (const auto &path : inputs)
+        scan_segment(q, path);
+
+    if (q.command == CMD_SUMMARY)
+    {
+        printf("segments:      %zu\n", inputs.size());
+        if (totals.skipped_segments > 0)
+            printf("skipped:       %llu (outside --from/--to)\n",
+                   (unsigned long long)totals.skipped_segments);
+        printf("requests:      %llu\n", (unsigned long long)totals.requests);
+        printf("allowed:       %llu\n", (unsigned long long)totals.allowed);
+        printf("blocked:       %llu\n", (unsigned long long)totals.blocked);
+        printf("rate_limited:  %llu\n",
+               (unsigned long long)totals.rate_limited);
+        printf("unavailable:   %llu\n",
+               (unsigned long long)totals.unavailable);
+        printf("bytes:         %llu\n", (unsigned long long)totals.bytes);
+        if (totals.requests > 0)
+        {
+            printf("first:         %s\n", format_time(totals.first_us).c_str());
+            printf("last:          %s\n", format_time(totals.last_us).c_str());
+        }
+    }
+    else if (q.command == CMD_TOP_HOSTS)
+    {
+        print_top(by_host, q.limit, false, "host");
+    }
+    else if (q.command == CMD_BYTES_BY_CLIENT)
+    {
+        print_top(by_client, q.limit, true, "client");
+    }
+
+    return 0;
+}
@@ -0,0 +1,623 @@
+// Deterministic replay of a traffic capture.
+//
+// Reads a capture written by the proxy (capture_file in proxy.conf) and
+// re-issues every request through the proxy at its captured offset, with
+// the captured method, request header and body sizes, response size,
+// origin think time and CONNECT duration. Responses come from a built-in
+// origin stub, so no real origin is contacted.
+//
+// By default requests go to the stub as 127.0.0.1:<origin port>. With
+// --keep-hosts the captured host and port are used instead; run the proxy
+// in reverse-proxy mode with a "*" pool pointing at --origin-port so they
+// still reach the stub while blocklist and per-host behaviour see the
+// real names.
+//
+// Usage: ./replay [--proxy HOST:PORT] [--speed X] [--concurrency N]
+//                 [--origin-port N] [--keep-hosts] [--limit N] <capture>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "access_log_format.h"
+#include "capture_format.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct Entry
+{
+    CaptureRecord rec;
+    string host;
+};
+
+struct Options
+{
+    string proxy_host = "127.0.0.1";
+    int proxy_port = 8080;
+    double speed = 1.0;
+    size_t concurrency = 256;
+    int origin_port = 0; // 0 = any free port
+    bool keep_hosts = false;
+    size_t limit = 0;    // 0 = whole capture
+    string path;
+};
+
+struct Result
+{
+    bool ok = false;
+    int status = 0;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t latency_us = 0;
+    uint64_t late_us = 0; // started this long after its scheduled time
+};
+
+static bool send_all(int fd, const char *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Sends len filler bytes
+static bool send_fill(int fd, uint64_t len)
+{
+    static const vector<char> chunk(64 * 1024, 'x');
+    while (len > 0)
+    {
+        size_t n = min<uint64_t>(len, chunk.size());
+        if (!send_all(fd, chunk.data(), n))
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+// Reads and discards len bytes; false if the peer closes first
+static bool recv_discard(int fd, uint64_t len)
+{
+    char buf[64 * 1024];
+    while (len > 0)
+    {
+        ssize_t n = recv(fd, buf, min<uint64_t>(len, sizeof(buf)), 0);
+        if (n <= 0)
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+// Reads up to and including the blank line ending a header block; any
+// bytes after it are returned in rest
+static bool recv_header(int fd, string &header, string &rest,
+                        const char *end = "\r\n\r\n")
+{
+    char buf[4096];
+    while (header.find(end) == string::npos)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0 || header.size() > 64 * 1024)
+            return false;
+        header.append(buf, n);
+    }
+
+    size_t cut = header.find(end) + strlen(end);
+    rest = header.substr(cut);
+    header.resize(cut);
+    return true;
+}
+
+static uint64_t header_number(const string &header, const string &name)
+{
+    size_t pos = header.find("\r\n" + name + ":");
+    if (pos == string::npos)
+        return 0;
+    return strtoull(header.c_str() + pos + name.size() + 3, nullptr, 10);
+}
+
+// Tunnelled traffic starts with "REPLAY <up> <down>\n": the stub reads <up>
+// bytes, answers with <down> bytes and holds the connection until the
+// client closes it. Anything else is an HTTP request whose X-Replay-*
+// headers give the think time and the total response size.
+static void serve_stub_client(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    string header, rest;
+    char first[7] = {};
+    ssize_t peeked = recv(fd, first, 7, MSG_PEEK | MSG_WAITALL);
+
+    if (peeked == 7 && memcmp(first, "REPLAY ", 7) == 0)
+    {
+        if (recv_header(fd, header, rest, "\n"))
+        {
+            unsigned long long up = 0, down = 0;
+            sscanf(header.c_str(), "REPLAY %llu %llu", &up, &down);
+            if (up <= rest.size() || recv_discard(fd, up - rest.size()))
+            {
+                send_fill(fd, down);
+                char c;
+                while (recv(fd, &c, 1, 0) > 0)
+                {
+                }
+            }
+        }
+        close(fd);
+        return;
+    }
+
+    if (!recv_header(fd, header, rest))
+    {
+        close(fd);
+        return;
+    }
+
+    uint64_t body = header_number(header, "Content-Length");
+    if (body > rest.size())
+        recv_discard(fd, body - rest.size());
+
+    uint64_t delay_us = header_number(header, "X-Replay-Delay-Us");
+    if (delay_us > 0)
+        this_thread::sleep_for(chrono::microseconds(delay_us));
+
+    // Size the body so header plus body match the captured response
+    uint64_t total = header_number(header, "X-Replay-Response");
+    auto reply_header = [](uint64_t length)
+    {
+        return "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n"
+               "Content-Length: " + to_string(length) + "\r\n\r\n";
+    };
+
+    uint64_t length = 0;
+    for (int i = 0; i < 3; ++i) // settles once the digit count stops changing
+    {
+        size_t head_size = reply_header(length).size();
+        length = total > head_size ? total - head_size : 0;
+    }
+    string reply = reply_header(length);
+
+    bool head = header.compare(0, 5, "HEAD ") == 0;
+    if (send_all(fd, reply.data(), reply.size()) && !head)
+        send_fill(fd, length);
+    close(fd);
+}
+
+static int start_stub(int &port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0)
+    {
+        perror("origin stub");
+        exit(1);
+    }
+
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr *)&addr, &len);
+    port = ntohs(addr.sin_port);
+
+    thread([fd]
+           {
+               while (true)
+               {
+                   int c = accept(fd, nullptr, nullptr);
+                   if (c < 0)
+                       continue;
+                   thread(serve_stub_client, c).detach();
+               } })
+        .detach();
+
+    return fd;
+}
+
+static int connect_proxy(const Options &opt)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.proxy_port);
+    inet_pton(AF_INET, opt.proxy_host.c_str(), &addr.sin_addr);
+
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Header, body and tunnel preamble go out as separate small writes
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Pads a header block (without its final blank line) to the captured size
+static string finish_header(string header, uint32_t captured_bytes)
+{
+    const string pad_name = "X-Replay-Pad: ";
+    size_t minimum = header.size() + pad_name.size() + 4;
+    if (captured_bytes > minimum)
+        header += pad_name + string(captured_bytes - minimum, 'p') + "\r\n";
+    return header + "\r\n";
+}
+
+static int parse_status(const string &header)
+{
+    size_t sp = header.find(' ');
+    return sp == string::npos ? 0 : atoi(header.c_str() + sp + 1);
+}
+
+static void run_http(const Options &opt, const Entry &e, const string &target,
+                     Result &r)
+{
+    int fd = connect_proxy(opt);
+    if (fd < 0)
+        return;
+
+    string method = e.rec.method == METHOD_OTHER ? "GET"
+                                                 : method_name(e.rec.method);
+    uint64_t delay_us = e.rec.first_byte_us / opt.speed;
+
+    string header = finish_header(
+        method + " http://" + target + "/replay HTTP/1.1\r\n"
+                                       "Host: " + target + "\r\n"
+                                       "Connection: close\r\n"
+                                       "X-Replay-Response: " + to_string(e.rec.response_bytes) + "\r\n"
+                                       "X-Replay-Delay-Us: " + to_string(delay_us) + "\r\n"
+                                       "Content-Length: " + to_string(e.rec.request_bytes) + "\r\n",
+        e.rec.header_bytes);
+
+    if (send_all(fd, header.data(), header.size()) &&
+        send_fill(fd, e.rec.request_bytes))
+    {
+        r.sent = header.size() + e.rec.request_bytes;
+
+        string reply, rest;
+        if (recv_header(fd, reply, rest))
+        {
+            r.status = parse_status(reply);
+            r.received = reply.size() + rest.size();
+
+            char buf[64 * 1024];
+            ssize_t n;
+            while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+                r.received += n;
+            r.ok = r.status / 100 == 2;
+        }
+    }
+    close(fd);
+}
+
+static void run_connect(const Options &opt, const Entry &e,
+                        const string &target, Clock::time_point started,
+                        Result &r)
+{
+    int fd = connect_proxy(opt);
+    if (fd < 0)
+        return;
+
+    string header = finish_header("CONNECT " + target + " HTTP/1.1\r\n"
+                                                        "Host: " + target + "\r\n",
+                                  e.rec.header_bytes);
+    string reply, rest;
+    if (!send_all(fd, header.data(), header.size()) ||
+        !recv_header(fd, reply, rest))
+    {
+        close(fd);
+        return;
+    }
+
+    r.status = parse_status(reply);
+    if (r.status != 200)
+    {
+        close(fd);
+        return;
+    }
+
+    string hello = "REPLAY " + to_string(e.rec.request_bytes) + " " +
+                   to_string(e.rec.response_bytes) + "\n";
+    if (send_all(fd, hello.data(), hello.size()) &&
+        send_fill(fd, e.rec.request_bytes) &&
+        recv_discard(fd, e.rec.response_bytes))
+    {
+        r.sent = header.size() + hello.size() + e.rec.request_bytes;
+        r.received = reply.size() + e.rec.response_bytes;
+        r.ok = true;
+
+        // Keep the tunnel open as long as the captured one was
+        auto hold_until = started + chrono::microseconds(
+                                        (uint64_t)(e.rec.duration_us / opt.speed));
+        this_thread::sleep_until(hold_until);
+    }
+    close(fd);
+}
+
+static bool load_capture(const string &path, vector<Entry> &entries)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        cerr << "[ERROR] Cannot open " << path << endl;
+        return false;
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(CaptureHeader))
+    {
+        close(fd);
+        cerr << "[ERROR] Not a capture file: " << path << endl;
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        cerr << "[ERROR] Cannot map " << path << endl;
+        return false;
+    }
+
+    const char *base = static_cast<const char *>(map);
+    CaptureHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CAPTURE_VERSION)
+    {
+        munmap(map, size);
+        cerr << "[ERROR] Not a capture file: " << path << endl;
+        return false;
+    }
+
+    // A capture still being written may end in a partial record
+    size_t offset = sizeof(header);
+    while (offset + sizeof(CaptureRecord) <= size)
+    {
+        Entry e;
+        memcpy(&e.rec, base + offset, sizeof(e.rec));
+        offset += sizeof(e.rec);
+        if (offset + e.rec.host_length > size)
+            break;
+        e.host.assign(base + offset, e.rec.host_length);
+        offset += e.rec.host_length;
+        entries.push_back(move(e));
+    }
+
+    munmap(map, size);
+
+    // Records are written as requests end; replay in arrival order
+    stable_sort(entries.begin(), entries.end(),
+                [](const Entry &a, const Entry &b)
+                { return a.rec.start_us < b.rec.start_us; });
+    return true;
+}
+
+static double percentile_ms(vector<uint64_t> &values, double p)
+{
+    if (values.empty())
+        return 0;
+    sort(values.begin(), values.end());
+    size_t i = min(values.size() - 1, (size_t)(values.size() * p));
+    return values[i] / 1000.0;
+}
+
+static void print_latencies(const char *label, vector<uint64_t> replayed,
+                            vector<uint64_t> captured)
+{
+    if (replayed.empty())
+        return;
+
+    printf("%-10s %8zu  replayed p50 %9.2f p90 %9.2f p99 %9.2f ms"
+           "  | captured p50 %9.2f p90 %9.2f p99 %9.2f ms\n",
+           label, replayed.size(),
+           percentile_ms(replayed, 0.50), percentile_ms(replayed, 0.90),
+           percentile_ms(replayed, 0.99),
+           percentile_ms(captured, 0.50), percentile_ms(captured, 0.90),
+           percentile_ms(captured, 0.99));
+}
+
+static void usage()
+{
+    cerr << "Usage: ./replay [--proxy HOST:PORT] [--speed X] "
+            "[--concurrency N] [--origin-port N] [--keep-hosts] "
+            "[--limit N] <capture>"
+         << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--proxy" && has_value)
+        {
+            string value = argv[++i];
+            size_t colon = value.rfind(':');
+            if (colon == string::npos)
+            {
+                usage();
+                return 1;
+            }
+            opt.proxy_host = value.substr(0, colon);
+            opt.proxy_port = atoi(value.c_str() + colon + 1);
+        }
+        else if (arg == "--speed" && has_value)
+            opt.speed = atof(argv[++i]);
+        else if (arg == "--concurrency" && has_value)
+            opt.concurrency = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--origin-port" && has_value)
+            opt.origin_port = atoi(argv[++i]);
+        else if (arg == "--limit" && has_value)
+            opt.limit = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--keep-hosts")
+            opt.keep_hosts = true;
+        else if (opt.path.empty() && arg[0] != '-')
+            opt.path = arg;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (opt.path.empty() || opt.speed <= 0 || opt.concurrency == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    vector<Entry> entries;
+    if (!load_capture(opt.path, entries))
+        return 1;
+    if (opt.limit > 0 && entries.size() > opt.limit)
+        entries.resize(opt.limit);
+    if (entries.empty())
+    {
+        cerr << "[ERROR] Capture holds no requests" << endl;
+        return 1;
+    }
+
+    start_stub(opt.origin_port);
+    string stub_target = "127.0.0.1:" + to_string(opt.origin_port);
+
+    uint64_t first_us = entries.front().rec.start_us;
+    printf("replaying %zu requests (%.1f s captured) at %.2fx through %s:%d, "
+           "origin stub on port %d\n",
+           entries.size(),
+           (entries.back().rec.start_us - first_us) / 1e6, opt.speed,
+           opt.proxy_host.c_str(), opt.proxy_port, opt.origin_port);
+
+    vector<Result> results(entries.size());
+    atomic<size_t> next(0);
+    Clock::time_point t0 = Clock::now();
+
+    // Each worker takes the next request in arrival order and waits for
+    // its scheduled time; when all workers are busy, requests start late
+    auto worker = [&]
+    {
+        size_t i;
+        while ((i = next.fetch_add(1)) < entries.size())
+        {
+            const Entry &e = entries[i];
+            Clock::time_point due =
+                t0 + chrono::microseconds(
+                         (uint64_t)((e.rec.start_us - first_us) / opt.speed));
+            this_thread::sleep_until(due);
+
+            Clock::time_point started = Clock::now();
+            Result &r = results[i];
+            r.late_us = chrono::duration_cast<chrono::microseconds>(
+                            started - due)
+                            .count();
+
+            string target = opt.keep_hosts
+                                ? e.host + ":" + to_string(e.rec.port)
+                                : stub_target;
+
+            if (e.rec.method == METHOD_CONNECT)
+                run_connect(opt, e, target, started, r);
+            else
+                run_http(opt, e, target, r);
+
+            r.latency_us = chrono::duration_cast<chrono::microseconds>(
+                               Clock::now() - started)
+                               .count();
+        }
+    };
+
+    vector<thread> workers;
+    for (size_t i = 0; i < min(opt.concurrency, entries.size()); ++i)
+        workers.emplace_back(worker);
+    for (auto &t : workers)
+        t.join();
+
+    double wall = chrono::duration<double>(Clock::now() - t0).count();
+
+    // Summary
+    size_t ok = 0, late = 0;
+    uint64_t sent = 0, received = 0, captured_bytes = 0;
+    map<int, size_t> statuses;
+    vector<uint64_t> http_replayed, http_captured;
+    vector<uint64_t> tunnel_replayed, tunnel_captured;
+
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const Entry &e = entries[i];
+        const Result &r = results[i];
+
+        ok += r.ok;
+        late += r.late_us > 10000;
+        sent += r.sent;
+        received += r.received;
+        captured_bytes += e.rec.request_bytes + e.rec.response_bytes;
+        ++statuses[r.status];
+
+        if (!r.ok)
+            continue;
+        if (e.rec.method == METHOD_CONNECT)
+        {
+            tunnel_replayed.push_back(r.latency_us);
+            tunnel_captured.push_back(e.rec.duration_us / opt.speed);
+        }
+        else
+        {
+            http_replayed.push_back(r.latency_us);
+            http_captured.push_back(e.rec.duration_us / opt.speed);
+        }
+    }
+
+    printf("completed  %zu/%zu in %.2f s (%.1f req/s)\n",
+           ok, entries.size(), wall, entries.size() / wall);
+    printf("late       %zu started more than 10 ms after schedule\n", late);
+    printf("bytes      sent %llu, received %llu (captured %llu)\n",
+           (unsigned long long)sent, (unsigned long long)received,
+           (unsigned long long)captured_bytes);
+
+    printf("status    ");
+    for (const auto &entry : statuses)
+        printf(" %s=%zu",
+               entry.first ? to_string(entry.first).c_str() : "error",
+               entry.second);
+    printf("\n");
+
+    print_latencies("http", http_replayed, http_captured);
+    print_latencies("connect", tunnel_replayed, tunnel_captured);
+
+    return ok == entries.size() ? 0 : 2;
+}